@@ -10,9 +10,12 @@ build_dir="./build"
 
 cc=clang
 source_files=("tunnel_runner.c")
-cflags=("-std=c99" "-Wall" "-Wextra" "-Wshadow" "-Wsign-compare" "-Wswitch-enum" "-Wno-missing-braces")
+# -ffp-contract=off: the shape kernels and the --check golden hashes rely on
+# unfused multiply-adds.
+cflags=("-std=c99" "-Wall" "-Wextra" "-Wshadow" "-Wsign-compare" "-Wswitch-enum" "-Wno-missing-braces" "-ffp-contract=off")
 debug_flags=("-g" "-Og" "-Werror")
 release_flags=("-O2" "-Os" "-DTR_LOGLEVEL_DEBUG")
+bench_flags=("-O2" "-g" "-fno-omit-frame-pointer" "-DTR_MICROBENCH" "-DTR_LOGLEVEL_DEBUG")
 # shellcheck disable=SC2207
 ldflags=("-lm" $(sdl2-config --cflags --libs))
 
@@ -36,6 +39,25 @@ build_debug() {
     )
 }
 
+build_bench() {
+    bench_dir="${build_dir}/bench"
+    bench_path="${bench_dir}/${exe_name}"
+    mkdir -p "$bench_dir"
+    (
+        set -x;
+        "$cc" "${cflags[@]}" "${bench_flags[@]}" "${source_files[@]}" -o "$bench_path" "${ldflags[@]}"
+    )
+}
+
+run_check() {
+    build_debug
+    (
+        set -x;
+        "$debug_path" --selftest
+        "$debug_path" --check
+    )
+}
+
 usage() {
     echo "build.sh - Build ${exe_name}"
     echo " "
@@ -45,10 +67,14 @@ usage() {
     echo "-h, --help                show help"
     echo "-r, --release-only        build only release executable"
     echo "-d, --debug-only          build only debug executable"
+    echo "-b, --bench-only          build only the microbenchmark executable"
+    echo "-c, --check               build the debug executable and run its self test and checks"
 }
 
 release_only=false
 debug_only=false
+bench_only=false
+check=false
 
 while [[ $# -gt 0 ]]; do
     case "$1" in
@@ -64,12 +90,30 @@ while [[ $# -gt 0 ]]; do
             debug_only=true
             shift
             ;;
+        -b|--bench-only)
+            bench_only=true
+            shift
+            ;;
+        -c|--check)
+            check=true
+            shift
+            ;;
         *)
             break
             ;;
     esac
 done
 
+if [ "$check" = true ]; then
+    run_check
+    exit 0
+fi
+
+if [ "$bench_only" = true ]; then
+    build_bench
+    exit 0
+fi
+
 if [ "$debug_only" = false ]; then
     build_release
 fi
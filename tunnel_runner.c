@@ -1,12 +1,48 @@
+#define _POSIX_C_SOURCE 200809L
+// NOTE: For syscall(), to read perf counters in the benchmark.
+#define _DEFAULT_SOURCE
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <SDL.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TR_SIMD_X86
+#define TR_TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define TR_SIMD_NEON
+#endif
+
+// NOTE: Never fuse a multiply and an add into one FMA. The shape kernels and
+// the --check golden hashes rely on every product being rounded on its own
+// (build.sh also passes -ffp-contract=off).
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
 
 #define TR_PI32 3.14159265359f
+// Scales the distance table; bigger values make the tunnel rings wider.
+#define TR_TUNNEL_RATIO 32.0f
 
 #define TR_SCREEN_WIDTH 640
 #define TR_SCREEN_HEIGHT 480
@@ -18,12 +54,117 @@
 #define TR_CONTROLLER_STICK_MAX 32770
 #define TR_CONTROLLER_STICK_MIN -32770
 
-// TODO: Should time be stored in a double of seconds?
-#define TR_SECOND 1000
+// NOTE: Time is kept in integer nanoseconds from a monotonic clock.
+#define TR_SECOND 1000000000ull
+#define TR_MILLISECOND 1000000ull
 #define TR_FPS 60
-#define TR_MS_PER_FRAME (TR_SECOND / TR_FPS)
 #define TR_UPDATES_PER_SECOND 120
-#define TR_MS_PER_UPDATE (TR_SECOND / TR_UPDATES_PER_SECOND)
+#define TR_NS_PER_UPDATE (TR_SECOND / TR_UPDATES_PER_SECOND)
+// Sleep-then-spin pacing wakes at least this long before the deadline; the
+// margin grows with the oversleep the OS actually shows us.
+#define TR_PACING_MIN_SPIN_NS (200 * 1000ull)
+#define TR_PACING_MAX_SPIN_NS (4 * TR_MILLISECOND)
+
+#define TR_MAX_THREADS 64
+// Windows a --displays run opens at most, one per display.
+#define TR_MAX_WINDOWS 8
+#define TR_BANDS_PER_THREAD 4
+
+// Wait this long after the last resize event before rebuilding the tables.
+#define TR_RESIZE_DEBOUNCE_MS 50
+
+// Per-resolution arenas are mapped in whole huge pages, on a huge page
+// boundary, and hand out blocks aligned to a cache line.
+#define TR_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define TR_ARENA_ALIGNMENT 64
+
+// Dynamic render scale: drop a level when frames take more than this share
+// of the frame budget, and go back up when the next level is predicted to
+// take less than TR_DYNAMIC_SCALE_RAISE. Frames are only judged once this
+// many have been rendered at the current scale.
+#define TR_DYNAMIC_SCALE_LOWER 0.9
+#define TR_DYNAMIC_SCALE_RAISE 0.7
+#define TR_DYNAMIC_SCALE_SETTLE_FRAMES 30
+
+#define TR_CACHE_MAGIC "TRTABLE"
+#define TR_CACHE_VERSION 3
+#define TR_CACHE_DIR_NAME "tunnel-runner"
+#define TR_MAX_PATH 4096
+
+#define TR_SELFTEST_ITERATIONS 1000
+#define TR_CHECK_FRAMES 7
+
+// Input logs (--record, --replay). Replays step the simulation this many
+// times per frame, whatever the frame rate, so every run renders the same
+// sequence of frames.
+#define TR_INPUT_LOG_MAGIC "TRINPUT"
+#define TR_INPUT_LOG_VERSION 1
+#define TR_INPUT_LOG_MAX_RECORD (6 + 9 * TR_MAX_CONTROLLERS)
+#define TR_INPUT_LOG_MAX_REPEAT 0xFFFF
+#define TR_REPLAY_UPDATES_PER_FRAME (TR_UPDATES_PER_SECOND / TR_FPS)
+
+// Offline export (--export): frames in flight between the renderer and the
+// writer thread, and the default length of an export.
+#define TR_EXPORT_RING_SIZE 4
+#define TR_EXPORT_DEFAULT_SECONDS 10
+
+#define TR_FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define TR_FNV_PRIME 0x100000001b3ull
+
+// Shape engine: the radius breathes by this fraction, once every
+// TR_SHAPE_PULSE_STEPS simulation steps, and cross-section changes ease in
+// by TR_SHAPE_EASE per step.
+#define TR_SHAPE_PULSE 0.15f
+#define TR_SHAPE_PULSE_STEPS 480
+#define TR_SHAPE_EASE 0.05f
+#define TR_SHAPE_TWIST_STEP 0.0002f
+#define TR_SHAPE_RADIUS_STEP 0.1f
+#define TR_SHAPE_ELLIPSE_ASPECT 1.6f
+
+// Animated textures regenerate this many rows per rendered frame, rolling
+// down the texture.
+#define TR_TEXTURE_ANIMATION_ROWS 32
+#define TR_TEXTURE_STEPS_PER_FRAME 2
+#define TR_NOISE_COARSE_CELL 32
+#define TR_NOISE_FINE_CELL 8
+#define TR_NOISE_SEED 0x7E57A11u
+
+#define TR_BENCH_DEFAULT_FRAMES 120
+#define TR_BENCH_MAX_SIZES 16
+// Frames rendered on one thread to count cache misses.
+#define TR_BENCH_COUNTER_FRAMES 8
+
+// Microbenchmarks (--microbench, in TR_MICROBENCH builds): iterations of
+// each render function, and of the slower table and texture generation.
+#define TR_MICROBENCH_RENDER_ITERATIONS 30
+#define TR_MICROBENCH_BUILD_ITERATIONS 5
+#define TR_MICROBENCH_TEXTURE_ITERATIONS 20
+
+// Profiler: events kept per thread (a power of two; older ones are
+// overwritten), and the overlay's bar size in pixels. Stage times shown in
+// the overlay are averaged over roughly TR_PROFILE_AVERAGE_FRAMES frames.
+#define TR_PROFILE_RING_SIZE (1 << 16)
+#define TR_PROFILE_AVERAGE_FRAMES 16
+#define TR_PROFILE_OVERLAY_WIDTH 256
+#define TR_PROFILE_OVERLAY_BAR 4
+#define TR_PROFILE_OVERLAY_MARGIN 8
+
+// Transform table entries: distance in the high byte, angle in the low byte.
+#define TR_TRANSFORM_PACK(distance, angle) ((uint16_t)((((uint32_t)(distance) & 0xFF) << 8) | ((uint32_t)(angle) & 0xFF)))
+#define TR_TRANSFORM_DISTANCE(entry) ((entry) >> 8)
+#define TR_TRANSFORM_ANGLE(entry) ((entry) & 0xFF)
+
+// NOTE: The vector kernels rely on the texture dimensions being 256x256, so
+// that adding the offsets to a packed table entry byte by byte (no carry from
+// angle into distance) yields the texel index directly. The vector texture
+// generators likewise treat a byte's value as its column.
+#if TR_TEX_WIDTH != 256 || TR_TEX_HEIGHT != 256
+#undef TR_SIMD_X86
+#undef TR_SIMD_NEON
+#endif
+
+#define TR_TRIPLE_BUFFER_INDEX_MASK 0x3
+#define TR_TRIPLE_BUFFER_FRESH 0x4
 
 #define TR_LOG_ERR(message, ...) fprintf(stderr, (message), ##__VA_ARGS__)
 
@@ -47,7 +188,110 @@ enum Color
     COLOR_YELLOW,
     COLOR_MAGENTA,
     COLOR_CYAN,
-    COLOR_WHITE
+    COLOR_WHITE,
+    // Gradients
+    COLOR_FIRE,
+    COLOR_OCEAN,
+    // Cycling gradients
+    COLOR_RAINBOW,
+    COLOR_COUNT
+};
+
+enum TexturePattern
+{
+    TEXTURE_XOR,
+    TEXTURE_MOSAIC,
+    TEXTURE_CHECKER,
+    TEXTURE_NOISE,
+    // Animated
+    TEXTURE_PLASMA,
+    // Loaded with --texture-file
+    TEXTURE_IMAGE,
+    TEXTURE_PATTERN_COUNT
+};
+
+enum TextureUpdate
+{
+    // A whole atlas slot generated or loaded.
+    TEXTURE_UPDATE_GENERATE,
+    // Some rows of an animated slot regenerated.
+    TEXTURE_UPDATE_ANIMATE,
+    // Some rows of the active slot run through the palette.
+    TEXTURE_UPDATE_COLORIZE,
+    // Some rows of the active slot copied into Z-order.
+    TEXTURE_UPDATE_SWIZZLE,
+    TEXTURE_UPDATE_COUNT
+};
+
+// How the active slot is stored for the table kernels to fetch from.
+enum TexelLayout
+{
+    // 32-bit colors in row-major order (256 KB): one fetch per pixel.
+    TEXELS_COLORIZED,
+    // 8-bit texels in Morton (Z) order (64 KB) and a 1 KB palette: two
+    // fetches per pixel, but neighbouring texels in both directions share
+    // cache lines, and palette changes don't touch the texels at all.
+    TEXELS_MORTON
+};
+
+struct GradientStop
+{
+    uint8_t position;
+    uint32_t color;
+};
+
+// Maps 8-bit texels to ARGB8888 pixels. Entries are stored twice so that
+// `entries + phase` is a 256-entry table for any phase; cycling the palette
+// just moves that pointer.
+struct Palette
+{
+    uint32_t entries[2 * 256];
+    enum Color color;
+    bool cycles;
+    bool valid;
+};
+
+struct Texture
+{
+    // Atlas of 8-bit texels with a slot per pattern, all generated up front,
+    // so switching patterns never allocates or regenerates anything.
+    uint8_t slots[TEXTURE_PATTERN_COUNT][TR_TEX_HEIGHT][TR_TEX_WIDTH];
+    bool slot_loaded[TEXTURE_PATTERN_COUNT];
+    enum TexturePattern active;
+    // Next row an animated slot regenerates, and the time it was last at.
+    uint32_t animation_row;
+    uint32_t animation_time;
+    // The active slot run through the palette, ready to store as pixels.
+    // Rebuilt lazily by texture_colorize when the slot, color or cycle phase
+    // changes, so rendering is a pure gather. Rows in
+    // [dirty_row_start, dirty_row_end) have changed since then.
+    uint32_t colorized[TR_TEX_HEIGHT][TR_TEX_WIDTH];
+    enum Color colorized_color;
+    uint8_t colorized_phase;
+    bool colorized_valid;
+    uint32_t dirty_row_start;
+    uint32_t dirty_row_end;
+    // With TEXELS_MORTON, texture_colorize keeps the active slot in `morton`
+    // instead, indexed by morton_swizzle, and points `palette` at the
+    // colors. The padding lets the AVX2 kernel gather 32 bits at any texel.
+    enum TexelLayout layout;
+    uint8_t morton[TR_TEX_HEIGHT * TR_TEX_WIDTH + 3];
+    const uint32_t *palette;
+    // What `palette` holds. A palette that doesn't cycle is rebuilt in place
+    // for a new color, so the pointer alone doesn't show the change.
+    enum Color palette_color;
+    uint8_t palette_phase;
+    // Bumped whenever what the kernels fetch (colorized, or morton and
+    // palette) changes.
+    uint32_t version;
+};
+
+struct TextureStats
+{
+    uint64_t updates[TEXTURE_UPDATE_COUNT];
+    uint64_t rows[TEXTURE_UPDATE_COUNT];
+    uint64_t total_ns[TEXTURE_UPDATE_COUNT];
+    uint64_t max_ns[TEXTURE_UPDATE_COUNT];
 };
 
 struct SDLOffscreenBuffer
@@ -58,370 +302,7506 @@ struct SDLOffscreenBuffer
     uint32_t width;
     uint32_t height;
     int32_t pitch;
+    // Fraction of the window size we render at. SDL_RenderCopy stretches
+    // the texture to fill the window.
+    float scale;
+    // Bumped by every resize, which also replaces the texture.
+    uint32_t generation;
 };
 
-struct SDLWindowDimension
+struct ControllerInput
 {
-    int32_t width;
-    int32_t height;
+    bool attached;
+    bool start;
+    bool back;
+    bool a_button;
+    bool b_button;
+    bool x_button;
+    bool y_button;
+    bool left_shoulder;
+    bool right_shoulder;
+    int16_t stick_leftx;
+    int16_t stick_lefty;
+    int16_t stick_rightx;
+    int16_t stick_righty;
 };
 
-struct TransformData
+enum CrossSection
 {
-    int32_t width;
-    int32_t height;
-    int32_t **distance_table;
-    int32_t **angle_table;
-    int32_t look_shift_x;
-    int32_t look_shift_y;
+    CROSS_SECTION_CIRCLE,
+    CROSS_SECTION_ELLIPSE,
+    CROSS_SECTION_SQUARE,
+    CROSS_SECTION_COUNT
 };
 
-static struct SDLOffscreenBuffer global_back_buffer;
-static SDL_GameController *controller_handles[TR_MAX_CONTROLLERS];
-static SDL_Haptic *rumble_handles[TR_MAX_CONTROLLERS];
-static struct TransformData transform;
+// Geometry of the tunnel, for the shape engine.
+struct TunnelShape
+{
+    // Like TR_TUNNEL_RATIO: bigger values make the rings wider.
+    float radius;
+    // Extra angle units per unit of depth.
+    float twist;
+    // Vertical stretch of the cross-section; above 1 is a wide ellipse.
+    float aspect;
+    // 0 for a round cross-section, 1 for a square one.
+    float squareness;
+};
 
+// Everything one simulation step reads from the keyboard and controllers.
+struct InputState
+{
+    bool key_a;
+    bool key_d;
+    bool key_w;
+    bool key_s;
+    bool key_left;
+    bool key_right;
+    bool key_up;
+    bool key_down;
+    // 0 for none, otherwise 1 + the enum Color picked with the number keys.
+    uint8_t color_key;
+    // 0 for none, otherwise 1 + the enum TexturePattern picked with F1-F6.
+    uint8_t texture_key;
+    bool key_q;
+    bool key_e;
+    bool key_r;
+    bool key_f;
+    // 0 for none, otherwise 1 + the enum CrossSection picked with Z, X, C.
+    uint8_t cross_section_key;
+    struct ControllerInput controllers[TR_MAX_CONTROLLERS];
+};
 
-uint64_t
-get_current_time_ms(void)
+// Everything the renderer needs from the simulation.
+struct SimState
 {
-    struct timespec current;
-    clock_gettime(CLOCK_MONOTONIC, &current);
-    uint64_t milliseconds = ((current.tv_sec * 1000000000) + current.tv_nsec) / 1000000;
-    return milliseconds;
-}
+    int32_t rotation_offset;
+    int32_t translation_offset;
+    // Right stick position; mapped onto the look shift by the renderer.
+    int16_t look_x;
+    int16_t look_y;
+    enum Color color_choice;
+    // Advances every step; cycling palettes rotate by it.
+    uint8_t palette_phase;
+    enum TexturePattern texture_choice;
+    // Steps since the simulation started; drives animated textures.
+    uint32_t tick;
+    enum CrossSection cross_section;
+    struct TunnelShape shape;
+    // Controllers that should be rumbling. The main thread starts and stops
+    // them, since SDL's haptic calls don't belong on the simulation thread.
+    bool rumble[TR_MAX_CONTROLLERS];
+    bool quit;
+};
 
+// Lock-free single-producer, single-consumer handoff of the latest SimState.
+// The writer and reader each own one slot; the third is swapped between them
+// atomically.
+struct TripleBuffer
+{
+    struct SimState slots[3];
+    SDL_atomic_t middle;
+    int32_t write_index;
+    int32_t read_index;
+};
 
-void
-render_texture(
-        struct SDLOffscreenBuffer buffer,
-        uint32_t texture[TR_TEX_HEIGHT][TR_TEX_WIDTH],
-        int32_t x_offset,
-        int32_t y_offset,
-        enum Color color_choice)
+struct Simulation
 {
-    uint8_t *row = (uint8_t *)buffer.memory;
+    SDL_Thread *thread;
+    SDL_atomic_t stop;
+    // Owned by the simulation thread, or by the main thread when replaying
+    // (which runs no simulation thread).
+    struct SimState state;
+    struct TripleBuffer states;
+    // The input the next updates use. SDL's keyboard and controller state is
+    // only safe to read on the main thread, which pumps the events that
+    // update it, so the main thread samples it into here every frame.
+    SDL_mutex *input_lock;
+    struct InputState input;
+};
 
-    for (uint32_t y = 0; y < buffer.height; ++y)
-    {
-        uint32_t *pixel = (uint32_t *)row;
-        for (uint32_t x = 0; x < buffer.width; ++x)
-        {
-            uint8_t color = texture[
-                (uint32_t)(y + y_offset) % TR_TEX_HEIGHT
-            ]
-            [
-                (uint32_t)(x + x_offset) % TR_TEX_WIDTH
-            ];
-            uint32_t red = color << 16;
-            uint32_t green = color << 8;
-            uint32_t blue = color;
+struct InputLogHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t updates_per_second;
+    // Texture the recording started with (--texture).
+    uint32_t texture_choice;
+};
 
-            switch(color_choice)
-            {
-                case COLOR_GREEN:
-                {
-                    *pixel++ = green;
-                } break;
-                case COLOR_RED:
-                {
-                    *pixel++ = red;
-                } break;
-                case COLOR_BLUE:
-                {
-                    *pixel++ = blue;
-                } break;
-                case COLOR_YELLOW:
-                {
-                    *pixel++ = red | green;
-                } break;
-                case COLOR_MAGENTA:
-                {
-                    *pixel++ = red | blue;
-                } break;
-                case COLOR_CYAN:
-                {
-                    *pixel++ = blue | green;
-                } break;
-                case COLOR_WHITE:
-                {
-                    *pixel++ = red | green | blue;
-                } break;
-                default:
-                {
-                    TR_LOG_ERR("Invalid color enum value: %d\n", color_choice);
-                    *pixel++ = red | green | blue;
-                } break;
-            }
-        }
+// A per-update log of InputState. Each entry is a little-endian repeat
+// count followed by one encoded input, which the next `count` updates all
+// saw: 6 bytes of keys and attached controllers, then 9 bytes (buttons and
+// sticks) for each attached controller.
+struct InputLog
+{
+    FILE *file;
+    bool replaying;
+    const char *path;
+    // The input being repeated: encoded when recording, decoded when
+    // replaying.
+    uint8_t record[TR_INPUT_LOG_MAX_RECORD];
+    uint32_t record_size;
+    struct InputState input;
+    // Updates the record covers so far (recording) or has left (replaying).
+    uint32_t repeat;
+    uint64_t updates;
+    // Hash of every frame rendered during a replay, chained in order.
+    uint64_t frame_hash;
+    uint64_t frames;
+};
 
-        row += buffer.pitch;
-    }
-}
+enum ExportFormat
+{
+    // One YUV4MPEG2 (4:4:4) file.
+    EXPORT_Y4M,
+    // A directory of numbered PPM images.
+    EXPORT_PPM
+};
 
+// Frames rendered by --export are handed to a writer thread through a ring
+// of TR_EXPORT_RING_SIZE buffers, so that rendering only waits on disk when
+// the whole ring is waiting to be written.
+struct FrameExporter
+{
+    enum ExportFormat format;
+    const char *path;
+    FILE *file;
+    uint32_t width;
+    uint32_t height;
+    uint32_t fps;
+    uint8_t *frames[TR_EXPORT_RING_SIZE];
+    // Y, U and V planes for the frame being written to a Y4M file.
+    uint8_t *planes;
+    SDL_sem *free_frames;
+    SDL_sem *ready_frames;
+    SDL_Thread *writer;
+    // Frames handed to the writer so far.
+    SDL_atomic_t rendered;
+    SDL_atomic_t failed;
+    uint64_t render_waits;
+};
 
-void
-render_tunnel(
-        struct SDLOffscreenBuffer buffer,
-        uint32_t texture[TR_TEX_HEIGHT][TR_TEX_WIDTH],
-        int32_t rotation_offset,
-        int32_t translation_offset,
-        enum Color color_choice)
+enum PresentMode
 {
-    uint8_t *row = (uint8_t *)buffer.memory;
+    // Render into buffer.memory, then copy it into the texture with
+    // SDL_UpdateTexture.
+    PRESENT_UPDATE,
+    // Render straight into the pixels returned by SDL_LockTexture.
+    PRESENT_LOCK,
+    PRESENT_MODE_COUNT
+};
 
-    for (uint32_t y = 0; y < buffer.height; ++y)
-    {
-        uint32_t *pixel = (uint32_t *)row;
-        for (uint32_t x = 0; x < buffer.width; ++x)
-        {
-            uint32_t texel_y = (uint32_t)(transform.distance_table[y + transform.look_shift_y][x + transform.look_shift_x] + translation_offset) % TR_TEX_HEIGHT;
-            uint32_t texel_x = (uint32_t)(transform.angle_table[y + transform.look_shift_y][x + transform.look_shift_x] + rotation_offset) % TR_TEX_WIDTH;
+// Bytes we copy into the texture ourselves, per present mode. (The renderer
+// may still upload a locked texture to the GPU on unlock; that isn't counted.)
+struct PresentStats
+{
+    uint64_t frames[PRESENT_MODE_COUNT];
+    uint64_t bytes_copied[PRESENT_MODE_COUNT];
+};
 
-            assert(texel_x >= 0 && texel_x < TR_TEX_WIDTH);
-            assert(texel_y >= 0 && texel_y < TR_TEX_HEIGHT);
+enum PacingMode
+{
+    // Let SDL_RENDERER_PRESENTVSYNC block in SDL_RenderPresent.
+    PACING_VSYNC,
+    // Sleep until shortly before the frame deadline, then spin up to it.
+    PACING_SPIN,
+    // Render as fast as possible.
+    PACING_UNCAPPED
+};
 
-            uint8_t texel = texture[texel_y][texel_x];
+struct FramePacer
+{
+    enum PacingMode mode;
+    uint64_t frame_ns;
+    uint64_t deadline_ns;
+    // Adaptive sleep: how long before the deadline we stop sleeping and
+    // start spinning, tracked from how late sleeps actually wake up.
+    uint64_t spin_ns;
+    uint64_t previous_frame_end_ns;
 
-            uint32_t red = texel << 16;
-            uint32_t green = texel << 8;
-            uint32_t blue = texel;
+    // Frame interval statistics, for the jitter report.
+    uint64_t interval_count;
+    uint64_t interval_min_ns;
+    uint64_t interval_max_ns;
+    double interval_sum_ms;
+    double interval_sum_sq_ms;
+    double deviation_sum_ms;
+    uint64_t missed_deadlines;
+};
 
-            switch(color_choice)
-            {
-                case COLOR_GREEN:
-                {
-                    *pixel++ = green;
-                } break;
-                case COLOR_RED:
-                {
-                    *pixel++ = red;
-                } break;
-                case COLOR_BLUE:
-                {
-                    *pixel++ = blue;
-                } break;
-                case COLOR_YELLOW:
-                {
-                    *pixel++ = red | green;
-                } break;
-                case COLOR_MAGENTA:
-                {
-                    *pixel++ = red | blue;
-                } break;
-                case COLOR_CYAN:
-                {
-                    *pixel++ = blue | green;
-                } break;
-                case COLOR_WHITE:
-                {
-                    *pixel++ = red | green | blue;
-                } break;
-                default:
-                {
-                    *pixel++ = red | green | blue;
-                    TR_LOG_ERR("Invalid color enum value: %d\n", color_choice);
-                } break;
-            }
-        }
-        row += global_back_buffer.pitch;
-    }
-}
+struct SDLWindowDimension
+{
+    int32_t width;
+    int32_t height;
+};
 
+// Picks the render scale from measured frame times (--scale auto).
+struct DynamicScale
+{
+    bool enabled;
+    uint32_t level;
+    uint64_t budget_ns;
+    // Moving average of the time spent on each frame, not counting pacing.
+    uint64_t average_ns;
+    uint32_t settled_frames;
+    uint64_t changes;
+};
 
-struct SDLWindowDimension
-sdl_get_window_dimension(SDL_Window *window)
+enum ProfileStage
 {
-    int w = 0;
-    int h = 0;
-    SDL_GetWindowSize(window, &w, &h);
-    struct SDLWindowDimension result = { .width = w, .height = h };
-    return result;
-}
+    PROFILE_EVENTS,
+    PROFILE_UPDATE,
+    // Picking up rebuilt tables and moving the view.
+    PROFILE_TABLES,
+    PROFILE_TEXTURE,
+    PROFILE_RENDER,
+    // SDL_UnlockTexture or SDL_UpdateTexture.
+    PROFILE_UPLOAD,
+    // Frame pacing.
+    PROFILE_WAIT,
+    // SDL_RenderCopy and SDL_RenderPresent.
+    PROFILE_PRESENT,
+    PROFILE_STAGE_COUNT
+};
 
+enum ProfileTrack
+{
+    PROFILE_TRACK_MAIN,
+    PROFILE_TRACK_SIMULATION,
+    PROFILE_TRACK_COUNT
+};
 
-void
-sdl_resize_texture(struct SDLOffscreenBuffer *buffer, SDL_Renderer *renderer, int32_t window_width, int32_t window_height)
+struct ProfileEvent
 {
-    if (buffer->memory)
-    {
-        free(buffer->memory);
-    }
+    uint64_t start_ns;
+    uint32_t duration_ns;
+    // Frame on the main track, update tick on the simulation track.
+    uint32_t frame;
+    uint32_t stage;
+};
 
-    if (buffer->texture)
-    {
-        SDL_DestroyTexture(buffer->texture);
-    }
+// Only ever written by the thread the track belongs to.
+struct ProfileRing
+{
+    struct ProfileEvent events[TR_PROFILE_RING_SIZE];
+    uint64_t count;
+    uint32_t frame;
+};
 
-    if (transform.distance_table)
-    {
-        for (int32_t y = 0; y < transform.height; ++y)
-        {
-            free(transform.distance_table[y]);
-        }
-        free(transform.distance_table);
-    }
-    if (transform.angle_table)
-    {
-        for (int32_t y = 0; y < transform.height; ++y)
-        {
-            free(transform.angle_table[y]);
-        }
-        free(transform.angle_table);
-    }
+struct Profiler
+{
+    // Set before any thread starts and never changed after, so it can be
+    // read without synchronization.
+    bool enabled;
+    bool overlay;
+    const char *output_prefix;
+    uint64_t start_ns;
+    struct ProfileRing rings[PROFILE_TRACK_COUNT];
+    // Time spent in each stage so far this frame, over the recent frames
+    // shown by the overlay, and over every frame.
+    uint64_t frame_ns[PROFILE_STAGE_COUNT];
+    double average_ms[PROFILE_STAGE_COUNT];
+    uint64_t total_ns[PROFILE_STAGE_COUNT];
+    // Update time added up by the simulation thread since the last frame.
+    SDL_atomic_t update_ns;
+};
 
-    buffer->texture = SDL_CreateTexture(
-            renderer,
-            SDL_PIXELFORMAT_ARGB8888,
-            SDL_TEXTUREACCESS_STREAMING,
-            window_width, window_height);
+enum TransformLayout
+{
+    // Entries for the whole width x height grid.
+    TRANSFORM_FULL,
+    // Entries only for the quadrant right of and below the center, which
+    // the others mirror: (width / 2 + 1) x (height / 2 + 1) entries, a
+    // quarter of the full grid.
+    TRANSFORM_QUADRANT
+};
 
-    buffer->width = window_width;
-    buffer->height = window_height;
-    buffer->pitch = window_width * TR_BYTES_PER_PIXEL;
+// One allocation for everything whose size depends on a back buffer's
+// resolution: the buffer itself, its distance/angle tables and the delta
+// renderer's index cache. A resize that fits reuses it instead of freeing
+// and allocating each of them again.
+struct Arena
+{
+    uint8_t *base;
+    size_t capacity;
+    size_t used;
+    // Set if `base` is an anonymous mapping, which the kernel may back with
+    // huge pages, rather than the malloc'd fallback.
+    bool mapped;
+};
 
-    buffer->memory = malloc(window_width * window_height * TR_BYTES_PER_PIXEL);
+struct TransformData
+{
+    // The grid the look shift moves the window around in, twice the window
+    // size in each dimension.
+    int32_t width;
+    int32_t height;
+    enum TransformLayout layout;
+    // Dimensions of `table` itself.
+    int32_t stride;
+    int32_t rows;
+    // One contiguous, row-major table. Each entry packs the distance (high
+    // byte) and the angle (low byte), both reduced modulo 256, so an entry
+    // is already a texel index into the 256x256 texture.
+    uint16_t *table;
+    // Non-null if `table` points into a read-only mapping of a cache file
+    // instead of a malloc'd block.
+    void *mapping;
+    size_t mapping_size;
+    // Set if `table` was taken from an arena, which owns it.
+    bool table_in_arena;
+    int32_t look_shift_x;
+    int32_t look_shift_y;
+    // Window pixels per table entry, so that a reduced render scale shows
+    // the same tunnel, just coarser.
+    float pixel_size;
+};
 
-    transform.width = 2 * window_width;
-    transform.height = 2 * window_height;
-    transform.look_shift_x = window_width / 2;
-    transform.look_shift_y = window_height / 2;
-    transform.distance_table = malloc(transform.height * sizeof(int32_t *));
-    transform.angle_table = malloc(transform.height * sizeof(int32_t *));
+// On-disk transform cache file layout: this header, then the packed table.
+struct TransformCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    int32_t window_width;
+    int32_t window_height;
+    float ratio;
+    uint32_t tex_width;
+    uint32_t tex_height;
+    float pixel_size;
+    uint32_t layout;
+};
 
-    for (int32_t y = 0; y < transform.height; ++y)
-    {
-        transform.distance_table[y] = malloc(transform.width * sizeof(int32_t));
-        transform.angle_table[y] = malloc(transform.width * sizeof(int32_t));
-    }
+// Rebuilds transform tables on a background thread after the window is
+// resized. Rendering keeps using the old tables (stretched to the new window
+// size) until the new ones are swapped in by transform_rebuilder_poll.
+struct TransformRebuilder
+{
+    SDL_Thread *thread;
+    SDL_mutex *lock;
+    SDL_cond *changed;
+    // Protected by `lock`:
+    int32_t requested_width;
+    int32_t requested_height;
+    float requested_scale;
+    bool has_request;
+    bool has_result;
+    bool quit;
+    struct TransformData result;
+    // Holds `result`'s table, and gets its back buffer and index cache when
+    // it's swapped in.
+    struct Arena result_arena;
+    int32_t result_width;
+    int32_t result_height;
+    float result_scale;
+    // The arena swapped out by the last resize, reused by the next build.
+    struct Arena spare_arena;
+};
 
-    // Make distance and angle transformation tables
-    for (int32_t y = 0; y < transform.height; ++y)
-    {
-        for (int32_t x = 0; x < transform.width; ++x)
-        {
-            int32_t dist_from_center_x = x - window_width;
-            int32_t dist_from_center_y = y - window_height;
-            float dist_from_center = sqrtf((float)(dist_from_center_x * dist_from_center_x + dist_from_center_y * dist_from_center_y));
-            float angle_from_positive_x_axis = atan2f((float)dist_from_center_y, (float)dist_from_center_x) / TR_PI32;
+// Transform tables for one back buffer size and scale, shared by every
+// window of a --displays run that renders at it.
+struct SharedTransform
+{
+    struct TransformData data;
+    struct Arena arena;
+    int32_t width;
+    int32_t height;
+    float scale;
+    // Windows using these tables; the slot is free at 0.
+    uint32_t references;
+};
 
-            float ratio = 32.0f;
-            transform.distance_table[y][x] = (int32_t)(ratio * TR_TEX_HEIGHT / dist_from_center) % TR_TEX_HEIGHT;
-            transform.angle_table[y][x] = (int32_t)(0.5f * TR_TEX_WIDTH * angle_from_positive_x_axis);
-        }
-    }
-}
+typedef void (*TaskFunction)(void *data, uint32_t task_index);
 
+struct ThreadPool
+{
+    // The calling thread always works on tasks too, so a pool of N threads
+    // has N - 1 workers.
+    SDL_Thread *workers[TR_MAX_THREADS];
+    uint32_t worker_count;
+    SDL_sem *work_ready;
+    SDL_sem *work_done;
+    SDL_atomic_t next_task;
+    uint32_t task_count;
+    TaskFunction task_function;
+    void *task_data;
+    bool quit;
+};
 
-void
-sdl_update_window(SDL_Renderer *renderer, struct SDLOffscreenBuffer buffer)
+struct RenderTunnelJob
 {
-    if (SDL_UpdateTexture(buffer.texture, 0, buffer.memory, buffer.pitch))
-    {
-        TR_LOG_ERR("SDL_UpdateTexture failed: %s\n", SDL_GetError());
-    }
+    struct SDLOffscreenBuffer buffer;
+    const struct Texture *texture;
+    int32_t rotation_offset;
+    int32_t translation_offset;
+    uint32_t band_height;
+    // Non-null to draw from a DeltaRenderer's index cache instead.
+    const uint16_t *indices;
+};
 
-    SDL_RenderCopy(renderer, buffer.texture, 0, 0);
-    SDL_RenderPresent(renderer);
-}
+// Renders `count` tunnel pixels from the table entries table_row[0],
+// table_row[step], table_row[2 * step], ..., where `step` is 1 or -1. Each
+// entry is XORed with `entry_mask` before the offsets are added, which lets
+// the quadrant table layout stand in for the mirrored quadrants.
+typedef void (*TunnelRowFunction)(
+        uint32_t *pixel,
+        const uint16_t *table_row,
+        int32_t step,
+        uint32_t count,
+        const uint32_t *texture,
+        uint16_t entry_mask,
+        int32_t rotation_offset,
+        int32_t translation_offset);
 
+// The same, fetching from a TEXELS_MORTON texture.
+typedef void (*TunnelMortonRowFunction)(
+        uint32_t *pixel,
+        const uint16_t *table_row,
+        int32_t step,
+        uint32_t count,
+        const uint8_t *texels,
+        const uint32_t *palette,
+        uint16_t entry_mask,
+        int32_t rotation_offset,
+        int32_t translation_offset);
 
-bool
-handle_event(SDL_Event *event)
+enum TunnelEngine
 {
-    bool should_quit = false;
+    // Look up distance and angle in the transform tables.
+    ENGINE_TABLE,
+    // Evaluate them per pixel from a TunnelShape.
+    ENGINE_SHAPE,
+    ENGINE_COUNT
+};
 
-    switch(event->type)
-    {
-        case SDL_QUIT:
-        {
-            TR_LOG_DBG("SDL_QUIT\n");
-            should_quit = true;
-        } break;
+// A TunnelShape as the shape kernels consume it, for one frame.
+struct TunnelShapeParams
+{
+    // radius * TR_TEX_HEIGHT
+    float depth_scale;
+    float twist;
+    float aspect;
+    float squareness;
+    // Distance between neighbouring pixels, in window pixels.
+    float pixel_size;
+    // Where the back buffer's top left pixel is relative to the center of
+    // the tunnel, in back buffer pixels. The look shift moves it.
+    int32_t origin_x;
+    int32_t origin_y;
+};
 
-        case SDL_WINDOWEVENT:
-        {
-            switch(event->window.event)
+// Renders `count` pixels of one row straight from the tunnel geometry. Pixel
+// i is at (dx + i * pixel_size, dy) from the center of the tunnel.
+typedef void (*TunnelShapeRowFunction)(
+        uint32_t *pixel,
+        uint32_t count,
+        float dx,
+        float dy,
+        const struct TunnelShapeParams *params,
+        const uint32_t *texture,
+        int32_t rotation_offset,
+        int32_t translation_offset);
+
+struct TunnelKernel
+{
+    const char *name;
+    TunnelRowFunction function;
+    TunnelMortonRowFunction morton_function;
+    TunnelShapeRowFunction shape_function;
+    SDL_bool (*is_supported)(void);
+};
+
+// Everything besides the rotation and translation that decides which texel
+// each pixel shows. Frames with the same geometry differ only by a constant
+// added to every pixel's texel index.
+struct FrameGeometry
+{
+    enum TunnelEngine engine;
+    uint32_t width;
+    uint32_t height;
+    // The table engine's view. The shape engine's is in `shape`.
+    float pixel_size;
+    int32_t look_shift_x;
+    int32_t look_shift_y;
+    // Only compared for the shape engine.
+    struct TunnelShapeParams shape;
+};
+
+// What a presented frame was drawn from.
+struct FrameKey
+{
+    struct FrameGeometry geometry;
+    uint32_t buffer_generation;
+    uint32_t texture_version;
+    int32_t rotation_offset;
+    int32_t translation_offset;
+    bool overlay;
+};
+
+// Redraws only what changed (--redraw delta). A frame identical to the one
+// on screen isn't drawn or presented at all. While the geometry holds still,
+// the tunnel is drawn from a cache of each pixel's texel index, so a frame
+// that only moves through the tunnel or rolls is one add and one gather per
+// pixel, whatever the engine or table layout.
+struct DeltaRenderer
+{
+    bool enabled;
+    // TR_TRANSFORM_PACK(distance, angle) of every pixel at zero rotation and
+    // translation, for the `cached` geometry, width entries per row. Sized
+    // for the 32-bit pixels the cache is rendered as before it's narrowed.
+    uint16_t *indices;
+    size_t capacity;
+    // Set if `indices` was taken from an arena, which owns it.
+    bool indices_in_arena;
+    bool indices_valid;
+    struct FrameGeometry cached;
+    // The cache is only built for geometry that has held for a frame, so a
+    // view that keeps moving doesn't pay for a rebuild every frame.
+    struct FrameGeometry previous;
+    struct FrameKey presented;
+    bool presented_valid;
+    uint64_t full_frames;
+    uint64_t delta_frames;
+    uint64_t skipped_frames;
+    uint64_t cache_builds;
+};
+
+// One window of a --displays run, with everything that depends on its size.
+// The simulation, texture and thread pool are shared by all of them.
+struct TunnelWindow
+{
+    SDL_Window *window;
+    SDL_Renderer *renderer;
+    uint32_t id;
+    struct SDLOffscreenBuffer buffer;
+    struct SharedTransform *tables;
+    struct DeltaRenderer delta;
+    // The buffer and the index cache; the tables have their own.
+    struct Arena arena;
+};
+
+enum CheckView
+{
+    CHECK_TUNNEL,
+    // render_texture, the flat debug view.
+    CHECK_TEXTURE
+};
+
+// One input to the frame sequence --check renders for every scene.
+struct CheckFrame
+{
+    int32_t rotation_offset;
+    int32_t translation_offset;
+    int16_t look_x;
+    int16_t look_y;
+    enum Color color_choice;
+    uint8_t palette_phase;
+};
+
+struct CheckScene
+{
+    const char *name;
+    enum CheckView view;
+    enum TunnelEngine engine;
+    int32_t window_width;
+    int32_t window_height;
+    float scale;
+    enum TexturePattern pattern;
+    // Hash of the reference rendering of every frame, chained in order.
+    uint64_t golden;
+};
+
+#ifdef TR_MICROBENCH
+enum PerfCounter
+{
+    PERF_COUNTER_CYCLES,
+    PERF_COUNTER_INSTRUCTIONS,
+    PERF_COUNTER_LLC_MISSES,
+    PERF_COUNTER_BRANCH_MISSES,
+    PERF_COUNTER_COUNT
+};
+
+// Hardware counters for the calling thread; fds are -1 where unavailable.
+struct PerfCounters
+{
+    int fds[PERF_COUNTER_COUNT];
+    uint64_t start[PERF_COUNTER_COUNT];
+};
+
+// Everything the microbenchmarks share: a frame at the benchmark size, and
+// a row-padded copy of it standing in for the streaming texture.
+struct MicrobenchContext
+{
+    struct SDLOffscreenBuffer buffer;
+    uint8_t *upload;
+    int32_t upload_pitch;
+    // Built by the table generation benchmark, apart from `transform`.
+    struct TransformData tables;
+};
+
+struct Microbench
+{
+    const char *name;
+    // Called before timing, to put the globals in shape; may be null.
+    void (*setup)(struct MicrobenchContext *context, int32_t argument);
+    void (*run)(struct MicrobenchContext *context, int32_t argument, uint32_t iteration);
+    int32_t argument;
+    uint32_t iterations;
+    // Work is counted in texels of the 256x256 texture instead of pixels.
+    bool per_texel;
+};
+#endif
+
+static struct SDLOffscreenBuffer global_back_buffer;
+static SDL_GameController *controller_handles[TR_MAX_CONTROLLERS];
+static SDL_Haptic *rumble_handles[TR_MAX_CONTROLLERS];
+static struct TransformData transform;
+// The main window's back buffer, tables and index cache.
+static struct Arena resolution_arena;
+static enum TunnelEngine tunnel_engine = ENGINE_TABLE;
+static struct TunnelShapeParams tunnel_shape;
+static struct ThreadPool global_thread_pool;
+static bool transform_cache_enabled = true;
+static enum TransformLayout transform_layout = TRANSFORM_QUADRANT;
+static struct TransformRebuilder transform_rebuilder;
+static enum PresentMode present_mode = PRESENT_LOCK;
+static struct PresentStats present_stats;
+static struct Simulation global_simulation;
+static struct FramePacer global_frame_pacer;
+static struct Palette global_palette;
+static float render_scale = 1.0f;
+static struct DynamicScale global_dynamic_scale;
+static const float render_scale_levels[] = { 1.0f, 0.75f, 0.5f, 0.375f, 0.25f };
+#define TR_RENDER_SCALE_LEVEL_COUNT (sizeof(render_scale_levels) / sizeof(render_scale_levels[0]))
+static struct Texture global_texture;
+static struct TextureStats texture_stats;
+static struct Profiler global_profiler;
+static struct InputLog input_log;
+// One sine period over 256 entries, and two periods, each stored twice so a
+// phase offset plus a column never wraps.
+static uint8_t texture_sine[2 * TR_TEX_WIDTH];
+static uint8_t texture_sine_fast[2 * TR_TEX_WIDTH];
+static const struct TunnelKernel *tunnel_kernel;
+static struct DeltaRenderer global_delta_renderer = { .enabled = true };
+// Its colorized texels are their own texel indices, to render the index
+// cache with.
+static struct Texture index_texture;
+// One spare, so a window can acquire its new tables before releasing its old.
+static struct SharedTransform shared_transforms[TR_MAX_WINDOWS + 1];
+static struct TunnelWindow tunnel_windows[TR_MAX_WINDOWS];
+static uint32_t tunnel_window_count;
+
+
+uint64_t
+get_current_time_ns(void)
+{
+    struct timespec current;
+    clock_gettime(CLOCK_MONOTONIC, &current);
+    uint64_t nanoseconds = ((uint64_t)current.tv_sec * TR_SECOND) + current.tv_nsec;
+    return nanoseconds;
+}
+
+
+void
+sleep_ns(uint64_t nanoseconds)
+{
+    struct timespec duration;
+    duration.tv_sec = (time_t)(nanoseconds / TR_SECOND);
+    duration.tv_nsec = (long)(nanoseconds % TR_SECOND);
+    while (nanosleep(&duration, &duration) != 0 && errno == EINTR)
+    {
+    }
+}
+
+
+size_t
+arena_align(size_t size)
+{
+    return (size + TR_ARENA_ALIGNMENT - 1) & ~(size_t)(TR_ARENA_ALIGNMENT - 1);
+}
+
+
+void
+arena_release(struct Arena *arena)
+{
+    if (arena->mapped)
+    {
+        munmap(arena->base, arena->capacity);
+    }
+    else
+    {
+        free(arena->base);
+    }
+    memset(arena, 0, sizeof(*arena));
+}
+
+
+// An anonymous mapping of `size` bytes, a multiple of the huge page size,
+// that starts on a huge page boundary. Maps one huge page more than that and
+// unmaps the slack on either side. Returns null if the mapping fails.
+uint8_t *
+arena_map(size_t size)
+{
+    size_t mapping_size = size + TR_HUGE_PAGE_SIZE;
+    uint8_t *mapping = mmap(0, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    uintptr_t aligned = ((uintptr_t)mapping + TR_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(TR_HUGE_PAGE_SIZE - 1);
+    uint8_t *base = (uint8_t *)aligned;
+    size_t head = (size_t)(base - mapping);
+    size_t tail = mapping_size - head - size;
+    if (head > 0)
+    {
+        munmap(mapping, head);
+    }
+    if (tail > 0)
+    {
+        munmap(base + size, tail);
+    }
+
+#ifdef MADV_HUGEPAGE
+    // NOTE: Only a hint. Without transparent huge pages the arena is backed
+    // by normal pages, and nothing else changes.
+    madvise(base, size, MADV_HUGEPAGE);
+#endif
+    return base;
+}
+
+
+// Empty the arena and make sure it has room for `size` bytes. Keeps the
+// current allocation if it's big enough; otherwise maps a new one, or
+// mallocs it if the mapping fails, and frees the old. Returns false if there
+// isn't memory for it either way, and leaves the arena and everything in it
+// as it was.
+bool
+arena_reserve(struct Arena *arena, size_t size)
+{
+    if (size <= arena->capacity)
+    {
+        arena->used = 0;
+        return true;
+    }
+
+    struct Arena grown = {0};
+    size_t capacity = (size + TR_HUGE_PAGE_SIZE - 1) & ~(size_t)(TR_HUGE_PAGE_SIZE - 1);
+    grown.base = arena_map(capacity);
+    if (grown.base)
+    {
+        grown.capacity = capacity;
+        grown.mapped = true;
+    }
+    else
+    {
+        TR_LOG_DBG("Arena: mmap failed (%s), falling back to malloc\n", strerror(errno));
+        void *memory = 0;
+        if (posix_memalign(&memory, TR_ARENA_ALIGNMENT, size) != 0)
+        {
+            TR_LOG_ERR("Out of memory for %.1f MiB of back buffer and tables\n", (double)size / (1024.0 * 1024.0));
+            return false;
+        }
+        grown.base = memory;
+        grown.capacity = size;
+    }
+
+    arena_release(arena);
+    *arena = grown;
+    return true;
+}
+
+
+// `size` bytes from an arena reserved with room for them, aligned to a
+// cache line.
+void *
+arena_push(struct Arena *arena, size_t size)
+{
+    size_t start = arena_align(arena->used);
+    assert(start + size <= arena->capacity);
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+
+const char *
+profile_stage_name(enum ProfileStage stage)
+{
+    switch(stage)
+    {
+        case PROFILE_EVENTS: return "events";
+        case PROFILE_UPDATE: return "update";
+        case PROFILE_TABLES: return "tables";
+        case PROFILE_TEXTURE: return "texture";
+        case PROFILE_RENDER: return "render";
+        case PROFILE_UPLOAD: return "upload";
+        case PROFILE_WAIT: return "wait";
+        case PROFILE_PRESENT: return "present";
+        case PROFILE_STAGE_COUNT: break;
+    }
+    return "unknown";
+}
+
+
+const char *
+profile_track_name(enum ProfileTrack track)
+{
+    return track == PROFILE_TRACK_MAIN ? "main" : "simulation";
+}
+
+
+void
+profile_init(const char *output_prefix, bool overlay)
+{
+    memset(&global_profiler, 0, sizeof(global_profiler));
+    global_profiler.enabled = true;
+    global_profiler.overlay = overlay;
+    global_profiler.output_prefix = output_prefix;
+    global_profiler.start_ns = get_current_time_ns();
+}
+
+
+// Timers are a pair of calls around the code being measured:
+//
+//     uint64_t start_ns = profile_begin();
+//     ...
+//     profile_end(PROFILE_TRACK_MAIN, PROFILE_RENDER, start_ns);
+//
+// With the profiler off, both are a single untaken branch.
+uint64_t
+profile_begin(void)
+{
+    return global_profiler.enabled ? get_current_time_ns() : 0;
+}
+
+
+void
+profile_end(enum ProfileTrack track, enum ProfileStage stage, uint64_t start_ns)
+{
+    if (!global_profiler.enabled)
+    {
+        return;
+    }
+
+    uint64_t duration_ns = get_current_time_ns() - start_ns;
+    struct ProfileRing *ring = &global_profiler.rings[track];
+    struct ProfileEvent *event = &ring->events[ring->count & (TR_PROFILE_RING_SIZE - 1)];
+    event->start_ns = start_ns;
+    event->duration_ns = duration_ns > UINT32_MAX ? UINT32_MAX : (uint32_t)duration_ns;
+    event->frame = ring->frame;
+    event->stage = stage;
+    ++ring->count;
+
+    if (track == PROFILE_TRACK_MAIN)
+    {
+        global_profiler.frame_ns[stage] += duration_ns;
+    }
+    else
+    {
+        SDL_AtomicAdd(&global_profiler.update_ns, (int)event->duration_ns);
+    }
+}
+
+
+// Called by each thread when it finishes a frame (main) or update
+// (simulation). The main thread also folds the frame's stage times into the
+// averages shown by the overlay.
+void
+profile_next_frame(enum ProfileTrack track)
+{
+    if (!global_profiler.enabled)
+    {
+        return;
+    }
+
+    global_profiler.rings[track].frame++;
+    if (track != PROFILE_TRACK_MAIN)
+    {
+        return;
+    }
+
+    global_profiler.frame_ns[PROFILE_UPDATE] = (uint32_t)SDL_AtomicSet(&global_profiler.update_ns, 0);
+    for (int32_t stage = 0; stage < PROFILE_STAGE_COUNT; ++stage)
+    {
+        double ms = (double)global_profiler.frame_ns[stage] / TR_MILLISECOND;
+        global_profiler.average_ms[stage] += (ms - global_profiler.average_ms[stage]) / TR_PROFILE_AVERAGE_FRAMES;
+        global_profiler.total_ns[stage] += global_profiler.frame_ns[stage];
+        global_profiler.frame_ns[stage] = 0;
+    }
+}
+
+
+void
+profile_fill_rect(struct SDLOffscreenBuffer buffer, int32_t x, int32_t y, int32_t width, int32_t height, uint32_t color)
+{
+    int32_t x_end = x + width < (int32_t)buffer.width ? x + width : (int32_t)buffer.width;
+    int32_t y_end = y + height < (int32_t)buffer.height ? y + height : (int32_t)buffer.height;
+    for (int32_t row = y; row < y_end; ++row)
+    {
+        uint32_t *pixel = (uint32_t *)((uint8_t *)buffer.memory + row * buffer.pitch);
+        for (int32_t column = x; column < x_end; ++column)
+        {
+            pixel[column] = color;
+        }
+    }
+}
+
+
+// Draw the average time per frame of each stage as a bar in the top left
+// corner, in stage order, under one bar with all of them stacked. The full
+// bar width is the frame budget, marked by a white line.
+void
+profile_draw_overlay(struct SDLOffscreenBuffer buffer, uint64_t budget_ns)
+{
+    static const uint32_t stage_colors[PROFILE_STAGE_COUNT] = {
+        0xFF808080, // events
+        0xFF40C0FF, // update
+        0xFFC040FF, // tables
+        0xFFFFC040, // texture
+        0xFF40FF40, // render
+        0xFFFF8040, // upload
+        0xFF404040, // wait
+        0xFFFF4040, // present
+    };
+
+    if (!global_profiler.overlay || !buffer.memory)
+    {
+        return;
+    }
+
+    int32_t left = TR_PROFILE_OVERLAY_MARGIN;
+    int32_t top = TR_PROFILE_OVERLAY_MARGIN;
+    int32_t bar_spacing = TR_PROFILE_OVERLAY_BAR + 2;
+    double pixels_per_ms = (double)TR_PROFILE_OVERLAY_WIDTH * TR_MILLISECOND / budget_ns;
+
+    profile_fill_rect(buffer, left - 2, top - 2, TR_PROFILE_OVERLAY_WIDTH + 4,
+            (PROFILE_STAGE_COUNT + 1) * bar_spacing + 2, 0xFF000000);
+
+    int32_t stacked_x = left;
+    for (int32_t stage = 0; stage < PROFILE_STAGE_COUNT; ++stage)
+    {
+        int32_t width = (int32_t)(global_profiler.average_ms[stage] * pixels_per_ms + 0.5);
+        if (width > TR_PROFILE_OVERLAY_WIDTH)
+        {
+            width = TR_PROFILE_OVERLAY_WIDTH;
+        }
+        int32_t stacked_width = width < left + TR_PROFILE_OVERLAY_WIDTH - stacked_x ? width : left + TR_PROFILE_OVERLAY_WIDTH - stacked_x;
+
+        profile_fill_rect(buffer, stacked_x, top, stacked_width, TR_PROFILE_OVERLAY_BAR, stage_colors[stage]);
+        profile_fill_rect(buffer, left, top + (stage + 1) * bar_spacing, width, TR_PROFILE_OVERLAY_BAR, stage_colors[stage]);
+        stacked_x += stacked_width;
+    }
+
+    profile_fill_rect(buffer, left + TR_PROFILE_OVERLAY_WIDTH, top - 2, 1,
+            (PROFILE_STAGE_COUNT + 1) * bar_spacing + 2, 0xFFFFFFFF);
+}
+
+
+// Write every event still in the rings to PREFIX.csv, and to PREFIX.json in
+// the Chrome trace event format (load it in chrome://tracing or Perfetto).
+// Must only be called once the threads being profiled have stopped.
+bool
+profile_write(const char *prefix)
+{
+    char csv_path[TR_MAX_PATH];
+    char json_path[TR_MAX_PATH];
+    snprintf(csv_path, sizeof(csv_path), "%s.csv", prefix);
+    snprintf(json_path, sizeof(json_path), "%s.json", prefix);
+
+    FILE *csv = fopen(csv_path, "w");
+    FILE *json = fopen(json_path, "w");
+    if (!csv || !json)
+    {
+        TR_LOG_ERR("Couldn't open %s for writing: %s\n", csv ? json_path : csv_path, strerror(errno));
+        if (csv)
+        {
+            fclose(csv);
+        }
+        if (json)
+        {
+            fclose(json);
+        }
+        return false;
+    }
+
+    fprintf(csv, "track,stage,frame,start_ns,duration_ns\n");
+    fprintf(json, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    uint64_t event_count = 0;
+    for (int32_t track = 0; track < PROFILE_TRACK_COUNT; ++track)
+    {
+        fprintf(json, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+                track + 1, profile_track_name((enum ProfileTrack)track));
+
+        const struct ProfileRing *ring = &global_profiler.rings[track];
+        uint64_t first = ring->count > TR_PROFILE_RING_SIZE ? ring->count - TR_PROFILE_RING_SIZE : 0;
+        for (uint64_t i = first; i < ring->count; ++i)
+        {
+            const struct ProfileEvent *event = &ring->events[i & (TR_PROFILE_RING_SIZE - 1)];
+            const char *stage_name = profile_stage_name((enum ProfileStage)event->stage);
+            uint64_t start_ns = event->start_ns - global_profiler.start_ns;
+            fprintf(csv, "%s,%s,%" PRIu32 ",%" PRIu64 ",%" PRIu32 "\n",
+                    profile_track_name((enum ProfileTrack)track), stage_name, event->frame, start_ns, event->duration_ns);
+            fprintf(json, "{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%" PRIu32 "}},\n",
+                    stage_name, track + 1, (double)start_ns / 1000.0, (double)event->duration_ns / 1000.0, event->frame);
+        }
+        event_count += ring->count - first;
+    }
+
+    // NOTE: The trailing metadata event saves tracking which event is last
+    // to leave out its comma.
+    fprintf(json, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"tunnel-runner\"}}\n]}\n");
+
+    bool ok = !ferror(csv) && !ferror(json);
+    ok = fclose(csv) == 0 && ok;
+    ok = fclose(json) == 0 && ok;
+    if (!ok)
+    {
+        TR_LOG_ERR("Couldn't write profile to %s\n", prefix);
+        return false;
+    }
+
+    TR_LOG_DBG("Profile: %" PRIu64 " events written to %s and %s\n", event_count, csv_path, json_path);
+    return true;
+}
+
+
+// Average time per frame in each stage, printed on exit.
+void
+profile_report(void)
+{
+    uint32_t frames = global_profiler.rings[PROFILE_TRACK_MAIN].frame;
+    if (!global_profiler.enabled || frames == 0)
+    {
+        return;
+    }
+
+    for (int32_t stage = 0; stage < PROFILE_STAGE_COUNT; ++stage)
+    {
+        TR_LOG_DBG("Profile (%s): %.3f ms per frame\n",
+                profile_stage_name((enum ProfileStage)stage),
+                (double)global_profiler.total_ns[stage] / frames / TR_MILLISECOND);
+    }
+}
+
+
+const char *
+texture_pattern_name(enum TexturePattern pattern)
+{
+    switch(pattern)
+    {
+        case TEXTURE_XOR: return "xor";
+        case TEXTURE_MOSAIC: return "mosaic";
+        case TEXTURE_CHECKER: return "checker";
+        case TEXTURE_NOISE: return "noise";
+        case TEXTURE_PLASMA: return "plasma";
+        case TEXTURE_IMAGE: return "image";
+        case TEXTURE_PATTERN_COUNT: break;
+    }
+    return "unknown";
+}
+
+
+const char *
+texture_update_name(enum TextureUpdate update)
+{
+    switch(update)
+    {
+        case TEXTURE_UPDATE_GENERATE: return "generate";
+        case TEXTURE_UPDATE_ANIMATE: return "animate";
+        case TEXTURE_UPDATE_COLORIZE: return "colorize";
+        case TEXTURE_UPDATE_SWIZZLE: return "swizzle";
+        case TEXTURE_UPDATE_COUNT: break;
+    }
+    return "unknown";
+}
+
+
+void
+texture_stats_record(enum TextureUpdate update, uint32_t rows, uint64_t elapsed_ns)
+{
+    texture_stats.updates[update]++;
+    texture_stats.rows[update] += rows;
+    texture_stats.total_ns[update] += elapsed_ns;
+    if (elapsed_ns > texture_stats.max_ns[update])
+    {
+        texture_stats.max_ns[update] = elapsed_ns;
+    }
+    TR_LOG_FRM("Texture (%s): %u rows in %" PRIu64 " ns\n", texture_update_name(update), rows, elapsed_ns);
+}
+
+
+void
+texture_stats_report(void)
+{
+    for (int32_t update = 0; update < TEXTURE_UPDATE_COUNT; ++update)
+    {
+        if (texture_stats.updates[update])
+        {
+            TR_LOG_DBG("Texture (%s): %" PRIu64 " updates, %" PRIu64 " rows and %.3f ms each on average, %.3f ms max\n",
+                    texture_update_name(update),
+                    texture_stats.updates[update],
+                    texture_stats.rows[update] / texture_stats.updates[update],
+                    (double)texture_stats.total_ns[update] / texture_stats.updates[update] / TR_MILLISECOND,
+                    (double)texture_stats.max_ns[update] / TR_MILLISECOND);
+        }
+    }
+}
+
+
+void
+texture_row_xor(uint8_t *row, uint32_t y)
+{
+    uint32_t x = 0;
+#if defined(TR_SIMD_X86)
+    __m128i ramp = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i row_value = _mm_set1_epi8((char)y);
+    for (; x + 16 <= TR_TEX_WIDTH; x += 16)
+    {
+        __m128i column = _mm_add_epi8(ramp, _mm_set1_epi8((char)x));
+        _mm_storeu_si128((__m128i *)(row + x), _mm_xor_si128(column, row_value));
+    }
+#elif defined(TR_SIMD_NEON)
+    static const uint8_t ramp_bytes[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+    uint8x16_t ramp = vld1q_u8(ramp_bytes);
+    uint8x16_t row_value = vdupq_n_u8((uint8_t)y);
+    for (; x + 16 <= TR_TEX_WIDTH; x += 16)
+    {
+        uint8x16_t column = vaddq_u8(ramp, vdupq_n_u8((uint8_t)x));
+        vst1q_u8(row + x, veorq_u8(column, row_value));
+    }
+#endif
+    for (; x < TR_TEX_WIDTH; ++x)
+    {
+        row[x] = (uint8_t)((x * 256 / TR_TEX_WIDTH) ^ (y * 256 / TR_TEX_HEIGHT));
+    }
+}
+
+
+void
+texture_row_mosaic(uint8_t *row, uint32_t y)
+{
+    for (uint32_t x = 0; x < TR_TEX_WIDTH; ++x)
+    {
+        row[x] = (uint8_t)(x * x * y * y);
+    }
+}
+
+
+// 8x8 squares of light and dark.
+void
+texture_row_checker(uint8_t *row, uint32_t y)
+{
+    uint32_t x = 0;
+#if defined(TR_SIMD_X86)
+    __m128i ramp = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i row_value = _mm_set1_epi8((char)y);
+    __m128i square_bit = _mm_set1_epi8(TR_TEX_WIDTH / 8);
+    __m128i light = _mm_set1_epi8((char)0xE0);
+    __m128i dark = _mm_set1_epi8(0x20);
+    for (; x + 16 <= TR_TEX_WIDTH; x += 16)
+    {
+        __m128i column = _mm_add_epi8(ramp, _mm_set1_epi8((char)x));
+        __m128i parity = _mm_and_si128(_mm_xor_si128(column, row_value), square_bit);
+        __m128i is_light = _mm_cmpeq_epi8(parity, square_bit);
+        __m128i texel = _mm_or_si128(_mm_and_si128(is_light, light), _mm_andnot_si128(is_light, dark));
+        _mm_storeu_si128((__m128i *)(row + x), texel);
+    }
+#elif defined(TR_SIMD_NEON)
+    static const uint8_t ramp_bytes[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+    uint8x16_t ramp = vld1q_u8(ramp_bytes);
+    uint8x16_t row_value = vdupq_n_u8((uint8_t)y);
+    uint8x16_t square_bit = vdupq_n_u8(TR_TEX_WIDTH / 8);
+    for (; x + 16 <= TR_TEX_WIDTH; x += 16)
+    {
+        uint8x16_t column = vaddq_u8(ramp, vdupq_n_u8((uint8_t)x));
+        uint8x16_t is_light = vtstq_u8(veorq_u8(column, row_value), square_bit);
+        vst1q_u8(row + x, vbslq_u8(is_light, vdupq_n_u8(0xE0), vdupq_n_u8(0x20)));
+    }
+#endif
+    for (; x < TR_TEX_WIDTH; ++x)
+    {
+        uint32_t parity = ((x / (TR_TEX_WIDTH / 8)) ^ (y / (TR_TEX_HEIGHT / 8))) & 1;
+        row[x] = parity ? 0xE0 : 0x20;
+    }
+}
+
+
+// Four sine waves averaged together. Every wave has a whole number of periods
+// across the texture, so the plasma tiles seamlessly around and along the
+// tunnel at any time.
+void
+texture_row_plasma(uint8_t *row, uint32_t y, uint32_t time)
+{
+    const uint8_t *horizontal = texture_sine + (time & 0xFF);
+    const uint8_t *diagonal = texture_sine + ((y + 2 * time) & 0xFF);
+    const uint8_t *ripple = texture_sine_fast + ((0 - time) & 0xFF);
+    uint8_t vertical = texture_sine_fast[(y + 3 * time) & 0xFF];
+
+    uint32_t x = 0;
+#if defined(TR_SIMD_X86)
+    __m128i vertical_wide = _mm_set1_epi8((char)vertical);
+    for (; x + 16 <= TR_TEX_WIDTH; x += 16)
+    {
+        __m128i a = _mm_avg_epu8(
+                _mm_loadu_si128((const __m128i *)(horizontal + x)),
+                _mm_loadu_si128((const __m128i *)(diagonal + x)));
+        __m128i b = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(ripple + x)), vertical_wide);
+        _mm_storeu_si128((__m128i *)(row + x), _mm_avg_epu8(a, b));
+    }
+#elif defined(TR_SIMD_NEON)
+    uint8x16_t vertical_wide = vdupq_n_u8(vertical);
+    for (; x + 16 <= TR_TEX_WIDTH; x += 16)
+    {
+        uint8x16_t a = vrhaddq_u8(vld1q_u8(horizontal + x), vld1q_u8(diagonal + x));
+        uint8x16_t b = vrhaddq_u8(vld1q_u8(ripple + x), vertical_wide);
+        vst1q_u8(row + x, vrhaddq_u8(a, b));
+    }
+#endif
+    // NOTE: Rounding averages, to match pavgb and vrhadd.
+    for (; x < TR_TEX_WIDTH; ++x)
+    {
+        uint32_t a = (horizontal[x] + diagonal[x] + 1) >> 1;
+        uint32_t b = (ripple[x] + vertical + 1) >> 1;
+        row[x] = (uint8_t)((a + b + 1) >> 1);
+    }
+}
+
+
+// out = (a * (256 - weight) + b * weight) / 256
+void
+texture_blend_rows(uint8_t *out, const uint8_t *a, const uint8_t *b, uint32_t weight)
+{
+    assert(weight < 256);
+
+    uint32_t x = 0;
+#if defined(TR_SIMD_X86)
+    __m128i zero = _mm_setzero_si128();
+    __m128i weight_a = _mm_set1_epi16((int16_t)(256 - weight));
+    __m128i weight_b = _mm_set1_epi16((int16_t)weight);
+    for (; x + 16 <= TR_TEX_WIDTH; x += 16)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + x));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + x));
+        // NOTE: 255 * 256 still fits in an unsigned 16-bit lane.
+        __m128i lo = _mm_add_epi16(
+                _mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), weight_a),
+                _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), weight_b));
+        __m128i hi = _mm_add_epi16(
+                _mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), weight_a),
+                _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), weight_b));
+        __m128i blended = _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+        _mm_storeu_si128((__m128i *)(out + x), blended);
+    }
+#elif defined(TR_SIMD_NEON)
+    // NOTE: 256 - weight doesn't fit in a byte lane, so a is weighted by
+    // 255 - weight and then added once more.
+    uint8x8_t weight_a = vdup_n_u8((uint8_t)(255 - weight));
+    uint8x8_t weight_b = vdup_n_u8((uint8_t)weight);
+    for (; x + 16 <= TR_TEX_WIDTH; x += 16)
+    {
+        uint8x16_t va = vld1q_u8(a + x);
+        uint8x16_t vb = vld1q_u8(b + x);
+        uint16x8_t lo = vaddw_u8(vmlal_u8(vmull_u8(vget_low_u8(va), weight_a), vget_low_u8(vb), weight_b), vget_low_u8(va));
+        uint16x8_t hi = vaddw_u8(vmlal_u8(vmull_u8(vget_high_u8(va), weight_a), vget_high_u8(vb), weight_b), vget_high_u8(va));
+        vst1q_u8(out + x, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+    }
+#endif
+    for (; x < TR_TEX_WIDTH; ++x)
+    {
+        out[x] = (uint8_t)((a[x] * (256 - weight) + b[x] * weight) >> 8);
+    }
+}
+
+
+// One octave of tileable value noise: random values on a lattice with
+// `cell`-pixel spacing, linearly interpolated. Lattice rows are interpolated
+// along x once, then each texture row blends the two around it.
+void
+texture_noise_octave(uint8_t texels[TR_TEX_HEIGHT][TR_TEX_WIDTH], uint32_t cell, uint32_t *seed)
+{
+    uint32_t cells_x = TR_TEX_WIDTH / cell;
+    uint32_t cells_y = TR_TEX_HEIGHT / cell;
+    uint8_t lattice_rows[TR_TEX_HEIGHT][TR_TEX_WIDTH];
+    uint8_t knots[TR_TEX_WIDTH];
+
+    for (uint32_t j = 0; j < cells_y; ++j)
+    {
+        for (uint32_t i = 0; i < cells_x; ++i)
+        {
+            *seed ^= *seed << 13;
+            *seed ^= *seed >> 17;
+            *seed ^= *seed << 5;
+            knots[i] = (uint8_t)(*seed >> 24);
+        }
+        for (uint32_t x = 0; x < TR_TEX_WIDTH; ++x)
+        {
+            uint32_t i = x / cell;
+            uint32_t weight = (x % cell) * 256 / cell;
+            lattice_rows[j][x] = (uint8_t)((knots[i] * (256 - weight) + knots[(i + 1) % cells_x] * weight) >> 8);
+        }
+    }
+
+    for (uint32_t y = 0; y < TR_TEX_HEIGHT; ++y)
+    {
+        uint32_t j = y / cell;
+        uint32_t weight = (y % cell) * 256 / cell;
+        texture_blend_rows(texels[y], lattice_rows[j], lattice_rows[(j + 1) % cells_y], weight);
+    }
+}
+
+
+void
+texture_generate_noise(uint8_t texels[TR_TEX_HEIGHT][TR_TEX_WIDTH])
+{
+    uint8_t fine[TR_TEX_HEIGHT][TR_TEX_WIDTH];
+    uint32_t seed = TR_NOISE_SEED;
+    texture_noise_octave(texels, TR_NOISE_COARSE_CELL, &seed);
+    texture_noise_octave(fine, TR_NOISE_FINE_CELL, &seed);
+    for (uint32_t y = 0; y < TR_TEX_HEIGHT; ++y)
+    {
+        // A quarter fine detail over the coarse shape.
+        texture_blend_rows(texels[y], texels[y], fine[y], 64);
+    }
+}
+
+
+bool
+texture_pattern_is_animated(enum TexturePattern pattern)
+{
+    return pattern == TEXTURE_PLASMA;
+}
+
+
+void
+texture_mark_dirty(struct Texture *texture, uint32_t row_start, uint32_t row_end)
+{
+    if (texture->dirty_row_start == texture->dirty_row_end)
+    {
+        texture->dirty_row_start = row_start;
+        texture->dirty_row_end = row_end;
+    }
+    else
+    {
+        if (row_start < texture->dirty_row_start)
+        {
+            texture->dirty_row_start = row_start;
+        }
+        if (row_end > texture->dirty_row_end)
+        {
+            texture->dirty_row_end = row_end;
+        }
+    }
+}
+
+
+// Fill a procedural pattern's atlas slot. Animated patterns are generated at
+// `time`.
+void
+texture_generate(struct Texture *texture, enum TexturePattern pattern, uint32_t time)
+{
+    uint64_t start_ns = get_current_time_ns();
+    uint8_t (*texels)[TR_TEX_WIDTH] = texture->slots[pattern];
+
+    switch(pattern)
+    {
+        case TEXTURE_XOR:
+        {
+            for (uint32_t y = 0; y < TR_TEX_HEIGHT; ++y)
+            {
+                texture_row_xor(texels[y], y);
+            }
+        } break;
+        case TEXTURE_MOSAIC:
+        {
+            for (uint32_t y = 0; y < TR_TEX_HEIGHT; ++y)
+            {
+                texture_row_mosaic(texels[y], y);
+            }
+        } break;
+        case TEXTURE_CHECKER:
+        {
+            for (uint32_t y = 0; y < TR_TEX_HEIGHT; ++y)
+            {
+                texture_row_checker(texels[y], y);
+            }
+        } break;
+        case TEXTURE_NOISE:
+        {
+            texture_generate_noise(texels);
+        } break;
+        case TEXTURE_PLASMA:
+        {
+            for (uint32_t y = 0; y < TR_TEX_HEIGHT; ++y)
+            {
+                texture_row_plasma(texels[y], y, time);
+            }
+            texture->animation_time = time;
+        } break;
+        case TEXTURE_IMAGE:
+        case TEXTURE_PATTERN_COUNT:
+        {
+            TR_LOG_ERR("Not a procedural texture: %d\n", pattern);
+            return;
+        }
+    }
+
+    texture->slot_loaded[pattern] = true;
+    if (pattern == texture->active)
+    {
+        texture_mark_dirty(texture, 0, TR_TEX_HEIGHT);
+    }
+    texture_stats_record(TEXTURE_UPDATE_GENERATE, TR_TEX_HEIGHT, get_current_time_ns() - start_ns);
+}
+
+
+// Load a BMP into the image slot, resampled to the texture size. Only the
+// luminance is kept; color comes from the palette as for every other pattern.
+bool
+texture_load_image(struct Texture *texture, const char *path)
+{
+    uint64_t start_ns = get_current_time_ns();
+
+    SDL_Surface *loaded = SDL_LoadBMP(path);
+    if (!loaded)
+    {
+        TR_LOG_ERR("SDL_LoadBMP failed: %s\n", SDL_GetError());
+        return false;
+    }
+    SDL_Surface *surface = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_ARGB8888, 0);
+    SDL_FreeSurface(loaded);
+    if (!surface)
+    {
+        TR_LOG_ERR("SDL_ConvertSurfaceFormat failed: %s\n", SDL_GetError());
+        return false;
+    }
+    if (SDL_LockSurface(surface) != 0)
+    {
+        TR_LOG_ERR("SDL_LockSurface failed: %s\n", SDL_GetError());
+        SDL_FreeSurface(surface);
+        return false;
+    }
+
+    uint8_t (*texels)[TR_TEX_WIDTH] = texture->slots[TEXTURE_IMAGE];
+    for (uint32_t y = 0; y < TR_TEX_HEIGHT; ++y)
+    {
+        uint32_t source_y = y * (uint32_t)surface->h / TR_TEX_HEIGHT;
+        const uint32_t *source_row = (const uint32_t *)((const uint8_t *)surface->pixels + source_y * surface->pitch);
+        for (uint32_t x = 0; x < TR_TEX_WIDTH; ++x)
+        {
+            uint32_t color = source_row[x * (uint32_t)surface->w / TR_TEX_WIDTH];
+            uint32_t red = (color >> 16) & 0xFF;
+            uint32_t green = (color >> 8) & 0xFF;
+            uint32_t blue = color & 0xFF;
+            texels[y][x] = (uint8_t)((red * 77 + green * 150 + blue * 29) >> 8);
+        }
+    }
+
+    SDL_UnlockSurface(surface);
+    SDL_FreeSurface(surface);
+
+    texture->slot_loaded[TEXTURE_IMAGE] = true;
+    if (texture->active == TEXTURE_IMAGE)
+    {
+        texture_mark_dirty(texture, 0, TR_TEX_HEIGHT);
+    }
+    texture_stats_record(TEXTURE_UPDATE_GENERATE, TR_TEX_HEIGHT, get_current_time_ns() - start_ns);
+    return true;
+}
+
+
+// Fill every procedural slot of the atlas.
+void
+texture_init(struct Texture *texture)
+{
+    for (uint32_t i = 0; i < 2 * TR_TEX_WIDTH; ++i)
+    {
+        float angle = 2.0f * TR_PI32 * (float)(i % TR_TEX_WIDTH) / TR_TEX_WIDTH;
+        texture_sine[i] = (uint8_t)(128.0f + 127.0f * sinf(angle));
+        texture_sine_fast[i] = (uint8_t)(128.0f + 127.0f * sinf(2.0f * angle));
+    }
+
+    memset(texture->slot_loaded, 0, sizeof(texture->slot_loaded));
+    texture->active = TEXTURE_XOR;
+    texture->animation_row = 0;
+    texture->colorized_valid = false;
+    texture->dirty_row_start = texture->dirty_row_end = 0;
+    texture->layout = TEXELS_COLORIZED;
+    texture->palette = 0;
+    memset(texture->morton, 0, sizeof(texture->morton));
+
+    for (int32_t pattern = 0; pattern < TEXTURE_PATTERN_COUNT; ++pattern)
+    {
+        if (pattern != TEXTURE_IMAGE)
+        {
+            texture_generate(texture, (enum TexturePattern)pattern, 0);
+        }
+    }
+}
+
+
+// Switch to another atlas slot. Returns false (and keeps the current one) if
+// that slot was never loaded.
+bool
+texture_select(struct Texture *texture, enum TexturePattern pattern)
+{
+    if (!texture->slot_loaded[pattern])
+    {
+        return false;
+    }
+    if (pattern != texture->active)
+    {
+        TR_LOG_DBG("Texture: %s\n", texture_pattern_name(pattern));
+        texture->active = pattern;
+        texture->colorized_valid = false;
+    }
+    return true;
+}
+
+
+// Advance an animated slot to `time`. Only the next TR_TEXTURE_ANIMATION_ROWS
+// rows are regenerated, rolling down the texture, so every row is brought up
+// to date every TR_TEX_HEIGHT / TR_TEXTURE_ANIMATION_ROWS frames at a fraction
+// of the cost of regenerating (and recolorizing) the whole slot each frame.
+void
+texture_animate(struct Texture *texture, uint32_t time)
+{
+    if (!texture_pattern_is_animated(texture->active) || time == texture->animation_time)
+    {
+        return;
+    }
+
+    uint64_t start_ns = get_current_time_ns();
+    uint8_t (*texels)[TR_TEX_WIDTH] = texture->slots[texture->active];
+    uint32_t row_start = texture->animation_row;
+    uint32_t row_end = row_start + TR_TEXTURE_ANIMATION_ROWS;
+    assert(row_end <= TR_TEX_HEIGHT);
+
+    for (uint32_t y = row_start; y < row_end; ++y)
+    {
+        texture_row_plasma(texels[y], y, time);
+    }
+
+    texture->animation_row = row_end % TR_TEX_HEIGHT;
+    texture->animation_time = time;
+    texture_mark_dirty(texture, row_start, row_end);
+    texture_stats_record(TEXTURE_UPDATE_ANIMATE, TR_TEXTURE_ANIMATION_ROWS, get_current_time_ns() - start_ns);
+}
+
+
+void
+palette_fill_channels(uint32_t *entries, uint32_t channel_mask)
+{
+    for (uint32_t texel = 0; texel < 256; ++texel)
+    {
+        uint32_t red = texel << 16;
+        uint32_t green = texel << 8;
+        uint32_t blue = texel;
+        entries[texel] = (red | green | blue) & channel_mask;
+    }
+}
+
+
+// Linear interpolation between the stops, which must be sorted by position
+// and start at 0 and end at 255.
+void
+palette_fill_gradient(uint32_t *entries, const struct GradientStop *stops, uint32_t stop_count)
+{
+    uint32_t stop = 0;
+    for (uint32_t texel = 0; texel < 256; ++texel)
+    {
+        while (stop + 2 < stop_count && texel > stops[stop + 1].position)
+        {
+            ++stop;
+        }
+
+        const struct GradientStop *from = &stops[stop];
+        const struct GradientStop *to = &stops[stop + 1];
+        uint32_t span = to->position - from->position;
+        uint32_t t = span ? ((texel - from->position) * 256) / span : 0;
+
+        uint32_t color = 0;
+        for (uint32_t shift = 0; shift <= 16; shift += 8)
+        {
+            int32_t a = (from->color >> shift) & 0xFF;
+            int32_t b = (to->color >> shift) & 0xFF;
+            int32_t channel = a + (((b - a) * (int32_t)t) / 256);
+            color |= (uint32_t)channel << shift;
+        }
+        entries[texel] = color;
+    }
+}
+
+
+void
+palette_build(struct Palette *palette, enum Color color_choice)
+{
+    static const struct GradientStop fire[] = {
+        { 0, 0x000000 },
+        { 96, 0x800000 },
+        { 160, 0xFF4000 },
+        { 224, 0xFFC000 },
+        { 255, 0xFFFFC0 },
+    };
+    static const struct GradientStop ocean[] = {
+        { 0, 0x000010 },
+        { 112, 0x003070 },
+        { 192, 0x0090B0 },
+        { 255, 0xC0FFFF },
+    };
+    // Starts and ends on the same color so that cycling is seamless.
+    static const struct GradientStop rainbow[] = {
+        { 0, 0xFF0000 },
+        { 43, 0xFFFF00 },
+        { 85, 0x00FF00 },
+        { 128, 0x00FFFF },
+        { 170, 0x0000FF },
+        { 213, 0xFF00FF },
+        { 255, 0xFF0000 },
+    };
+
+    palette->cycles = false;
+
+    switch(color_choice)
+    {
+        case COLOR_GREEN:
+        {
+            palette_fill_channels(palette->entries, 0x0000FF00);
+        } break;
+        case COLOR_RED:
+        {
+            palette_fill_channels(palette->entries, 0x00FF0000);
+        } break;
+        case COLOR_BLUE:
+        {
+            palette_fill_channels(palette->entries, 0x000000FF);
+        } break;
+        case COLOR_YELLOW:
+        {
+            palette_fill_channels(palette->entries, 0x00FFFF00);
+        } break;
+        case COLOR_MAGENTA:
+        {
+            palette_fill_channels(palette->entries, 0x00FF00FF);
+        } break;
+        case COLOR_CYAN:
+        {
+            palette_fill_channels(palette->entries, 0x0000FFFF);
+        } break;
+        case COLOR_WHITE:
+        {
+            palette_fill_channels(palette->entries, 0x00FFFFFF);
+        } break;
+        case COLOR_FIRE:
+        {
+            palette_fill_gradient(palette->entries, fire, sizeof(fire) / sizeof(fire[0]));
+        } break;
+        case COLOR_OCEAN:
+        {
+            palette_fill_gradient(palette->entries, ocean, sizeof(ocean) / sizeof(ocean[0]));
+        } break;
+        case COLOR_RAINBOW:
+        {
+            palette_fill_gradient(palette->entries, rainbow, sizeof(rainbow) / sizeof(rainbow[0]));
+            palette->cycles = true;
+        } break;
+        case COLOR_COUNT:
+        default:
+        {
+            TR_LOG_ERR("Invalid color enum value: %d\n", color_choice);
+            palette_fill_channels(palette->entries, 0x00FFFFFF);
+        } break;
+    }
+
+    memcpy(palette->entries + 256, palette->entries, 256 * sizeof(uint32_t));
+    palette->color = color_choice;
+    palette->valid = true;
+}
+
+
+// Return the 256-entry lookup table for this color and cycle phase, only
+// rebuilding the palette when the color has changed.
+const uint32_t *
+palette_lookup(struct Palette *palette, enum Color color_choice, uint8_t phase)
+{
+    if (!palette->valid || palette->color != color_choice)
+    {
+        palette_build(palette, color_choice);
+    }
+    return palette->cycles ? palette->entries + phase : palette->entries;
+}
+
+
+// Interleave the bits of a texel index's column (low byte) and row (high
+// byte) into its Z-order index: ... y1 x1 y0 x0. Written as shifts and masks
+// on 16 bits so that the vector kernels do exactly the same per lane.
+uint16_t
+morton_swizzle(uint16_t index)
+{
+    uint32_t x = index;
+    x = (x & 0xF00F) | ((x & 0x00F0) << 4) | ((x >> 4) & 0x00F0);
+    x = (x & 0xC3C3) | ((x & 0x0C0C) << 2) | ((x >> 2) & 0x0C0C);
+    x = (x & 0x9999) | ((x & 0x2222) << 1) | ((x >> 1) & 0x2222);
+    return (uint16_t)x;
+}
+
+
+// The TEXELS_MORTON counterpart of colorizing: copy the active slot's
+// changed rows into Z-order. The palette is applied while rendering, so
+// only new texels cost anything here.
+void
+texture_swizzle(struct Texture *texture)
+{
+    uint32_t row_start = texture->dirty_row_start;
+    uint32_t row_end = texture->dirty_row_end;
+    if (!texture->colorized_valid)
+    {
+        row_start = 0;
+        row_end = TR_TEX_HEIGHT;
+    }
+    if (row_start == row_end)
+    {
+        return;
+    }
+
+    uint64_t start_ns = get_current_time_ns();
+    uint8_t (*texels)[TR_TEX_WIDTH] = texture->slots[texture->active];
+    for (uint32_t y = row_start; y < row_end; ++y)
+    {
+        for (uint32_t x = 0; x < TR_TEX_WIDTH; ++x)
+        {
+            texture->morton[morton_swizzle((uint16_t)(y * TR_TEX_WIDTH + x))] = texels[y][x];
+        }
+    }
+
+    texture->colorized_valid = true;
+    texture->dirty_row_start = texture->dirty_row_end = 0;
+    ++texture->version;
+    texture_stats_record(TEXTURE_UPDATE_SWIZZLE, row_end - row_start, get_current_time_ns() - start_ns);
+}
+
+
+void
+texture_set_layout(struct Texture *texture, enum TexelLayout layout)
+{
+    if (layout != texture->layout)
+    {
+        texture->layout = layout;
+        texture->colorized_valid = false;
+    }
+}
+
+
+// Bring texture->colorized (or, with TEXELS_MORTON, texture->morton) up to
+// date with the active slot, color and phase. Only rows marked dirty are
+// redone unless the palette or slot changed.
+void
+texture_colorize(struct Texture *texture, struct Palette *palette, enum Color color_choice, uint8_t phase)
+{
+    const uint32_t *lut = palette_lookup(palette, color_choice, phase);
+    if (!palette->cycles)
+    {
+        phase = 0;
+    }
+
+    if (texture->layout == TEXELS_MORTON)
+    {
+        if (texture->palette != lut
+                || texture->palette_color != color_choice
+                || texture->palette_phase != phase)
+        {
+            texture->palette = lut;
+            texture->palette_color = color_choice;
+            texture->palette_phase = phase;
+            ++texture->version;
+        }
+        texture_swizzle(texture);
+        return;
+    }
+
+    uint32_t row_start = texture->dirty_row_start;
+    uint32_t row_end = texture->dirty_row_end;
+    if (!texture->colorized_valid
+            || texture->colorized_color != color_choice
+            || texture->colorized_phase != phase)
+    {
+        row_start = 0;
+        row_end = TR_TEX_HEIGHT;
+    }
+    if (row_start == row_end)
+    {
+        return;
+    }
+
+    uint64_t start_ns = get_current_time_ns();
+    uint8_t (*texels)[TR_TEX_WIDTH] = texture->slots[texture->active];
+    for (uint32_t y = row_start; y < row_end; ++y)
+    {
+        for (uint32_t x = 0; x < TR_TEX_WIDTH; ++x)
+        {
+            texture->colorized[y][x] = lut[texels[y][x]];
+        }
+    }
+
+    texture->colorized_color = color_choice;
+    texture->colorized_phase = phase;
+    texture->colorized_valid = true;
+    texture->dirty_row_start = texture->dirty_row_end = 0;
+    ++texture->version;
+    texture_stats_record(TEXTURE_UPDATE_COLORIZE, row_end - row_start, get_current_time_ns() - start_ns);
+}
+
+
+void
+render_texture(
+        struct SDLOffscreenBuffer buffer,
+        const struct Texture *texture,
+        int32_t x_offset,
+        int32_t y_offset)
+{
+    uint8_t *row = (uint8_t *)buffer.memory;
+
+    for (uint32_t y = 0; y < buffer.height; ++y)
+    {
+        uint32_t *pixel = (uint32_t *)row;
+        uint32_t v = (uint32_t)(y + y_offset) % TR_TEX_HEIGHT;
+        for (uint32_t x = 0; x < buffer.width; ++x)
+        {
+            uint32_t u = (uint32_t)(x + x_offset) % TR_TEX_WIDTH;
+            if (texture->layout == TEXELS_MORTON)
+            {
+                *pixel++ = texture->palette[texture->morton[morton_swizzle((uint16_t)(v * TR_TEX_WIDTH + u))]];
+            }
+            else
+            {
+                *pixel++ = texture->colorized[v][u];
+            }
+        }
+
+        row += buffer.pitch;
+    }
+}
+
+
+// Reference implementation. The vectorized kernels below must produce
+// exactly the same pixels; run with --selftest to check.
+void
+tunnel_row_scalar(
+        uint32_t *pixel,
+        const uint16_t *table_row,
+        int32_t step,
+        uint32_t count,
+        const uint32_t *texture,
+        uint16_t entry_mask,
+        int32_t rotation_offset,
+        int32_t translation_offset)
+{
+    for (uint32_t x = 0; x < count; ++x)
+    {
+        uint16_t entry = table_row[(int32_t)x * step] ^ entry_mask;
+        uint32_t texel_y = (uint32_t)(TR_TRANSFORM_DISTANCE(entry) + translation_offset) % TR_TEX_HEIGHT;
+        uint32_t texel_x = (uint32_t)(TR_TRANSFORM_ANGLE(entry) + rotation_offset) % TR_TEX_WIDTH;
+
+        assert(texel_x >= 0 && texel_x < TR_TEX_WIDTH);
+        assert(texel_y >= 0 && texel_y < TR_TEX_HEIGHT);
+
+        *pixel++ = texture[texel_y * TR_TEX_WIDTH + texel_x];
+    }
+}
+
+
+#ifdef TR_SIMD_X86
+// Load table_row[0], table_row[step], ..., table_row[7 * step].
+__m128i
+tunnel_load_entries_sse2(const uint16_t *table_row, int32_t step)
+{
+    if (step > 0)
+    {
+        return _mm_loadu_si128((const __m128i *)table_row);
+    }
+    __m128i entries = _mm_loadu_si128((const __m128i *)(table_row - 7));
+    entries = _mm_shuffle_epi32(entries, _MM_SHUFFLE(0, 1, 2, 3));
+    entries = _mm_shufflelo_epi16(entries, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_shufflehi_epi16(entries, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+
+void
+tunnel_row_sse2(
+        uint32_t *pixel,
+        const uint16_t *table_row,
+        int32_t step,
+        uint32_t count,
+        const uint32_t *texture,
+        uint16_t entry_mask,
+        int32_t rotation_offset,
+        int32_t translation_offset)
+{
+    __m128i offsets = _mm_set1_epi16((int16_t)TR_TRANSFORM_PACK(translation_offset, rotation_offset));
+    __m128i mask = _mm_set1_epi16((int16_t)entry_mask);
+
+    uint32_t x = 0;
+    for (; x + 8 <= count; x += 8)
+    {
+        __m128i entries = _mm_xor_si128(tunnel_load_entries_sse2(table_row + (int32_t)x * step, step), mask);
+        __m128i index = _mm_add_epi8(entries, offsets);
+
+        // SSE2 has no gather, so the fetch itself stays scalar.
+        uint16_t indices[8];
+        _mm_storeu_si128((__m128i *)indices, index);
+        for (uint32_t i = 0; i < 8; ++i)
+        {
+            pixel[x + i] = texture[indices[i]];
+        }
+    }
+
+    tunnel_row_scalar(pixel + x, table_row + (int32_t)x * step, step, count - x, texture, entry_mask, rotation_offset, translation_offset);
+}
+
+
+// Load table_row[0], table_row[step], ..., table_row[15 * step].
+TR_TARGET_AVX2 __m256i
+tunnel_load_entries_avx2(const uint16_t *table_row, int32_t step)
+{
+    if (step > 0)
+    {
+        return _mm256_loadu_si256((const __m256i *)table_row);
+    }
+    __m256i entries = _mm256_loadu_si256((const __m256i *)(table_row - 15));
+    entries = _mm256_permute4x64_epi64(entries, _MM_SHUFFLE(0, 1, 2, 3));
+    entries = _mm256_shufflelo_epi16(entries, _MM_SHUFFLE(0, 1, 2, 3));
+    return _mm256_shufflehi_epi16(entries, _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+
+TR_TARGET_AVX2 void
+tunnel_row_avx2(
+        uint32_t *pixel,
+        const uint16_t *table_row,
+        int32_t step,
+        uint32_t count,
+        const uint32_t *texture,
+        uint16_t entry_mask,
+        int32_t rotation_offset,
+        int32_t translation_offset)
+{
+    __m256i offsets = _mm256_set1_epi16((int16_t)TR_TRANSFORM_PACK(translation_offset, rotation_offset));
+    __m256i mask = _mm256_set1_epi16((int16_t)entry_mask);
+
+    uint32_t x = 0;
+    for (; x + 16 <= count; x += 16)
+    {
+        __m256i entries = _mm256_xor_si256(tunnel_load_entries_avx2(table_row + (int32_t)x * step, step), mask);
+        __m256i index = _mm256_add_epi8(entries, offsets);
+        __m256i index_lo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(index));
+        __m256i index_hi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(index, 1));
+
+        __m256i color_lo = _mm256_i32gather_epi32((const int *)texture, index_lo, 4);
+        __m256i color_hi = _mm256_i32gather_epi32((const int *)texture, index_hi, 4);
+        _mm256_storeu_si256((__m256i *)(pixel + x), color_lo);
+        _mm256_storeu_si256((__m256i *)(pixel + x + 8), color_hi);
+    }
+
+    tunnel_row_scalar(pixel + x, table_row + (int32_t)x * step, step, count - x, texture, entry_mask, rotation_offset, translation_offset);
+}
+#endif
+
+#ifdef TR_SIMD_NEON
+// Load table_row[0], table_row[step], ..., table_row[7 * step].
+uint16x8_t
+tunnel_load_entries_neon(const uint16_t *table_row, int32_t step)
+{
+    if (step > 0)
+    {
+        return vld1q_u16(table_row);
+    }
+    uint16x8_t entries = vrev64q_u16(vld1q_u16(table_row - 7));
+    return vextq_u16(entries, entries, 4);
+}
+
+
+void
+tunnel_row_neon(
+        uint32_t *pixel,
+        const uint16_t *table_row,
+        int32_t step,
+        uint32_t count,
+        const uint32_t *texture,
+        uint16_t entry_mask,
+        int32_t rotation_offset,
+        int32_t translation_offset)
+{
+    uint8x16_t offsets = vreinterpretq_u8_u16(vdupq_n_u16(TR_TRANSFORM_PACK(translation_offset, rotation_offset)));
+    uint16x8_t mask = vdupq_n_u16(entry_mask);
+
+    uint32_t x = 0;
+    for (; x + 8 <= count; x += 8)
+    {
+        uint16x8_t loaded = veorq_u16(tunnel_load_entries_neon(table_row + (int32_t)x * step, step), mask);
+        uint8x16_t entries = vreinterpretq_u8_u16(loaded);
+        uint16x8_t index = vreinterpretq_u16_u8(vaddq_u8(entries, offsets));
+
+        // NEON has no gather, so the fetch itself stays scalar.
+        uint16_t indices[8];
+        vst1q_u16(indices, index);
+        for (uint32_t i = 0; i < 8; ++i)
+        {
+            pixel[x + i] = texture[indices[i]];
+        }
+    }
+
+    tunnel_row_scalar(pixel + x, table_row + (int32_t)x * step, step, count - x, texture, entry_mask, rotation_offset, translation_offset);
+}
+#endif
+
+
+// The TEXELS_MORTON kernels add the offsets exactly like the ones above, then
+// swizzle the texel index into Z-order and look the texel up in the palette.
+void
+tunnel_row_morton_scalar(
+        uint32_t *pixel,
+        const uint16_t *table_row,
+        int32_t step,
+        uint32_t count,
+        const uint8_t *texels,
+        const uint32_t *palette,
+        uint16_t entry_mask,
+        int32_t rotation_offset,
+        int32_t translation_offset)
+{
+    for (uint32_t x = 0; x < count; ++x)
+    {
+        uint16_t entry = table_row[(int32_t)x * step] ^ entry_mask;
+        uint16_t index = TR_TRANSFORM_PACK(
+                TR_TRANSFORM_DISTANCE(entry) + translation_offset,
+                TR_TRANSFORM_ANGLE(entry) + rotation_offset);
+        *pixel++ = palette[texels[morton_swizzle(index)]];
+    }
+}
+
+
+#ifdef TR_SIMD_X86
+// morton_swizzle on each 16-bit lane.
+__m128i
+tunnel_morton_swizzle_sse2(__m128i x)
+{
+    x = _mm_or_si128(
+            _mm_or_si128(_mm_and_si128(x, _mm_set1_epi16((int16_t)0xF00F)), _mm_slli_epi16(_mm_and_si128(x, _mm_set1_epi16(0x00F0)), 4)),
+            _mm_and_si128(_mm_srli_epi16(x, 4), _mm_set1_epi16(0x00F0)));
+    x = _mm_or_si128(
+            _mm_or_si128(_mm_and_si128(x, _mm_set1_epi16((int16_t)0xC3C3)), _mm_slli_epi16(_mm_and_si128(x, _mm_set1_epi16(0x0C0C)), 2)),
+            _mm_and_si128(_mm_srli_epi16(x, 2), _mm_set1_epi16(0x0C0C)));
+    x = _mm_or_si128(
+            _mm_or_si128(_mm_and_si128(x, _mm_set1_epi16((int16_t)0x9999)), _mm_slli_epi16(_mm_and_si128(x, _mm_set1_epi16(0x2222)), 1)),
+            _mm_and_si128(_mm_srli_epi16(x, 1), _mm_set1_epi16(0x2222)));
+    return x;
+}
+
+
+void
+tunnel_row_morton_sse2(
+        uint32_t *pixel,
+        const uint16_t *table_row,
+        int32_t step,
+        uint32_t count,
+        const uint8_t *texels,
+        const uint32_t *palette,
+        uint16_t entry_mask,
+        int32_t rotation_offset,
+        int32_t translation_offset)
+{
+    __m128i offsets = _mm_set1_epi16((int16_t)TR_TRANSFORM_PACK(translation_offset, rotation_offset));
+    __m128i mask = _mm_set1_epi16((int16_t)entry_mask);
+
+    uint32_t x = 0;
+    for (; x + 8 <= count; x += 8)
+    {
+        __m128i entries = _mm_xor_si128(tunnel_load_entries_sse2(table_row + (int32_t)x * step, step), mask);
+        __m128i index = tunnel_morton_swizzle_sse2(_mm_add_epi8(entries, offsets));
+
+        uint16_t indices[8];
+        _mm_storeu_si128((__m128i *)indices, index);
+        for (uint32_t i = 0; i < 8; ++i)
+        {
+            pixel[x + i] = palette[texels[indices[i]]];
+        }
+    }
+
+    tunnel_row_morton_scalar(pixel + x, table_row + (int32_t)x * step, step, count - x, texels, palette, entry_mask, rotation_offset, translation_offset);
+}
+
+
+// morton_swizzle on each 16-bit lane.
+TR_TARGET_AVX2 __m256i
+tunnel_morton_swizzle_avx2(__m256i x)
+{
+    x = _mm256_or_si256(
+            _mm256_or_si256(_mm256_and_si256(x, _mm256_set1_epi16((int16_t)0xF00F)), _mm256_slli_epi16(_mm256_and_si256(x, _mm256_set1_epi16(0x00F0)), 4)),
+            _mm256_and_si256(_mm256_srli_epi16(x, 4), _mm256_set1_epi16(0x00F0)));
+    x = _mm256_or_si256(
+            _mm256_or_si256(_mm256_and_si256(x, _mm256_set1_epi16((int16_t)0xC3C3)), _mm256_slli_epi16(_mm256_and_si256(x, _mm256_set1_epi16(0x0C0C)), 2)),
+            _mm256_and_si256(_mm256_srli_epi16(x, 2), _mm256_set1_epi16(0x0C0C)));
+    x = _mm256_or_si256(
+            _mm256_or_si256(_mm256_and_si256(x, _mm256_set1_epi16((int16_t)0x9999)), _mm256_slli_epi16(_mm256_and_si256(x, _mm256_set1_epi16(0x2222)), 1)),
+            _mm256_and_si256(_mm256_srli_epi16(x, 1), _mm256_set1_epi16(0x2222)));
+    return x;
+}
+
+
+// NOTE: There is no byte gather, so texels are gathered 32 bits at a time
+// from their own address (hence the padding after texture->morton) and
+// masked down to the low byte.
+TR_TARGET_AVX2 void
+tunnel_row_morton_avx2(
+        uint32_t *pixel,
+        const uint16_t *table_row,
+        int32_t step,
+        uint32_t count,
+        const uint8_t *texels,
+        const uint32_t *palette,
+        uint16_t entry_mask,
+        int32_t rotation_offset,
+        int32_t translation_offset)
+{
+    __m256i offsets = _mm256_set1_epi16((int16_t)TR_TRANSFORM_PACK(translation_offset, rotation_offset));
+    __m256i mask = _mm256_set1_epi16((int16_t)entry_mask);
+    __m256i low_byte = _mm256_set1_epi32(0xFF);
+
+    uint32_t x = 0;
+    for (; x + 16 <= count; x += 16)
+    {
+        __m256i entries = _mm256_xor_si256(tunnel_load_entries_avx2(table_row + (int32_t)x * step, step), mask);
+        __m256i index = tunnel_morton_swizzle_avx2(_mm256_add_epi8(entries, offsets));
+        __m256i index_lo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(index));
+        __m256i index_hi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(index, 1));
+
+        __m256i texel_lo = _mm256_and_si256(_mm256_i32gather_epi32((const int *)texels, index_lo, 1), low_byte);
+        __m256i texel_hi = _mm256_and_si256(_mm256_i32gather_epi32((const int *)texels, index_hi, 1), low_byte);
+        __m256i color_lo = _mm256_i32gather_epi32((const int *)palette, texel_lo, 4);
+        __m256i color_hi = _mm256_i32gather_epi32((const int *)palette, texel_hi, 4);
+        _mm256_storeu_si256((__m256i *)(pixel + x), color_lo);
+        _mm256_storeu_si256((__m256i *)(pixel + x + 8), color_hi);
+    }
+
+    tunnel_row_morton_scalar(pixel + x, table_row + (int32_t)x * step, step, count - x, texels, palette, entry_mask, rotation_offset, translation_offset);
+}
+#endif
+
+#ifdef TR_SIMD_NEON
+// morton_swizzle on each 16-bit lane.
+uint16x8_t
+tunnel_morton_swizzle_neon(uint16x8_t x)
+{
+    x = vorrq_u16(
+            vorrq_u16(vandq_u16(x, vdupq_n_u16(0xF00F)), vshlq_n_u16(vandq_u16(x, vdupq_n_u16(0x00F0)), 4)),
+            vandq_u16(vshrq_n_u16(x, 4), vdupq_n_u16(0x00F0)));
+    x = vorrq_u16(
+            vorrq_u16(vandq_u16(x, vdupq_n_u16(0xC3C3)), vshlq_n_u16(vandq_u16(x, vdupq_n_u16(0x0C0C)), 2)),
+            vandq_u16(vshrq_n_u16(x, 2), vdupq_n_u16(0x0C0C)));
+    x = vorrq_u16(
+            vorrq_u16(vandq_u16(x, vdupq_n_u16(0x9999)), vshlq_n_u16(vandq_u16(x, vdupq_n_u16(0x2222)), 1)),
+            vandq_u16(vshrq_n_u16(x, 1), vdupq_n_u16(0x2222)));
+    return x;
+}
+
+
+void
+tunnel_row_morton_neon(
+        uint32_t *pixel,
+        const uint16_t *table_row,
+        int32_t step,
+        uint32_t count,
+        const uint8_t *texels,
+        const uint32_t *palette,
+        uint16_t entry_mask,
+        int32_t rotation_offset,
+        int32_t translation_offset)
+{
+    uint8x16_t offsets = vreinterpretq_u8_u16(vdupq_n_u16(TR_TRANSFORM_PACK(translation_offset, rotation_offset)));
+    uint16x8_t mask = vdupq_n_u16(entry_mask);
+
+    uint32_t x = 0;
+    for (; x + 8 <= count; x += 8)
+    {
+        uint16x8_t loaded = veorq_u16(tunnel_load_entries_neon(table_row + (int32_t)x * step, step), mask);
+        uint8x16_t entries = vreinterpretq_u8_u16(loaded);
+        uint16x8_t index = tunnel_morton_swizzle_neon(vreinterpretq_u16_u8(vaddq_u8(entries, offsets)));
+
+        uint16_t indices[8];
+        vst1q_u16(indices, index);
+        for (uint32_t i = 0; i < 8; ++i)
+        {
+            pixel[x + i] = palette[texels[indices[i]]];
+        }
+    }
+
+    tunnel_row_morton_scalar(pixel + x, table_row + (int32_t)x * step, step, count - x, texels, palette, entry_mask, rotation_offset, translation_offset);
+}
+#endif
+
+// NOTE: The shape kernels below evaluate
+//
+//     depth = radius * TR_TEX_HEIGHT / max(1, metric)
+//     angle = atan2(dy, dx) * 128 / pi + twist * depth
+//
+// where the metric blends the Euclidean (round) and Chebyshev (square)
+// distance from the center with dy stretched by the aspect. atan2 is a
+// polynomial approximation (max error about 1e-5 radians) built from
+// operations every instruction set rounds identically, so the vector
+// kernels match the scalar one bit for bit. That only holds while the
+// compiler keeps each multiply and add separate: with contraction on, the
+// scalar expressions become FMAs and round differently from the separate
+// vector multiplies and adds (see FP_CONTRACT at the top of the file).
+#define TR_SHAPE_ATAN_C3 -0.327622764f
+#define TR_SHAPE_ATAN_C5 0.15931422f
+#define TR_SHAPE_ATAN_C7 -0.0464964749f
+#define TR_SHAPE_HALF_PI 1.57079637f
+#define TR_SHAPE_PI 3.14159274f
+#define TR_SHAPE_ANGLE_SCALE (TR_TEX_WIDTH / 2 / TR_SHAPE_PI)
+#define TR_SHAPE_MIN_DIVISOR 1e-20f
+
+void
+tunnel_shape_row_scalar(
+        uint32_t *pixel,
+        uint32_t count,
+        float dx,
+        float dy,
+        const struct TunnelShapeParams *params,
+        const uint32_t *texture,
+        int32_t rotation_offset,
+        int32_t translation_offset)
+{
+    float y = dy * params->aspect;
+    float abs_y = fabsf(y);
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        float x = dx + (float)i * params->pixel_size;
+        float abs_x = fabsf(x);
+
+        float round = sqrtf(x * x + y * y);
+        float square = abs_x > abs_y ? abs_x : abs_y;
+        float metric = round + (square - round) * params->squareness;
+        metric = metric > 1.0f ? metric : 1.0f;
+        float depth = params->depth_scale / metric;
+
+        float smaller = abs_x < abs_y ? abs_x : abs_y;
+        float larger = square > TR_SHAPE_MIN_DIVISOR ? square : TR_SHAPE_MIN_DIVISOR;
+        float ratio = smaller / larger;
+        float ratio_squared = ratio * ratio;
+        float radians = ((TR_SHAPE_ATAN_C7 * ratio_squared + TR_SHAPE_ATAN_C5) * ratio_squared + TR_SHAPE_ATAN_C3) * ratio_squared * ratio + ratio;
+        if (abs_y > abs_x)
+        {
+            radians = TR_SHAPE_HALF_PI - radians;
+        }
+        if (x < 0.0f)
+        {
+            radians = TR_SHAPE_PI - radians;
+        }
+        if (y < 0.0f)
+        {
+            radians = -radians;
+        }
+        float angle = radians * TR_SHAPE_ANGLE_SCALE + params->twist * depth;
+
+        uint32_t texel_y = ((uint32_t)(int32_t)depth + (uint32_t)translation_offset) % TR_TEX_HEIGHT;
+        uint32_t texel_x = ((uint32_t)(int32_t)angle + (uint32_t)rotation_offset) % TR_TEX_WIDTH;
+        *pixel++ = texture[texel_y * TR_TEX_WIDTH + texel_x];
+    }
+}
+
+
+#ifdef TR_SIMD_X86
+// Texel indices for the 4 pixels at x = dx, dx + pixel_size, ... (see
+// tunnel_shape_row_scalar).
+__m128i
+tunnel_shape_indices_sse2(
+        __m128 x,
+        __m128 y,
+        const struct TunnelShapeParams *params,
+        __m128i offsets)
+{
+    __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 abs_x = _mm_andnot_ps(sign, x);
+    __m128 abs_y = _mm_andnot_ps(sign, y);
+
+    __m128 round = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)));
+    __m128 square = _mm_max_ps(abs_x, abs_y);
+    __m128 metric = _mm_add_ps(round, _mm_mul_ps(_mm_sub_ps(square, round), _mm_set1_ps(params->squareness)));
+    metric = _mm_max_ps(metric, _mm_set1_ps(1.0f));
+    __m128 depth = _mm_div_ps(_mm_set1_ps(params->depth_scale), metric);
+
+    __m128 smaller = _mm_min_ps(abs_x, abs_y);
+    __m128 larger = _mm_max_ps(square, _mm_set1_ps(TR_SHAPE_MIN_DIVISOR));
+    __m128 ratio = _mm_div_ps(smaller, larger);
+    __m128 ratio_squared = _mm_mul_ps(ratio, ratio);
+    __m128 radians = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(TR_SHAPE_ATAN_C7), ratio_squared), _mm_set1_ps(TR_SHAPE_ATAN_C5));
+    radians = _mm_add_ps(_mm_mul_ps(radians, ratio_squared), _mm_set1_ps(TR_SHAPE_ATAN_C3));
+    radians = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(radians, ratio_squared), ratio), ratio);
+
+    __m128 steep = _mm_cmpgt_ps(abs_y, abs_x);
+    radians = _mm_or_ps(_mm_and_ps(steep, _mm_sub_ps(_mm_set1_ps(TR_SHAPE_HALF_PI), radians)), _mm_andnot_ps(steep, radians));
+    __m128 left = _mm_cmplt_ps(x, _mm_setzero_ps());
+    radians = _mm_or_ps(_mm_and_ps(left, _mm_sub_ps(_mm_set1_ps(TR_SHAPE_PI), radians)), _mm_andnot_ps(left, radians));
+    __m128 above = _mm_cmplt_ps(y, _mm_setzero_ps());
+    radians = _mm_xor_ps(radians, _mm_and_ps(above, sign));
+    __m128 angle = _mm_add_ps(_mm_mul_ps(radians, _mm_set1_ps(TR_SHAPE_ANGLE_SCALE)), _mm_mul_ps(_mm_set1_ps(params->twist), depth));
+
+    // Pack into (distance << 8) | angle in 32-bit lanes; the offsets are
+    // added before masking, as in the scalar kernel.
+    __m128i byte_mask = _mm_set1_epi32(0xFF);
+    __m128i distance = _mm_and_si128(_mm_add_epi32(_mm_cvttps_epi32(depth), _mm_shuffle_epi32(offsets, _MM_SHUFFLE(1, 1, 1, 1))), byte_mask);
+    __m128i texel_x = _mm_and_si128(_mm_add_epi32(_mm_cvttps_epi32(angle), _mm_shuffle_epi32(offsets, _MM_SHUFFLE(0, 0, 0, 0))), byte_mask);
+    return _mm_or_si128(_mm_slli_epi32(distance, 8), texel_x);
+}
+
+
+void
+tunnel_shape_row_sse2(
+        uint32_t *pixel,
+        uint32_t count,
+        float dx,
+        float dy,
+        const struct TunnelShapeParams *params,
+        const uint32_t *texture,
+        int32_t rotation_offset,
+        int32_t translation_offset)
+{
+    __m128 y = _mm_set1_ps(dy * params->aspect);
+    __m128 step = _mm_set1_ps(params->pixel_size);
+    __m128 start = _mm_set1_ps(dx);
+    __m128i offsets = _mm_setr_epi32(rotation_offset, translation_offset, 0, 0);
+    __m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 index_float = _mm_cvtepi32_ps(_mm_add_epi32(lane, _mm_set1_epi32((int32_t)i)));
+        __m128 x = _mm_add_ps(start, _mm_mul_ps(index_float, step));
+        __m128i index = tunnel_shape_indices_sse2(x, y, params, offsets);
+
+        // SSE2 has no gather, so the fetch itself stays scalar.
+        uint32_t indices[4];
+        _mm_storeu_si128((__m128i *)indices, index);
+        for (uint32_t j = 0; j < 4; ++j)
+        {
+            pixel[i + j] = texture[indices[j]];
+        }
+    }
+
+    // NOTE: Passing dx + i * pixel_size would round differently from the
+    // vector lanes, so the tail is done here rather than by the scalar kernel.
+    for (; i < count; ++i)
+    {
+        __m128 x = _mm_set1_ps(dx + (float)i * params->pixel_size);
+        uint32_t index = (uint32_t)_mm_cvtsi128_si32(tunnel_shape_indices_sse2(x, y, params, offsets));
+        pixel[i] = texture[index];
+    }
+}
+
+
+TR_TARGET_AVX2 void
+tunnel_shape_row_avx2(
+        uint32_t *pixel,
+        uint32_t count,
+        float dx,
+        float dy,
+        const struct TunnelShapeParams *params,
+        const uint32_t *texture,
+        int32_t rotation_offset,
+        int32_t translation_offset)
+{
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 y = _mm256_set1_ps(dy * params->aspect);
+    __m256 abs_y = _mm256_andnot_ps(sign, y);
+    __m256 step = _mm256_set1_ps(params->pixel_size);
+    __m256 start = _mm256_set1_ps(dx);
+    __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i byte_mask = _mm256_set1_epi32(0xFF);
+    __m256 above = _mm256_cmp_ps(y, _mm256_setzero_ps(), _CMP_LT_OQ);
+
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 index_float = _mm256_cvtepi32_ps(_mm256_add_epi32(lane, _mm256_set1_epi32((int32_t)i)));
+        __m256 x = _mm256_add_ps(start, _mm256_mul_ps(index_float, step));
+        __m256 abs_x = _mm256_andnot_ps(sign, x);
+
+        __m256 round = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)));
+        __m256 square = _mm256_max_ps(abs_x, abs_y);
+        __m256 metric = _mm256_add_ps(round, _mm256_mul_ps(_mm256_sub_ps(square, round), _mm256_set1_ps(params->squareness)));
+        metric = _mm256_max_ps(metric, _mm256_set1_ps(1.0f));
+        __m256 depth = _mm256_div_ps(_mm256_set1_ps(params->depth_scale), metric);
+
+        __m256 smaller = _mm256_min_ps(abs_x, abs_y);
+        __m256 larger = _mm256_max_ps(square, _mm256_set1_ps(TR_SHAPE_MIN_DIVISOR));
+        __m256 ratio = _mm256_div_ps(smaller, larger);
+        __m256 ratio_squared = _mm256_mul_ps(ratio, ratio);
+        __m256 radians = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(TR_SHAPE_ATAN_C7), ratio_squared), _mm256_set1_ps(TR_SHAPE_ATAN_C5));
+        radians = _mm256_add_ps(_mm256_mul_ps(radians, ratio_squared), _mm256_set1_ps(TR_SHAPE_ATAN_C3));
+        radians = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(radians, ratio_squared), ratio), ratio);
+
+        __m256 steep = _mm256_cmp_ps(abs_y, abs_x, _CMP_GT_OQ);
+        radians = _mm256_blendv_ps(radians, _mm256_sub_ps(_mm256_set1_ps(TR_SHAPE_HALF_PI), radians), steep);
+        __m256 left = _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ);
+        radians = _mm256_blendv_ps(radians, _mm256_sub_ps(_mm256_set1_ps(TR_SHAPE_PI), radians), left);
+        radians = _mm256_xor_ps(radians, _mm256_and_ps(above, sign));
+        __m256 angle = _mm256_add_ps(_mm256_mul_ps(radians, _mm256_set1_ps(TR_SHAPE_ANGLE_SCALE)), _mm256_mul_ps(_mm256_set1_ps(params->twist), depth));
+
+        __m256i distance = _mm256_and_si256(_mm256_add_epi32(_mm256_cvttps_epi32(depth), _mm256_set1_epi32(translation_offset)), byte_mask);
+        __m256i texel_x = _mm256_and_si256(_mm256_add_epi32(_mm256_cvttps_epi32(angle), _mm256_set1_epi32(rotation_offset)), byte_mask);
+        __m256i index = _mm256_or_si256(_mm256_slli_epi32(distance, 8), texel_x);
+
+        _mm256_storeu_si256((__m256i *)(pixel + i), _mm256_i32gather_epi32((const int *)texture, index, 4));
+    }
+
+    // NOTE: See tunnel_shape_row_sse2.
+    __m128i offsets = _mm_setr_epi32(rotation_offset, translation_offset, 0, 0);
+    __m128 y_narrow = _mm256_castps256_ps128(y);
+    for (; i < count; ++i)
+    {
+        __m128 x = _mm_set1_ps(dx + (float)i * params->pixel_size);
+        uint32_t index = (uint32_t)_mm_cvtsi128_si32(tunnel_shape_indices_sse2(x, y_narrow, params, offsets));
+        pixel[i] = texture[index];
+    }
+}
+#endif
+
+#ifdef TR_SIMD_NEON
+#ifdef __aarch64__
+float32x4_t
+tunnel_sqrt_neon(float32x4_t value)
+{
+    return vsqrtq_f32(value);
+}
+
+
+float32x4_t
+tunnel_div_neon(float32x4_t numerator, float32x4_t denominator)
+{
+    return vdivq_f32(numerator, denominator);
+}
+#else
+// NOTE: ARMv7 NEON has no square root or division, only 8-bit estimates of
+// the reciprocal (square root). The functions below refine those with
+// Newton steps to within an ulp or two, then round the result to the nearest
+// float by comparing the exact operand with the midpoints between it and its
+// neighbours in 64-bit integers, so they return exactly what sqrtf and `/`
+// do for the positive normal operands the shape kernel passes them.
+
+// All ones in the lanes where x < y, for values below 2^63.
+uint32x2_t
+tunnel_less_u64_neon(uint64x2_t x, uint64x2_t y)
+{
+    int64x2_t difference = vreinterpretq_s64_u64(vsubq_u64(x, y));
+    return vmovn_u64(vreinterpretq_u64_s64(vshrq_n_s64(difference, 63)));
+}
+
+
+// The 24-bit significand of a positive normal float, with its leading one.
+uint32x4_t
+tunnel_significand_neon(uint32x4_t bits)
+{
+    return vorrq_u32(vandq_u32(bits, vdupq_n_u32(0x7FFFFF)), vdupq_n_u32(0x800000));
+}
+
+
+uint32x4_t
+tunnel_exponent_neon(uint32x4_t bits)
+{
+    return vshrq_n_u32(bits, 23);
+}
+
+
+// The midpoints between a positive float with significand Q and its
+// neighbours, in units of a quarter of its ulp: 4Q + 2 above, and 4Q - 2
+// below unless it's a power of two, where the float below is closer.
+void
+tunnel_midpoints_neon(uint32x4_t significand, uint32x4_t *above, uint32x4_t *below)
+{
+    uint32x4_t quadruple = vshlq_n_u32(significand, 2);
+    uint32x4_t power_of_two = vceqq_u32(significand, vdupq_n_u32(0x800000));
+    *above = vaddq_u32(quadruple, vdupq_n_u32(2));
+    *below = vsubq_u32(quadruple, vbslq_u32(power_of_two, vdupq_n_u32(1), vdupq_n_u32(2)));
+}
+
+
+// Step `estimate` one float up in the lanes where `target`, the exact
+// operand, is past the midpoint above it, and one down where it's short of
+// the one below. All are 64-bit integers in the same units, two lanes to a
+// half.
+uint32x4_t
+tunnel_round_step_neon(
+        uint32x4_t estimate,
+        uint64x2_t target_low,
+        uint64x2_t target_high,
+        uint64x2_t above_low,
+        uint64x2_t above_high,
+        uint64x2_t below_low,
+        uint64x2_t below_high)
+{
+    uint32x4_t up = vcombine_u32(tunnel_less_u64_neon(above_low, target_low), tunnel_less_u64_neon(above_high, target_high));
+    uint32x4_t down = vcombine_u32(tunnel_less_u64_neon(target_low, below_low), tunnel_less_u64_neon(target_high, below_high));
+    // NOTE: The masks are all ones, so subtracting adds one and vice versa.
+    return vaddq_u32(vsubq_u32(estimate, up), down);
+}
+
+
+float32x4_t
+tunnel_sqrt_neon(float32x4_t value)
+{
+    float32x4_t inverse = vrsqrteq_f32(value);
+    for (uint32_t i = 0; i < 3; ++i)
+    {
+        inverse = vmulq_f32(inverse, vrsqrtsq_f32(vmulq_f32(value, inverse), inverse));
+    }
+    uint32x4_t result = vreinterpretq_u32_f32(vmulq_f32(value, inverse));
+
+    // With s = S * 2^(es - 23) and a midpoint m = M * 2^(eq - 25),
+    // s > m^2 exactly when S * 2^(es - 2 eq + 27) > M^2.
+    uint32x4_t value_bits = vreinterpretq_u32_f32(value);
+    uint32x4_t value_significand = tunnel_significand_neon(value_bits);
+    for (uint32_t i = 0; i < 2; ++i)
+    {
+        uint32x4_t above;
+        uint32x4_t below;
+        tunnel_midpoints_neon(tunnel_significand_neon(result), &above, &below);
+        int32x4_t shift = vaddq_s32(
+                vreinterpretq_s32_u32(vsubq_u32(tunnel_exponent_neon(value_bits), vshlq_n_u32(tunnel_exponent_neon(result), 1))),
+                vdupq_n_s32(127 + 27));
+        uint64x2_t target_low = vshlq_u64(vmovl_u32(vget_low_u32(value_significand)), vmovl_s32(vget_low_s32(shift)));
+        uint64x2_t target_high = vshlq_u64(vmovl_u32(vget_high_u32(value_significand)), vmovl_s32(vget_high_s32(shift)));
+        result = tunnel_round_step_neon(result, target_low, target_high,
+                vmull_u32(vget_low_u32(above), vget_low_u32(above)), vmull_u32(vget_high_u32(above), vget_high_u32(above)),
+                vmull_u32(vget_low_u32(below), vget_low_u32(below)), vmull_u32(vget_high_u32(below), vget_high_u32(below)));
+    }
+
+    // The estimate of sqrt(0) is 0 * infinity.
+    uint32x4_t zero = vceqq_f32(value, vdupq_n_f32(0.0f));
+    return vbslq_f32(zero, vdupq_n_f32(0.0f), vreinterpretq_f32_u32(result));
+}
+
+
+float32x4_t
+tunnel_div_neon(float32x4_t numerator, float32x4_t denominator)
+{
+    float32x4_t inverse = vrecpeq_f32(denominator);
+    for (uint32_t i = 0; i < 3; ++i)
+    {
+        inverse = vmulq_f32(inverse, vrecpsq_f32(denominator, inverse));
+    }
+    uint32x4_t result = vreinterpretq_u32_f32(vmulq_f32(numerator, inverse));
+
+    // With a = A * 2^(ea - 23), b = B * 2^(eb - 23) and a midpoint
+    // m = M * 2^(eq - 25), a > m * b exactly when A * 2^(ea - eq - eb + 25) > M * B.
+    uint32x4_t numerator_bits = vreinterpretq_u32_f32(numerator);
+    uint32x4_t denominator_bits = vreinterpretq_u32_f32(denominator);
+    uint32x4_t numerator_significand = tunnel_significand_neon(numerator_bits);
+    uint32x4_t denominator_significand = tunnel_significand_neon(denominator_bits);
+    for (uint32_t i = 0; i < 2; ++i)
+    {
+        uint32x4_t above;
+        uint32x4_t below;
+        tunnel_midpoints_neon(tunnel_significand_neon(result), &above, &below);
+        uint32x4_t exponents = vaddq_u32(tunnel_exponent_neon(result), tunnel_exponent_neon(denominator_bits));
+        int32x4_t shift = vaddq_s32(
+                vreinterpretq_s32_u32(vsubq_u32(tunnel_exponent_neon(numerator_bits), exponents)),
+                vdupq_n_s32(127 + 25));
+        uint64x2_t target_low = vshlq_u64(vmovl_u32(vget_low_u32(numerator_significand)), vmovl_s32(vget_low_s32(shift)));
+        uint64x2_t target_high = vshlq_u64(vmovl_u32(vget_high_u32(numerator_significand)), vmovl_s32(vget_high_s32(shift)));
+        result = tunnel_round_step_neon(result, target_low, target_high,
+                vmull_u32(vget_low_u32(above), vget_low_u32(denominator_significand)),
+                vmull_u32(vget_high_u32(above), vget_high_u32(denominator_significand)),
+                vmull_u32(vget_low_u32(below), vget_low_u32(denominator_significand)),
+                vmull_u32(vget_high_u32(below), vget_high_u32(denominator_significand)));
+    }
+
+    uint32x4_t zero = vceqq_f32(numerator, vdupq_n_f32(0.0f));
+    return vbslq_f32(zero, vdupq_n_f32(0.0f), vreinterpretq_f32_u32(result));
+}
+#endif
+
+
+// Texel indices for the 4 pixels at x (see tunnel_shape_row_scalar).
+uint32x4_t
+tunnel_shape_indices_neon(
+        float32x4_t x,
+        float32x4_t y,
+        const struct TunnelShapeParams *params,
+        int32_t rotation_offset,
+        int32_t translation_offset)
+{
+    float32x4_t zero = vdupq_n_f32(0.0f);
+    float32x4_t abs_x = vabsq_f32(x);
+    float32x4_t abs_y = vabsq_f32(y);
+
+    float32x4_t round = tunnel_sqrt_neon(vaddq_f32(vmulq_f32(x, x), vmulq_f32(y, y)));
+    float32x4_t square = vmaxq_f32(abs_x, abs_y);
+    float32x4_t metric = vaddq_f32(round, vmulq_f32(vsubq_f32(square, round), vdupq_n_f32(params->squareness)));
+    metric = vmaxq_f32(metric, vdupq_n_f32(1.0f));
+    float32x4_t depth = tunnel_div_neon(vdupq_n_f32(params->depth_scale), metric);
+
+    float32x4_t smaller = vminq_f32(abs_x, abs_y);
+    float32x4_t larger = vmaxq_f32(square, vdupq_n_f32(TR_SHAPE_MIN_DIVISOR));
+    float32x4_t ratio = tunnel_div_neon(smaller, larger);
+    float32x4_t ratio_squared = vmulq_f32(ratio, ratio);
+    float32x4_t radians = vaddq_f32(vmulq_f32(vdupq_n_f32(TR_SHAPE_ATAN_C7), ratio_squared), vdupq_n_f32(TR_SHAPE_ATAN_C5));
+    radians = vaddq_f32(vmulq_f32(radians, ratio_squared), vdupq_n_f32(TR_SHAPE_ATAN_C3));
+    radians = vaddq_f32(vmulq_f32(vmulq_f32(radians, ratio_squared), ratio), ratio);
+
+    uint32x4_t steep = vcgtq_f32(abs_y, abs_x);
+    radians = vbslq_f32(steep, vsubq_f32(vdupq_n_f32(TR_SHAPE_HALF_PI), radians), radians);
+    uint32x4_t left = vcltq_f32(x, zero);
+    radians = vbslq_f32(left, vsubq_f32(vdupq_n_f32(TR_SHAPE_PI), radians), radians);
+    uint32x4_t above = vcltq_f32(y, zero);
+    radians = vbslq_f32(above, vnegq_f32(radians), radians);
+    float32x4_t angle = vaddq_f32(vmulq_f32(radians, vdupq_n_f32(TR_SHAPE_ANGLE_SCALE)), vmulq_f32(vdupq_n_f32(params->twist), depth));
+
+    uint32x4_t byte_mask = vdupq_n_u32(0xFF);
+    uint32x4_t distance = vandq_u32(vreinterpretq_u32_s32(vaddq_s32(vcvtq_s32_f32(depth), vdupq_n_s32(translation_offset))), byte_mask);
+    uint32x4_t texel_x = vandq_u32(vreinterpretq_u32_s32(vaddq_s32(vcvtq_s32_f32(angle), vdupq_n_s32(rotation_offset))), byte_mask);
+    return vorrq_u32(vshlq_n_u32(distance, 8), texel_x);
+}
+
+
+void
+tunnel_shape_row_neon(
+        uint32_t *pixel,
+        uint32_t count,
+        float dx,
+        float dy,
+        const struct TunnelShapeParams *params,
+        const uint32_t *texture,
+        int32_t rotation_offset,
+        int32_t translation_offset)
+{
+    static const int32_t lanes[4] = { 0, 1, 2, 3 };
+    float32x4_t y = vdupq_n_f32(dy * params->aspect);
+    float32x4_t step = vdupq_n_f32(params->pixel_size);
+    float32x4_t start = vdupq_n_f32(dx);
+    int32x4_t lane = vld1q_s32(lanes);
+
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        float32x4_t index_float = vcvtq_f32_s32(vaddq_s32(lane, vdupq_n_s32((int32_t)i)));
+        float32x4_t x = vaddq_f32(start, vmulq_f32(index_float, step));
+
+        uint32_t indices[4];
+        vst1q_u32(indices, tunnel_shape_indices_neon(x, y, params, rotation_offset, translation_offset));
+        for (uint32_t j = 0; j < 4; ++j)
+        {
+            pixel[i + j] = texture[indices[j]];
+        }
+    }
+
+    // NOTE: See tunnel_shape_row_sse2.
+    for (; i < count; ++i)
+    {
+        float32x4_t x = vdupq_n_f32(dx + (float)i * params->pixel_size);
+        uint32_t index = vgetq_lane_u32(tunnel_shape_indices_neon(x, y, params, rotation_offset, translation_offset), 0);
+        pixel[i] = texture[index];
+    }
+}
+#endif
+
+
+SDL_bool
+tunnel_kernel_always_supported(void)
+{
+    return SDL_TRUE;
+}
+
+
+static const struct TunnelKernel tunnel_kernels[] = {
+    { "scalar", tunnel_row_scalar, tunnel_row_morton_scalar, tunnel_shape_row_scalar, tunnel_kernel_always_supported },
+#ifdef TR_SIMD_X86
+    { "sse2", tunnel_row_sse2, tunnel_row_morton_sse2, tunnel_shape_row_sse2, SDL_HasSSE2 },
+    { "avx2", tunnel_row_avx2, tunnel_row_morton_avx2, tunnel_shape_row_avx2, SDL_HasAVX2 },
+#endif
+#ifdef TR_SIMD_NEON
+    { "neon", tunnel_row_neon, tunnel_row_morton_neon, tunnel_shape_row_neon, SDL_HasNEON },
+#endif
+};
+
+#define TR_TUNNEL_KERNEL_COUNT (sizeof(tunnel_kernels) / sizeof(tunnel_kernels[0]))
+
+
+// Pick the kernel by name, or the last (widest) one the CPU supports if
+// `name` is null.
+bool
+select_tunnel_kernel(const char *name)
+{
+    for (uint32_t i = 0; i < TR_TUNNEL_KERNEL_COUNT; ++i)
+    {
+        const struct TunnelKernel *kernel = &tunnel_kernels[i];
+        if (!kernel->is_supported())
+        {
+            continue;
+        }
+        if (!name || strcmp(name, kernel->name) == 0)
+        {
+            tunnel_kernel = kernel;
+            if (name)
+            {
+                break;
+            }
+        }
+    }
+
+    if (name && strcmp(name, tunnel_kernel->name) != 0)
+    {
+        TR_LOG_ERR("Tunnel kernel not available on this CPU: %s\n", name);
+        return false;
+    }
+
+    TR_LOG_DBG("Tunnel kernel: %s\n", tunnel_kernel->name);
+    return true;
+}
+
+
+// Run the table kernel over part of a row, fetching from whichever store the
+// texture keeps its texels in.
+void
+tunnel_kernel_row(
+        uint32_t *pixel,
+        const uint16_t *table_row,
+        int32_t step,
+        uint32_t count,
+        const struct Texture *texture,
+        uint16_t entry_mask,
+        int32_t rotation_offset,
+        int32_t translation_offset)
+{
+    if (texture->layout == TEXELS_MORTON)
+    {
+        tunnel_kernel->morton_function(pixel, table_row, step, count, texture->morton, texture->palette,
+                entry_mask, rotation_offset, translation_offset);
+    }
+    else
+    {
+        tunnel_kernel->function(pixel, table_row, step, count, &texture->colorized[0][0],
+                entry_mask, rotation_offset, translation_offset);
+    }
+}
+
+
+void
+render_tunnel_rows(
+        struct SDLOffscreenBuffer buffer,
+        const struct Texture *texture,
+        int32_t rotation_offset,
+        int32_t translation_offset,
+        uint32_t row_start,
+        uint32_t row_end)
+{
+    uint8_t *row = (uint8_t *)buffer.memory + row_start * buffer.pitch;
+
+    if (tunnel_engine == ENGINE_SHAPE)
+    {
+        float dx = (float)tunnel_shape.origin_x * tunnel_shape.pixel_size;
+        for (uint32_t y = row_start; y < row_end; ++y)
+        {
+            float dy = (float)((int32_t)y + tunnel_shape.origin_y) * tunnel_shape.pixel_size;
+            tunnel_kernel->shape_function(
+                    (uint32_t *)row,
+                    buffer.width,
+                    dx,
+                    dy,
+                    &tunnel_shape,
+                    &texture->colorized[0][0],
+                    rotation_offset,
+                    translation_offset);
+            row += buffer.pitch;
+        }
+        return;
+    }
+
+    if (transform.layout == TRANSFORM_FULL)
+    {
+        for (uint32_t y = row_start; y < row_end; ++y)
+        {
+            tunnel_kernel_row(
+                    (uint32_t *)row,
+                    transform.table + (y + transform.look_shift_y) * transform.stride + transform.look_shift_x,
+                    1,
+                    buffer.width,
+                    texture,
+                    0,
+                    rotation_offset,
+                    translation_offset);
+            row += buffer.pitch;
+        }
+        return;
+    }
+
+    // NOTE: Each row of the quadrant layout is split where it crosses the
+    // vertical center line. Right of it, entries are read forwards; left of
+    // it, backwards from |dx|. Mirrored angles are produced with the entry
+    // mask and an adjusted rotation, using -a = ~a + 1 (mod 256):
+    //
+    //     angle(dx, dy) = a           (dx >= 0, dy >= 0)
+    //     angle(dx, dy) = -a          (dx >= 0, dy < 0)
+    //     angle(dx, dy) = 128 - a     (dx < 0, dy >= 0)
+    //     angle(dx, dy) = a - 128     (dx < 0, dy < 0)
+    int32_t center_x = transform.width / 2;
+    int32_t center_y = transform.height / 2;
+    int32_t dx_start = transform.look_shift_x - center_x;
+    uint32_t left_count = dx_start < 0 ? (uint32_t)-dx_start : 0;
+    if (left_count > buffer.width)
+    {
+        left_count = buffer.width;
+    }
+    uint32_t right_count = buffer.width - left_count;
+    int32_t right_start = dx_start < 0 ? 0 : dx_start;
+
+    for (uint32_t y = row_start; y < row_end; ++y)
+    {
+        int32_t dy = (int32_t)y + transform.look_shift_y - center_y;
+        bool above = dy < 0;
+        const uint16_t *table_row = transform.table + (above ? -dy : dy) * transform.stride;
+        uint32_t *pixel = (uint32_t *)row;
+
+        if (left_count)
+        {
+            tunnel_kernel_row(
+                    pixel,
+                    table_row - dx_start,
+                    -1,
+                    left_count,
+                    texture,
+                    above ? 0 : 0xFF,
+                    rotation_offset + TR_TEX_WIDTH / 2 + (above ? 0 : 1),
+                    translation_offset);
+        }
+        if (right_count)
+        {
+            tunnel_kernel_row(
+                    pixel + left_count,
+                    table_row + right_start,
+                    1,
+                    right_count,
+                    texture,
+                    above ? 0xFF : 0,
+                    rotation_offset + (above ? 1 : 0),
+                    translation_offset);
+        }
+        row += buffer.pitch;
+    }
+}
+
+
+void
+render_tunnel(
+        struct SDLOffscreenBuffer buffer,
+        const struct Texture *texture,
+        int32_t rotation_offset,
+        int32_t translation_offset)
+{
+    render_tunnel_rows(buffer, texture, rotation_offset, translation_offset, 0, buffer.height);
+}
+
+
+// Like render_tunnel_rows, from a DeltaRenderer's index cache: each row is a
+// single run of the table kernel over contiguous entries.
+void
+render_tunnel_delta_rows(
+        struct SDLOffscreenBuffer buffer,
+        const struct Texture *texture,
+        const uint16_t *indices,
+        int32_t rotation_offset,
+        int32_t translation_offset,
+        uint32_t row_start,
+        uint32_t row_end)
+{
+    uint8_t *row = (uint8_t *)buffer.memory + row_start * buffer.pitch;
+    for (uint32_t y = row_start; y < row_end; ++y)
+    {
+        tunnel_kernel_row(
+                (uint32_t *)row,
+                indices + (size_t)y * buffer.width,
+                1,
+                buffer.width,
+                texture,
+                0,
+                rotation_offset,
+                translation_offset);
+        row += buffer.pitch;
+    }
+}
+
+
+void
+render_tunnel_delta(
+        struct SDLOffscreenBuffer buffer,
+        const struct Texture *texture,
+        const uint16_t *indices,
+        int32_t rotation_offset,
+        int32_t translation_offset)
+{
+    render_tunnel_delta_rows(buffer, texture, indices, rotation_offset, translation_offset, 0, buffer.height);
+}
+
+
+void
+thread_pool_do_tasks(struct ThreadPool *pool)
+{
+    for (;;)
+    {
+        uint32_t task_index = (uint32_t)SDL_AtomicAdd(&pool->next_task, 1);
+        if (task_index >= pool->task_count)
+        {
+            break;
+        }
+        pool->task_function(pool->task_data, task_index);
+    }
+}
+
+
+int
+thread_pool_worker(void *data)
+{
+    struct ThreadPool *pool = (struct ThreadPool *)data;
+
+    for (;;)
+    {
+        SDL_SemWait(pool->work_ready);
+        if (pool->quit)
+        {
+            break;
+        }
+        thread_pool_do_tasks(pool);
+        SDL_SemPost(pool->work_done);
+    }
+
+    return 0;
+}
+
+
+void
+thread_pool_init(struct ThreadPool *pool, uint32_t thread_count)
+{
+    if (thread_count == 0)
+    {
+        thread_count = SDL_GetCPUCount();
+    }
+    if (thread_count > TR_MAX_THREADS)
+    {
+        thread_count = TR_MAX_THREADS;
+    }
+
+    pool->worker_count = 0;
+    pool->quit = false;
+    pool->work_ready = SDL_CreateSemaphore(0);
+    pool->work_done = SDL_CreateSemaphore(0);
+
+    if (!pool->work_ready || !pool->work_done)
+    {
+        TR_LOG_ERR("SDL_CreateSemaphore failed: %s\n", SDL_GetError());
+        return;
+    }
+
+    for (uint32_t i = 0; i + 1 < thread_count; ++i)
+    {
+        SDL_Thread *worker = SDL_CreateThread(thread_pool_worker, "tr_worker", pool);
+        if (!worker)
+        {
+            TR_LOG_ERR("SDL_CreateThread failed: %s\n", SDL_GetError());
+            break;
+        }
+        pool->workers[pool->worker_count++] = worker;
+    }
+
+    TR_LOG_DBG("Thread pool: %u threads\n", pool->worker_count + 1);
+}
+
+
+void
+thread_pool_shutdown(struct ThreadPool *pool)
+{
+    pool->quit = true;
+    for (uint32_t i = 0; i < pool->worker_count; ++i)
+    {
+        SDL_SemPost(pool->work_ready);
+    }
+    for (uint32_t i = 0; i < pool->worker_count; ++i)
+    {
+        SDL_WaitThread(pool->workers[i], 0);
+    }
+    pool->worker_count = 0;
+
+    if (pool->work_ready)
+    {
+        SDL_DestroySemaphore(pool->work_ready);
+        pool->work_ready = 0;
+    }
+    if (pool->work_done)
+    {
+        SDL_DestroySemaphore(pool->work_done);
+        pool->work_done = 0;
+    }
+}
+
+
+// Run task_function for every index in [0, task_count) across the pool and
+// return once all of them have finished.
+void
+thread_pool_run(struct ThreadPool *pool, TaskFunction task_function, void *task_data, uint32_t task_count)
+{
+    pool->task_function = task_function;
+    pool->task_data = task_data;
+    pool->task_count = task_count;
+    SDL_AtomicSet(&pool->next_task, 0);
+
+    for (uint32_t i = 0; i < pool->worker_count; ++i)
+    {
+        SDL_SemPost(pool->work_ready);
+    }
+
+    thread_pool_do_tasks(pool);
+
+    for (uint32_t i = 0; i < pool->worker_count; ++i)
+    {
+        SDL_SemWait(pool->work_done);
+    }
+}
+
+
+void
+render_tunnel_band(void *data, uint32_t task_index)
+{
+    struct RenderTunnelJob *job = (struct RenderTunnelJob *)data;
+    uint32_t row_start = task_index * job->band_height;
+    uint32_t row_end = row_start + job->band_height;
+    if (row_end > job->buffer.height)
+    {
+        row_end = job->buffer.height;
+    }
+    if (job->indices)
+    {
+        render_tunnel_delta_rows(job->buffer, job->texture, job->indices, job->rotation_offset, job->translation_offset, row_start, row_end);
+    }
+    else
+    {
+        render_tunnel_rows(job->buffer, job->texture, job->rotation_offset, job->translation_offset, row_start, row_end);
+    }
+}
+
+
+// Split the job's frame into horizontal bands and draw them on the pool.
+void
+render_tunnel_job_run(struct ThreadPool *pool, struct RenderTunnelJob *job)
+{
+    uint32_t band_count = (pool->worker_count + 1) * TR_BANDS_PER_THREAD;
+    if (band_count > job->buffer.height)
+    {
+        band_count = job->buffer.height;
+    }
+    job->band_height = (job->buffer.height + band_count - 1) / band_count;
+    band_count = (job->buffer.height + job->band_height - 1) / job->band_height;
+
+    thread_pool_run(pool, render_tunnel_band, job, band_count);
+}
+
+
+// Same output as render_tunnel, but the frame is split into horizontal bands
+// that are drawn by the thread pool.
+void
+render_tunnel_threaded(
+        struct ThreadPool *pool,
+        struct SDLOffscreenBuffer buffer,
+        const struct Texture *texture,
+        int32_t rotation_offset,
+        int32_t translation_offset)
+{
+    if (pool->worker_count == 0)
+    {
+        render_tunnel(buffer, texture, rotation_offset, translation_offset);
+        return;
+    }
+
+    struct RenderTunnelJob job = {
+        .buffer = buffer,
+        .texture = texture,
+        .rotation_offset = rotation_offset,
+        .translation_offset = translation_offset,
+    };
+    render_tunnel_job_run(pool, &job);
+}
+
+
+// Same output as render_tunnel_delta, drawn by the thread pool.
+void
+render_tunnel_delta_threaded(
+        struct ThreadPool *pool,
+        struct SDLOffscreenBuffer buffer,
+        const struct Texture *texture,
+        const uint16_t *indices,
+        int32_t rotation_offset,
+        int32_t translation_offset)
+{
+    if (pool->worker_count == 0)
+    {
+        render_tunnel_delta(buffer, texture, indices, rotation_offset, translation_offset);
+        return;
+    }
+
+    struct RenderTunnelJob job = {
+        .buffer = buffer,
+        .texture = texture,
+        .rotation_offset = rotation_offset,
+        .translation_offset = translation_offset,
+        .indices = indices,
+    };
+    render_tunnel_job_run(pool, &job);
+}
+
+
+struct FrameGeometry
+frame_geometry_current(struct SDLOffscreenBuffer buffer)
+{
+    struct FrameGeometry geometry;
+    memset(&geometry, 0, sizeof(geometry));
+    geometry.engine = tunnel_engine;
+    geometry.width = buffer.width;
+    geometry.height = buffer.height;
+    if (tunnel_engine == ENGINE_SHAPE)
+    {
+        geometry.shape = tunnel_shape;
+    }
+    else
+    {
+        geometry.pixel_size = transform.pixel_size;
+        geometry.look_shift_x = transform.look_shift_x;
+        geometry.look_shift_y = transform.look_shift_y;
+    }
+    return geometry;
+}
+
+
+bool
+frame_geometry_equal(const struct FrameGeometry *a, const struct FrameGeometry *b)
+{
+    return a->engine == b->engine
+        && a->width == b->width
+        && a->height == b->height
+        && a->pixel_size == b->pixel_size
+        && a->look_shift_x == b->look_shift_x
+        && a->look_shift_y == b->look_shift_y
+        && a->shape.depth_scale == b->shape.depth_scale
+        && a->shape.twist == b->shape.twist
+        && a->shape.aspect == b->shape.aspect
+        && a->shape.squareness == b->shape.squareness
+        && a->shape.pixel_size == b->shape.pixel_size
+        && a->shape.origin_x == b->shape.origin_x
+        && a->shape.origin_y == b->shape.origin_y;
+}
+
+
+// Fill the index cache for the current geometry at this buffer's size, by
+// rendering the tunnel normally with index_texture. Returns false if the
+// cache can't be allocated.
+bool
+delta_renderer_build(struct DeltaRenderer *delta, struct ThreadPool *pool, struct SDLOffscreenBuffer buffer)
+{
+    delta->indices_valid = false;
+
+    size_t pixel_count = (size_t)buffer.width * buffer.height;
+    size_t size = pixel_count * TR_BYTES_PER_PIXEL;
+    if (size > delta->capacity)
+    {
+        if (!delta->indices_in_arena)
+        {
+            free(delta->indices);
+        }
+        delta->indices = malloc(size);
+        delta->indices_in_arena = false;
+        delta->capacity = delta->indices ? size : 0;
+        if (!delta->indices)
+        {
+            TR_LOG_ERR("Delta renderer: out of memory for the index cache\n");
+            return false;
+        }
+    }
+
+    if (!index_texture.colorized_valid)
+    {
+        for (uint32_t v = 0; v < TR_TEX_HEIGHT; ++v)
+        {
+            for (uint32_t u = 0; u < TR_TEX_WIDTH; ++u)
+            {
+                index_texture.colorized[v][u] = TR_TRANSFORM_PACK(v, u);
+            }
+        }
+        index_texture.layout = TEXELS_COLORIZED;
+        index_texture.colorized_valid = true;
+    }
+
+    struct SDLOffscreenBuffer target = buffer;
+    target.memory = delta->indices;
+    target.pitch = buffer.width * TR_BYTES_PER_PIXEL;
+    if (pool)
+    {
+        render_tunnel_threaded(pool, target, &index_texture, 0, 0);
+    }
+    else
+    {
+        render_tunnel(target, &index_texture, 0, 0);
+    }
+
+    // NOTE: Narrowed in place. Entry i is written over bytes [2i, 2i + 2),
+    // which only overlaps 32-bit entries that have already been read, and
+    // memcpy keeps the compiler from assuming the two views don't alias.
+    const uint8_t *wide = (const uint8_t *)delta->indices;
+    for (size_t i = 0; i < pixel_count; ++i)
+    {
+        uint32_t index;
+        memcpy(&index, wide + i * TR_BYTES_PER_PIXEL, sizeof(index));
+        delta->indices[i] = (uint16_t)index;
+    }
+
+    delta->cached = frame_geometry_current(buffer);
+    delta->indices_valid = true;
+    ++delta->cache_builds;
+    return true;
+}
+
+
+// Draw the tunnel into `buffer`: from the index cache when it matches the
+// current geometry, building it first if the geometry is the same as last
+// frame's, and the usual way otherwise.
+void
+delta_render(
+        struct DeltaRenderer *delta,
+        struct ThreadPool *pool,
+        struct SDLOffscreenBuffer buffer,
+        const struct Texture *texture,
+        int32_t rotation_offset,
+        int32_t translation_offset)
+{
+    if (!delta->enabled)
+    {
+        render_tunnel_threaded(pool, buffer, texture, rotation_offset, translation_offset);
+        return;
+    }
+
+    struct FrameGeometry geometry = frame_geometry_current(buffer);
+    bool cached = delta->indices_valid && frame_geometry_equal(&geometry, &delta->cached);
+    if (!cached && frame_geometry_equal(&geometry, &delta->previous))
+    {
+        cached = delta_renderer_build(delta, pool, buffer);
+    }
+    delta->previous = geometry;
+
+    if (cached)
+    {
+        render_tunnel_delta_threaded(pool, buffer, texture, delta->indices, rotation_offset, translation_offset);
+        ++delta->delta_frames;
+    }
+    else
+    {
+        render_tunnel_threaded(pool, buffer, texture, rotation_offset, translation_offset);
+        ++delta->full_frames;
+    }
+}
+
+
+struct FrameKey
+frame_key_current(struct SDLOffscreenBuffer buffer, const struct Texture *texture, int32_t rotation_offset, int32_t translation_offset)
+{
+    struct FrameKey key;
+    memset(&key, 0, sizeof(key));
+    key.geometry = frame_geometry_current(buffer);
+    key.buffer_generation = buffer.generation;
+    key.texture_version = texture->version;
+    key.rotation_offset = rotation_offset;
+    key.translation_offset = translation_offset;
+    key.overlay = global_profiler.overlay;
+    return key;
+}
+
+
+// Whether the frame for `key` is already on screen, so that drawing and
+// presenting it can be skipped. Otherwise, remember it as the next one to
+// be presented.
+bool
+delta_renderer_unchanged(struct DeltaRenderer *delta, const struct FrameKey *key)
+{
+    // NOTE: The overlay's bars move every frame.
+    bool unchanged = delta->enabled
+        && delta->presented_valid
+        && !key->overlay
+        && frame_geometry_equal(&key->geometry, &delta->presented.geometry)
+        && key->buffer_generation == delta->presented.buffer_generation
+        && key->texture_version == delta->presented.texture_version
+        && key->rotation_offset == delta->presented.rotation_offset
+        && key->translation_offset == delta->presented.translation_offset
+        && key->overlay == delta->presented.overlay;
+    if (unchanged)
+    {
+        ++delta->skipped_frames;
+    }
+    else
+    {
+        delta->presented = *key;
+        delta->presented_valid = true;
+    }
+    return unchanged;
+}
+
+
+void
+delta_renderer_report(struct DeltaRenderer *delta)
+{
+    if (!delta->enabled || delta->full_frames + delta->delta_frames + delta->skipped_frames == 0)
+    {
+        return;
+    }
+    TR_LOG_DBG("Redraw: %" PRIu64 " full, %" PRIu64 " from the index cache, %" PRIu64 " skipped frames, %" PRIu64 " cache builds\n",
+            delta->full_frames, delta->delta_frames, delta->skipped_frames, delta->cache_builds);
+}
+
+
+// Take the index cache for a back buffer of width x height from `arena`
+// instead of allocating it, and drop the current one.
+void
+delta_renderer_use_arena(struct DeltaRenderer *delta, struct Arena *arena, int32_t width, int32_t height)
+{
+    if (!delta->indices_in_arena)
+    {
+        free(delta->indices);
+    }
+    delta->capacity = (size_t)width * height * TR_BYTES_PER_PIXEL;
+    delta->indices = arena_push(arena, delta->capacity);
+    delta->indices_in_arena = true;
+    delta->indices_valid = false;
+}
+
+
+void
+delta_renderer_free(struct DeltaRenderer *delta)
+{
+    if (!delta->indices_in_arena)
+    {
+        free(delta->indices);
+    }
+    delta->indices = 0;
+    delta->indices_in_arena = false;
+    delta->capacity = 0;
+    delta->indices_valid = false;
+    delta->presented_valid = false;
+    memset(&delta->previous, 0, sizeof(delta->previous));
+}
+
+
+struct SDLWindowDimension
+sdl_get_window_dimension(SDL_Window *window)
+{
+    int w = 0;
+    int h = 0;
+    SDL_GetWindowSize(window, &w, &h);
+    struct SDLWindowDimension result = { .width = w, .height = h };
+    return result;
+}
+
+
+void
+transform_free(struct TransformData *t)
+{
+    if (t->mapping)
+    {
+        munmap(t->mapping, t->mapping_size);
+        t->mapping = 0;
+        t->mapping_size = 0;
+        t->table = 0;
+    }
+    if (t->table && !t->table_in_arena)
+    {
+        free(t->table);
+    }
+    t->table = 0;
+    t->table_in_arena = false;
+}
+
+
+// The packed entry for the pixel (quadrant_x, quadrant_y) right of and below
+// the center.
+uint16_t
+transform_quadrant_entry(float pixel_size, int32_t quadrant_x, int32_t quadrant_y)
+{
+    float dist_from_center = pixel_size * sqrtf((float)(quadrant_x * quadrant_x + quadrant_y * quadrant_y));
+    float angle_from_positive_x_axis = atan2f((float)quadrant_y, (float)quadrant_x) / TR_PI32;
+
+    // NOTE: The center pixel is infinitely far down the tunnel.
+    int32_t distance = dist_from_center > 0.0f ? (int32_t)(TR_TUNNEL_RATIO * TR_TEX_HEIGHT / dist_from_center) % TR_TEX_HEIGHT : 0;
+    int32_t angle = (int32_t)(0.5f * TR_TEX_WIDTH * angle_from_positive_x_axis);
+    return TR_TRANSFORM_PACK(distance, angle);
+}
+
+
+// Fill in the table rows that are |dy| = quadrant_y for every |dy| in
+// [quadrant_y_start, quadrant_y_end). Distance and angle are only computed
+// for the quadrant with dx >= 0 and dy >= 0; in the full layout the other
+// three quadrants are mirror images:
+//
+//     distance(+-dx, +-dy) = distance(dx, dy)
+//     angle(-dx, dy) = 128 - angle(dx, dy)
+//     angle(dx, -dy) = -angle(dx, dy)
+//
+// (with a half turn being 128 angle units).
+void
+transform_build_rows(struct TransformData *t, int32_t quadrant_y_start, int32_t quadrant_y_end)
+{
+    int32_t center_x = t->width / 2;
+    int32_t center_y = t->height / 2;
+
+    if (t->layout == TRANSFORM_QUADRANT)
+    {
+        for (int32_t quadrant_y = quadrant_y_start; quadrant_y < quadrant_y_end; ++quadrant_y)
+        {
+            uint16_t *row = t->table + quadrant_y * t->stride;
+            for (int32_t quadrant_x = 0; quadrant_x <= center_x; ++quadrant_x)
+            {
+                row[quadrant_x] = transform_quadrant_entry(t->pixel_size, quadrant_x, quadrant_y);
+            }
+        }
+        return;
+    }
+
+    for (int32_t quadrant_y = quadrant_y_start; quadrant_y < quadrant_y_end; ++quadrant_y)
+    {
+        // The table spans dy in [-center_y, center_y), so the bottom row has
+        // no mirror image and the top (dy = 0) row is its own.
+        uint16_t *row_below = quadrant_y < center_y ? t->table + (center_y + quadrant_y) * t->stride : 0;
+        uint16_t *row_above = quadrant_y > 0 ? t->table + (center_y - quadrant_y) * t->stride : 0;
+
+        for (int32_t quadrant_x = 0; quadrant_x <= center_x; ++quadrant_x)
+        {
+            uint16_t entry = transform_quadrant_entry(t->pixel_size, quadrant_x, quadrant_y);
+            int32_t distance = TR_TRANSFORM_DISTANCE(entry);
+            int32_t angle = TR_TRANSFORM_ANGLE(entry);
+            int32_t mirrored_angle = TR_TEX_WIDTH / 2 - angle;
+
+            int32_t right = center_x + quadrant_x;
+            int32_t left = center_x - quadrant_x;
+            bool has_right = quadrant_x < center_x;
+            bool has_left = quadrant_x > 0;
+
+            if (row_below)
+            {
+                if (has_right)
+                {
+                    row_below[right] = TR_TRANSFORM_PACK(distance, angle);
+                }
+                if (has_left)
+                {
+                    row_below[left] = TR_TRANSFORM_PACK(distance, mirrored_angle);
+                }
+            }
+            if (row_above)
+            {
+                if (has_right)
+                {
+                    row_above[right] = TR_TRANSFORM_PACK(distance, -angle);
+                }
+                if (has_left)
+                {
+                    row_above[left] = TR_TRANSFORM_PACK(distance, -mirrored_angle);
+                }
+            }
+        }
+    }
+}
+
+
+struct TransformBuildJob
+{
+    struct TransformData *transform;
+    int32_t band_height;
+};
+
+
+void
+transform_build_band(void *data, uint32_t task_index)
+{
+    struct TransformBuildJob *job = (struct TransformBuildJob *)data;
+    int32_t quadrant_height = job->transform->height / 2 + 1;
+    int32_t quadrant_y_start = (int32_t)task_index * job->band_height;
+    int32_t quadrant_y_end = quadrant_y_start + job->band_height;
+    if (quadrant_y_end > quadrant_height)
+    {
+        quadrant_y_end = quadrant_height;
+    }
+    transform_build_rows(job->transform, quadrant_y_start, quadrant_y_end);
+}
+
+
+// Fill in everything but the table itself for a back buffer of the given
+// size, in the current transform_layout.
+void
+transform_set_size(struct TransformData *t, int32_t window_width, int32_t window_height, float pixel_size)
+{
+    t->width = 2 * window_width;
+    t->height = 2 * window_height;
+    t->look_shift_x = window_width / 2;
+    t->look_shift_y = window_height / 2;
+    t->pixel_size = pixel_size;
+    t->layout = transform_layout;
+    if (t->layout == TRANSFORM_QUADRANT)
+    {
+        t->stride = window_width + 1;
+        t->rows = window_height + 1;
+    }
+    else
+    {
+        t->stride = t->width;
+        t->rows = t->height;
+    }
+}
+
+
+size_t
+transform_table_size(const struct TransformData *t)
+{
+    return (size_t)t->stride * t->rows * sizeof(uint16_t);
+}
+
+
+// Build the tables for a back buffer of the given size, each of whose pixels
+// covers `pixel_size` window pixels. If `pool` is non-null, the work is split
+// across its threads. The table is taken from `arena` if it's non-null,
+// which must have room for it, and malloc'd otherwise. Returns false if it
+// can't be allocated.
+bool
+transform_build(struct TransformData *t, int32_t window_width, int32_t window_height, float pixel_size, struct ThreadPool *pool, struct Arena *arena)
+{
+    transform_free(t);
+
+    transform_set_size(t, window_width, window_height, pixel_size);
+    size_t size = transform_table_size(t);
+    t->table = arena ? arena_push(arena, size) : malloc(size);
+    t->table_in_arena = arena != 0;
+    if (!t->table)
+    {
+        TR_LOG_ERR("Out of memory for the %dx%d transform tables\n", window_width, window_height);
+        return false;
+    }
+
+    int32_t quadrant_height = window_height + 1;
+    if (!pool || pool->worker_count == 0)
+    {
+        transform_build_rows(t, 0, quadrant_height);
+        return true;
+    }
+
+    int32_t band_count = (int32_t)(pool->worker_count + 1) * TR_BANDS_PER_THREAD;
+    struct TransformBuildJob job = {
+        .transform = t,
+        .band_height = (quadrant_height + band_count - 1) / band_count,
+    };
+    band_count = (quadrant_height + job.band_height - 1) / job.band_height;
+
+    thread_pool_run(pool, transform_build_band, &job, band_count);
+    return true;
+}
+
+
+void
+transform_cache_header(struct TransformCacheHeader *header, int32_t window_width, int32_t window_height, float pixel_size)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, TR_CACHE_MAGIC, sizeof(TR_CACHE_MAGIC));
+    header->version = TR_CACHE_VERSION;
+    header->entry_size = sizeof(uint16_t);
+    header->window_width = window_width;
+    header->window_height = window_height;
+    header->ratio = TR_TUNNEL_RATIO;
+    header->tex_width = TR_TEX_WIDTH;
+    header->tex_height = TR_TEX_HEIGHT;
+    header->pixel_size = pixel_size;
+    header->layout = transform_layout;
+}
+
+
+// $XDG_CACHE_HOME/tunnel-runner, falling back to ~/.cache/tunnel-runner.
+bool
+transform_cache_dir(char *path, size_t path_size)
+{
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    int length = 0;
+    if (cache_home && cache_home[0] == '/')
+    {
+        length = snprintf(path, path_size, "%s/" TR_CACHE_DIR_NAME, cache_home);
+    }
+    else
+    {
+        const char *home = getenv("HOME");
+        if (!home || !home[0])
+        {
+            return false;
+        }
+        length = snprintf(path, path_size, "%s/.cache/" TR_CACHE_DIR_NAME, home);
+    }
+    return length > 0 && (size_t)length < path_size;
+}
+
+
+bool
+transform_cache_path(char *path, size_t path_size, int32_t window_width, int32_t window_height, float pixel_size)
+{
+    char dir[TR_MAX_PATH];
+    if (!transform_cache_dir(dir, sizeof(dir)))
+    {
+        return false;
+    }
+    int length = snprintf(path, path_size, "%s/transform-v%d-%s-%dx%d-p%g-r%g-t%dx%d.bin",
+            dir, TR_CACHE_VERSION, transform_layout == TRANSFORM_QUADRANT ? "quadrant" : "full",
+            window_width, window_height, (double)pixel_size,
+            (double)TR_TUNNEL_RATIO, TR_TEX_WIDTH, TR_TEX_HEIGHT);
+    return length > 0 && (size_t)length < path_size;
+}
+
+
+// Map a cached table for this size and pixel size, if there is a valid one.
+bool
+transform_cache_load(struct TransformData *t, int32_t window_width, int32_t window_height, float pixel_size)
+{
+    char path[TR_MAX_PATH];
+    if (!transform_cache_path(path, sizeof(path), window_width, window_height, pixel_size))
+    {
+        return false;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct TransformData loaded = {0};
+    transform_set_size(&loaded, window_width, window_height, pixel_size);
+    size_t file_size = sizeof(struct TransformCacheHeader) + transform_table_size(&loaded);
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || (size_t)file_stat.st_size != file_size)
+    {
+        close(fd);
+        return false;
+    }
+
+    void *mapping = mmap(0, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        return false;
+    }
+
+    struct TransformCacheHeader expected;
+    transform_cache_header(&expected, window_width, window_height, pixel_size);
+    if (memcmp(mapping, &expected, sizeof(expected)) != 0)
+    {
+        TR_LOG_DBG("Ignoring stale transform cache: %s\n", path);
+        munmap(mapping, file_size);
+        return false;
+    }
+
+    transform_free(t);
+    *t = loaded;
+    t->mapping = mapping;
+    t->mapping_size = file_size;
+    t->table = (uint16_t *)((uint8_t *)mapping + sizeof(struct TransformCacheHeader));
+
+    TR_LOG_DBG("Loaded transform cache: %s\n", path);
+    return true;
+}
+
+
+// Like `mkdir -p`.
+bool
+make_directories(char *path)
+{
+    for (char *slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        bool made = mkdir(path, 0755) == 0 || errno == EEXIST;
+        *slash = '/';
+        if (!made)
+        {
+            return false;
+        }
+    }
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+
+// Write the table to a temporary file and rename it into place, so that
+// other instances never map a partially written cache file.
+void
+transform_cache_save(struct TransformData *t, int32_t window_width, int32_t window_height, float pixel_size)
+{
+    char dir[TR_MAX_PATH];
+    char path[TR_MAX_PATH];
+    char temp_path[TR_MAX_PATH + 32];
+    if (!t->table
+            || !transform_cache_dir(dir, sizeof(dir))
+            || !transform_cache_path(path, sizeof(path), window_width, window_height, pixel_size))
+    {
+        return;
+    }
+
+    if (!make_directories(dir))
+    {
+        TR_LOG_ERR("Can't create cache directory %s: %s\n", dir, strerror(errno));
+        return;
+    }
+
+    snprintf(temp_path, sizeof(temp_path), "%s.%ld.tmp", path, (long)getpid());
+    FILE *file = fopen(temp_path, "wb");
+    if (!file)
+    {
+        TR_LOG_ERR("Can't write transform cache %s: %s\n", temp_path, strerror(errno));
+        return;
+    }
+
+    struct TransformCacheHeader header;
+    transform_cache_header(&header, window_width, window_height, pixel_size);
+    size_t entry_count = (size_t)t->stride * t->rows;
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(t->table, sizeof(uint16_t), entry_count, file) == entry_count;
+    written = (fclose(file) == 0) && written;
+
+    if (!written || rename(temp_path, path) != 0)
+    {
+        TR_LOG_ERR("Can't write transform cache %s: %s\n", path, strerror(errno));
+        remove(temp_path);
+        return;
+    }
+
+    TR_LOG_DBG("Saved transform cache: %s\n", path);
+}
+
+
+// Map the tables from the cache if they're there, otherwise build them (in
+// `arena` if it's non-null) and save them to it. The shape engine doesn't
+// read them, so with it this only sets the size. Returns false if they can't
+// be allocated.
+bool
+transform_load_or_build(struct TransformData *t, int32_t window_width, int32_t window_height, float pixel_size, struct ThreadPool *pool, struct Arena *arena)
+{
+    if (tunnel_engine == ENGINE_SHAPE)
+    {
+        transform_free(t);
+        transform_set_size(t, window_width, window_height, pixel_size);
+        return true;
+    }
+
+    if (transform_cache_enabled && transform_cache_load(t, window_width, window_height, pixel_size))
+    {
+        return true;
+    }
+
+    if (!transform_build(t, window_width, window_height, pixel_size, pool, arena))
+    {
+        return false;
+    }
+
+    if (transform_cache_enabled)
+    {
+        transform_cache_save(t, window_width, window_height, pixel_size);
+    }
+    return true;
+}
+
+
+// The back buffer size for a window rendered at `scale`.
+struct SDLWindowDimension
+render_dimension(int32_t window_width, int32_t window_height, float scale)
+{
+    struct SDLWindowDimension result = {
+        .width = (int32_t)((float)window_width * scale + 0.5f),
+        .height = (int32_t)((float)window_height * scale + 0.5f),
+    };
+    if (result.width < 1)
+    {
+        result.width = 1;
+    }
+    if (result.height < 1)
+    {
+        result.height = 1;
+    }
+    return result;
+}
+
+
+// Arena space for a back buffer of width x height and the delta renderer's
+// index cache for it, which is the same size.
+size_t
+back_buffer_arena_size(int32_t width, int32_t height)
+{
+    return 2 * arena_align((size_t)width * height * TR_BYTES_PER_PIXEL);
+}
+
+
+// Arena space for the tables of a back buffer of width x height, which
+// transform_load_or_build doesn't make for the shape engine.
+size_t
+transform_arena_size(int32_t width, int32_t height, float pixel_size)
+{
+    if (tunnel_engine == ENGINE_SHAPE)
+    {
+        return 0;
+    }
+
+    struct TransformData tables = {0};
+    transform_set_size(&tables, width, height, pixel_size);
+    return arena_align(transform_table_size(&tables));
+}
+
+
+// Recreate the texture at the new size and take the buffer memory from
+// `arena`, which must have room for it.
+void
+sdl_resize_back_buffer(struct SDLOffscreenBuffer *buffer, SDL_Renderer *renderer, int32_t window_width, int32_t window_height, float scale, struct Arena *arena)
+{
+    if (buffer->texture)
+    {
+        SDL_DestroyTexture(buffer->texture);
+    }
+
+    buffer->texture = SDL_CreateTexture(
+            renderer,
+            SDL_PIXELFORMAT_ARGB8888,
+            SDL_TEXTUREACCESS_STREAMING,
+            window_width, window_height);
+
+    buffer->width = window_width;
+    buffer->height = window_height;
+    buffer->pitch = window_width * TR_BYTES_PER_PIXEL;
+    buffer->scale = scale;
+    ++buffer->generation;
+
+    buffer->memory = arena_push(arena, (size_t)window_width * window_height * TR_BYTES_PER_PIXEL);
+}
+
+
+// Resize the main window's back buffer, tables and index cache, all in the
+// resolution arena. Returns false, and leaves them all as they were, if
+// there isn't memory for the new size.
+bool
+sdl_resize_texture(struct SDLOffscreenBuffer *buffer, SDL_Renderer *renderer, int32_t window_width, int32_t window_height, float scale)
+{
+    struct SDLWindowDimension render = render_dimension(window_width, window_height, scale);
+    size_t size = back_buffer_arena_size(render.width, render.height) + transform_arena_size(render.width, render.height, 1.0f / scale);
+    if (!arena_reserve(&resolution_arena, size))
+    {
+        return false;
+    }
+
+    sdl_resize_back_buffer(buffer, renderer, render.width, render.height, scale, &resolution_arena);
+    delta_renderer_use_arena(&global_delta_renderer, &resolution_arena, render.width, render.height);
+    // NOTE: Can't fail, the arena has room for the tables.
+    transform_load_or_build(&transform, render.width, render.height, 1.0f / scale, &global_thread_pool, &resolution_arena);
+    return true;
+}
+
+
+int
+transform_rebuilder_thread(void *data)
+{
+    struct TransformRebuilder *rebuilder = (struct TransformRebuilder *)data;
+
+    SDL_LockMutex(rebuilder->lock);
+    for (;;)
+    {
+        while (!rebuilder->has_request && !rebuilder->quit)
+        {
+            SDL_CondWait(rebuilder->changed, rebuilder->lock);
+        }
+        if (rebuilder->quit)
+        {
+            break;
+        }
+
+        // Coalesce: keep waiting until the size has been stable for a while,
+        // so a drag-resize only rebuilds for the size it ends on.
+        do
+        {
+            rebuilder->has_request = false;
+            SDL_CondWaitTimeout(rebuilder->changed, rebuilder->lock, TR_RESIZE_DEBOUNCE_MS);
+        } while (rebuilder->has_request && !rebuilder->quit);
+        if (rebuilder->quit)
+        {
+            break;
+        }
+
+        float scale = rebuilder->requested_scale;
+        struct SDLWindowDimension render = render_dimension(rebuilder->requested_width, rebuilder->requested_height, scale);
+        // NOTE: The render loop is still using the resolution arena, so build
+        // in the one it swapped out last time, if there is one.
+        struct Arena arena = rebuilder->spare_arena;
+        memset(&rebuilder->spare_arena, 0, sizeof(rebuilder->spare_arena));
+        SDL_UnlockMutex(rebuilder->lock);
+
+        size_t size = back_buffer_arena_size(render.width, render.height) + transform_arena_size(render.width, render.height, 1.0f / scale);
+        if (!arena_reserve(&arena, size))
+        {
+            // Keep rendering at the old size.
+            SDL_LockMutex(rebuilder->lock);
+            arena_release(&rebuilder->spare_arena);
+            rebuilder->spare_arena = arena;
+            continue;
+        }
+
+        // The thread pool belongs to the render loop, so build serially here.
+        struct TransformData built = {0};
+        TR_LOG_DBG("Rebuilding transform tables for %dx%d (scale %g)\n", render.width, render.height, (double)scale);
+        transform_load_or_build(&built, render.width, render.height, 1.0f / scale, 0, &arena);
+
+        SDL_LockMutex(rebuilder->lock);
+        // Wait for the render loop to pick up the previous result.
+        while (rebuilder->has_result && !rebuilder->quit)
+        {
+            SDL_CondWait(rebuilder->changed, rebuilder->lock);
+        }
+        if (rebuilder->quit || rebuilder->has_request)
+        {
+            // Either shutting down, or the window was resized again while
+            // we were building and this result is already stale.
+            transform_free(&built);
+            arena_release(&rebuilder->spare_arena);
+            rebuilder->spare_arena = arena;
+            continue;
+        }
+        rebuilder->result = built;
+        rebuilder->result_arena = arena;
+        rebuilder->result_width = render.width;
+        rebuilder->result_height = render.height;
+        rebuilder->result_scale = scale;
+        rebuilder->has_result = true;
+    }
+    SDL_UnlockMutex(rebuilder->lock);
+
+    return 0;
+}
+
+
+bool
+transform_rebuilder_init(struct TransformRebuilder *rebuilder)
+{
+    rebuilder->lock = SDL_CreateMutex();
+    rebuilder->changed = SDL_CreateCond();
+    if (!rebuilder->lock || !rebuilder->changed)
+    {
+        TR_LOG_ERR("Can't create transform rebuilder: %s\n", SDL_GetError());
+        return false;
+    }
+
+    rebuilder->thread = SDL_CreateThread(transform_rebuilder_thread, "tr_rebuilder", rebuilder);
+    if (!rebuilder->thread)
+    {
+        TR_LOG_ERR("SDL_CreateThread failed: %s\n", SDL_GetError());
+        return false;
+    }
+
+    return true;
+}
+
+
+void
+transform_rebuilder_shutdown(struct TransformRebuilder *rebuilder)
+{
+    if (rebuilder->thread)
+    {
+        SDL_LockMutex(rebuilder->lock);
+        rebuilder->quit = true;
+        SDL_CondBroadcast(rebuilder->changed);
+        SDL_UnlockMutex(rebuilder->lock);
+        SDL_WaitThread(rebuilder->thread, 0);
+        rebuilder->thread = 0;
+    }
+
+    transform_free(&rebuilder->result);
+    arena_release(&rebuilder->result_arena);
+    arena_release(&rebuilder->spare_arena);
+    rebuilder->has_result = false;
+
+    if (rebuilder->changed)
+    {
+        SDL_DestroyCond(rebuilder->changed);
+        rebuilder->changed = 0;
+    }
+    if (rebuilder->lock)
+    {
+        SDL_DestroyMutex(rebuilder->lock);
+        rebuilder->lock = 0;
+    }
+}
+
+
+void
+transform_rebuilder_request(struct TransformRebuilder *rebuilder, int32_t window_width, int32_t window_height, float scale)
+{
+    SDL_LockMutex(rebuilder->lock);
+    rebuilder->requested_width = window_width;
+    rebuilder->requested_height = window_height;
+    rebuilder->requested_scale = scale;
+    rebuilder->has_request = true;
+    SDL_CondBroadcast(rebuilder->changed);
+    SDL_UnlockMutex(rebuilder->lock);
+}
+
+
+// Called once per frame from the render loop. If new tables are ready, swap
+// them in and resize the back buffer to match.
+void
+transform_rebuilder_poll(struct TransformRebuilder *rebuilder, struct SDLOffscreenBuffer *buffer, SDL_Renderer *renderer)
+{
+    if (!rebuilder->thread || SDL_LockMutex(rebuilder->lock) != 0)
+    {
+        return;
+    }
+
+    struct TransformData old = {0};
+    if (rebuilder->has_result)
+    {
+        old = transform;
+        transform = rebuilder->result;
+        memset(&rebuilder->result, 0, sizeof(rebuilder->result));
+        rebuilder->has_result = false;
+
+        // The old buffer, tables and index cache aren't used after this, so
+        // their arena is the next build's.
+        arena_release(&rebuilder->spare_arena);
+        rebuilder->spare_arena = resolution_arena;
+        resolution_arena = rebuilder->result_arena;
+        memset(&rebuilder->result_arena, 0, sizeof(rebuilder->result_arena));
+        sdl_resize_back_buffer(buffer, renderer, rebuilder->result_width, rebuilder->result_height, rebuilder->result_scale, &resolution_arena);
+        delta_renderer_use_arena(&global_delta_renderer, &resolution_arena, rebuilder->result_width, rebuilder->result_height);
+        SDL_CondBroadcast(rebuilder->changed);
+    }
+    SDL_UnlockMutex(rebuilder->lock);
+
+    transform_free(&old);
+}
+
+
+// Resize the back buffer and tables for this window size at the current
+// render scale, in the background unless --sync-resize was given.
+void
+sdl_request_resize(SDL_Renderer *renderer, int32_t window_width, int32_t window_height)
+{
+    if (transform_rebuilder.thread)
+    {
+        transform_rebuilder_request(&transform_rebuilder, window_width, window_height, render_scale);
+    }
+    else if (!sdl_resize_texture(&global_back_buffer, renderer, window_width, window_height, render_scale))
+    {
+        TR_LOG_ERR("Keeping the %ux%u back buffer\n", global_back_buffer.width, global_back_buffer.height);
+    }
+}
+
+
+void
+sdl_present(SDL_Renderer *renderer, struct SDLOffscreenBuffer buffer)
+{
+    uint64_t start_ns = profile_begin();
+    SDL_RenderCopy(renderer, buffer.texture, 0, 0);
+    SDL_RenderPresent(renderer);
+    profile_end(PROFILE_TRACK_MAIN, PROFILE_PRESENT, start_ns);
+}
+
+
+void
+sdl_update_window(SDL_Renderer *renderer, struct SDLOffscreenBuffer buffer)
+{
+    uint64_t start_ns = profile_begin();
+    if (SDL_UpdateTexture(buffer.texture, 0, buffer.memory, buffer.pitch))
+    {
+        TR_LOG_ERR("SDL_UpdateTexture failed: %s\n", SDL_GetError());
+    }
+    profile_end(PROFILE_TRACK_MAIN, PROFILE_UPLOAD, start_ns);
+
+    sdl_present(renderer, buffer);
+}
+
+
+// Point `locked` at the streaming texture's pixels. Must be followed by
+// SDL_UnlockTexture once the frame is drawn.
+bool
+sdl_lock_back_buffer(struct SDLOffscreenBuffer buffer, struct SDLOffscreenBuffer *locked)
+{
+    void *pixels = 0;
+    int pitch = 0;
+    if (!buffer.texture || SDL_LockTexture(buffer.texture, 0, &pixels, &pitch) != 0)
+    {
+        return false;
+    }
+
+    *locked = buffer;
+    locked->memory = pixels;
+    locked->pitch = pitch;
+    return true;
+}
+
+
+const char *
+present_mode_name(enum PresentMode mode)
+{
+    return mode == PRESENT_LOCK ? "lock" : "update";
+}
+
+
+void
+present_stats_record(enum PresentMode mode, uint64_t bytes_copied)
+{
+    present_stats.frames[mode]++;
+    present_stats.bytes_copied[mode] += bytes_copied;
+    TR_LOG_FRM("Present (%s): %" PRIu64 " bytes copied\n", present_mode_name(mode), bytes_copied);
+}
+
+
+void
+present_stats_report(void)
+{
+    for (int32_t mode = 0; mode < PRESENT_MODE_COUNT; ++mode)
+    {
+        if (present_stats.frames[mode])
+        {
+            TR_LOG_DBG("Present (%s): %" PRIu64 " frames, %" PRIu64 " bytes copied per frame\n",
+                    present_mode_name(mode),
+                    present_stats.frames[mode],
+                    present_stats.bytes_copied[mode] / present_stats.frames[mode]);
+        }
+    }
+}
+
+
+bool
+handle_event(SDL_Event *event)
+{
+    bool should_quit = false;
+
+    switch(event->type)
+    {
+        case SDL_QUIT:
+        {
+            TR_LOG_DBG("SDL_QUIT\n");
+            should_quit = true;
+        } break;
+
+        case SDL_WINDOWEVENT:
+        {
+            switch(event->window.event)
+            {
+                case SDL_WINDOWEVENT_SIZE_CHANGED:
+                {
+                    SDL_Window *window = SDL_GetWindowFromID(event->window.windowID);
+                    SDL_Renderer *renderer = SDL_GetRenderer(window);
+                    TR_LOG_DBG("SDL_WINDOWEVENT_SIZE_CHANGED (%d, %d)\n", event->window.data1, event->window.data2);
+                    sdl_request_resize(renderer, event->window.data1, event->window.data2);
+                } break;
+
+                case SDL_WINDOWEVENT_FOCUS_GAINED:
+                {
+                    TR_LOG_DBG("SDL_WINDOWEVENT_FOCUS_GAINED\n");
+                } break;
+
+                case SDL_WINDOWEVENT_EXPOSED:
+                {
+                    SDL_Window *window = SDL_GetWindowFromID(event->window.windowID);
+                    SDL_Renderer *renderer = SDL_GetRenderer(window);
+                    if (present_mode == PRESENT_LOCK)
+                    {
+                        // The texture already holds the last frame.
+                        sdl_present(renderer, global_back_buffer);
+                    }
+                    else
+                    {
+                        sdl_update_window(renderer, global_back_buffer);
+                    }
+                } break;
+            }
+        } break;
+
+        case SDL_KEYDOWN:
+        {
+            // NOTE: Everything else on the keyboard is sampled by the
+            // simulation thread; the overlay belongs to the main thread.
+            if (event->key.keysym.scancode == SDL_SCANCODE_P && !event->key.repeat && global_profiler.enabled)
+            {
+                global_profiler.overlay = !global_profiler.overlay;
+            }
+        } break;
+    }
+    return should_quit ;
+}
+
+
+void
+frame_pacer_init(struct FramePacer *pacer, enum PacingMode mode, uint32_t fps)
+{
+    memset(pacer, 0, sizeof(*pacer));
+    pacer->mode = mode;
+    pacer->frame_ns = TR_SECOND / (fps ? fps : TR_FPS);
+    pacer->spin_ns = TR_PACING_MAX_SPIN_NS / 2;
+    pacer->interval_min_ns = UINT64_MAX;
+    pacer->deadline_ns = get_current_time_ns() + pacer->frame_ns;
+}
+
+
+// Block until it's time to start presenting the next frame.
+void
+frame_pacer_wait(struct FramePacer *pacer)
+{
+    if (pacer->mode != PACING_SPIN)
+    {
+        return;
+    }
+
+    uint64_t now_ns = get_current_time_ns();
+    if (now_ns >= pacer->deadline_ns)
+    {
+        // Missed it. Don't try to catch up with a burst of short frames;
+        // start a fresh schedule from now.
+        ++pacer->missed_deadlines;
+        pacer->deadline_ns = now_ns + pacer->frame_ns;
+        return;
+    }
+
+    uint64_t remaining_ns = pacer->deadline_ns - now_ns;
+    if (remaining_ns > pacer->spin_ns)
+    {
+        uint64_t requested_ns = remaining_ns - pacer->spin_ns;
+        sleep_ns(requested_ns);
+        uint64_t slept_ns = get_current_time_ns() - now_ns;
+        uint64_t oversleep_ns = slept_ns > requested_ns ? slept_ns - requested_ns : 0;
+
+        // Grow the spin margin quickly when a sleep overshoots it, and
+        // shrink it slowly while sleeps are accurate.
+        uint64_t wanted_ns = oversleep_ns * 2 + TR_PACING_MIN_SPIN_NS;
+        if (wanted_ns > pacer->spin_ns)
+        {
+            pacer->spin_ns = wanted_ns;
+        }
+        else
+        {
+            pacer->spin_ns -= (pacer->spin_ns - wanted_ns) / 16;
+        }
+        if (pacer->spin_ns > TR_PACING_MAX_SPIN_NS)
+        {
+            pacer->spin_ns = TR_PACING_MAX_SPIN_NS;
+        }
+    }
+
+    while (get_current_time_ns() < pacer->deadline_ns)
+    {
+        // Spin.
+    }
+
+    pacer->deadline_ns += pacer->frame_ns;
+}
+
+
+// Wait out a frame that wasn't drawn because nothing changed. Never spins,
+// and sleeps a whole frame in the modes where presenting would have been
+// what blocked. The next presented frame doesn't count towards the interval
+// statistics.
+void
+frame_pacer_idle(struct FramePacer *pacer)
+{
+    uint64_t now_ns = get_current_time_ns();
+    if (pacer->mode != PACING_SPIN)
+    {
+        sleep_ns(pacer->frame_ns);
+    }
+    else if (now_ns < pacer->deadline_ns)
+    {
+        sleep_ns(pacer->deadline_ns - now_ns);
+        pacer->deadline_ns += pacer->frame_ns;
+    }
+    else
+    {
+        pacer->deadline_ns = now_ns + pacer->frame_ns;
+    }
+    pacer->previous_frame_end_ns = 0;
+}
+
+
+// Call right after presenting each frame.
+void
+frame_pacer_frame_presented(struct FramePacer *pacer)
+{
+    uint64_t now_ns = get_current_time_ns();
+    if (pacer->previous_frame_end_ns)
+    {
+        uint64_t interval_ns = now_ns - pacer->previous_frame_end_ns;
+        double interval_ms = (double)interval_ns / TR_MILLISECOND;
+        double target_ms = (double)pacer->frame_ns / TR_MILLISECOND;
+
+        ++pacer->interval_count;
+        pacer->interval_sum_ms += interval_ms;
+        pacer->interval_sum_sq_ms += interval_ms * interval_ms;
+        pacer->deviation_sum_ms += fabs(interval_ms - target_ms);
+        if (interval_ns < pacer->interval_min_ns)
+        {
+            pacer->interval_min_ns = interval_ns;
+        }
+        if (interval_ns > pacer->interval_max_ns)
+        {
+            pacer->interval_max_ns = interval_ns;
+        }
+        TR_LOG_FRM("Frame interval: %.3f ms\n", interval_ms);
+    }
+    pacer->previous_frame_end_ns = now_ns;
+}
+
+
+const char *
+pacing_mode_name(enum PacingMode mode)
+{
+    switch(mode)
+    {
+        case PACING_VSYNC: return "vsync";
+        case PACING_SPIN: return "spin";
+        case PACING_UNCAPPED: return "uncapped";
+    }
+    return "unknown";
+}
+
+
+void
+frame_pacer_report(struct FramePacer *pacer)
+{
+    if (pacer->interval_count == 0)
+    {
+        return;
+    }
+
+    double count = (double)pacer->interval_count;
+    double mean_ms = pacer->interval_sum_ms / count;
+    double variance = pacer->interval_sum_sq_ms / count - mean_ms * mean_ms;
+    (void)variance; // NOTE: Only read when logging is compiled in.
+
+    TR_LOG_DBG("Pacing (%s): %" PRIu64 " frames, interval mean %.3f ms, min %.3f ms, max %.3f ms\n",
+            pacing_mode_name(pacer->mode), pacer->interval_count, mean_ms,
+            (double)pacer->interval_min_ns / TR_MILLISECOND,
+            (double)pacer->interval_max_ns / TR_MILLISECOND);
+    TR_LOG_DBG("Pacing jitter: stddev %.3f ms, mean deviation from %.3f ms target %.3f ms, %" PRIu64 " missed deadlines\n",
+            variance > 0.0 ? sqrt(variance) : 0.0, (double)pacer->frame_ns / TR_MILLISECOND,
+            pacer->deviation_sum_ms / count, pacer->missed_deadlines);
+}
+
+
+void
+dynamic_scale_init(struct DynamicScale *scale, uint64_t budget_ns)
+{
+    memset(scale, 0, sizeof(*scale));
+    scale->enabled = true;
+    scale->budget_ns = budget_ns;
+}
+
+
+// Feed in how long the last frame took to produce, not counting the time
+// spent waiting to present it. Returns true if the render scale should move
+// to render_scale_levels[scale->level].
+bool
+dynamic_scale_update(struct DynamicScale *scale, float current_scale, uint64_t frame_ns)
+{
+    // NOTE: Frames rendered before the tables for the last change arrive
+    // don't tell us anything about the new level.
+    if (!scale->enabled || current_scale != render_scale_levels[scale->level])
+    {
+        return false;
+    }
+
+    if (scale->settled_frames == 0)
+    {
+        scale->average_ns = frame_ns;
+    }
+    else
+    {
+        scale->average_ns = (7 * scale->average_ns + frame_ns) / 8;
+    }
+    if (++scale->settled_frames < TR_DYNAMIC_SCALE_SETTLE_FRAMES)
+    {
+        return false;
+    }
+
+    uint32_t level = scale->level;
+    if (scale->average_ns > TR_DYNAMIC_SCALE_LOWER * scale->budget_ns)
+    {
+        if (level + 1 < TR_RENDER_SCALE_LEVEL_COUNT)
+        {
+            ++level;
+        }
+    }
+    else if (level > 0)
+    {
+        // Assume the cost scales with the pixel count.
+        float ratio = render_scale_levels[level - 1] / render_scale_levels[level];
+        double predicted_ns = (double)scale->average_ns * ratio * ratio;
+        if (predicted_ns < TR_DYNAMIC_SCALE_RAISE * scale->budget_ns)
+        {
+            --level;
+        }
+    }
+
+    if (level == scale->level)
+    {
+        return false;
+    }
+
+    TR_LOG_DBG("Render scale %g -> %g (%.3f ms per frame, %.3f ms budget)\n",
+            (double)render_scale_levels[scale->level], (double)render_scale_levels[level],
+            (double)scale->average_ns / TR_MILLISECOND, (double)scale->budget_ns / TR_MILLISECOND);
+    scale->level = level;
+    scale->settled_frames = 0;
+    scale->changes++;
+    return true;
+}
+
+
+void
+sdl_open_game_controllers()
+{
+    int32_t num_joysticks = SDL_NumJoysticks();
+    for (int32_t controller_index = 0; controller_index < num_joysticks; ++controller_index)
+    {
+        if (!SDL_IsGameController(controller_index))
+        {
+            continue;
+        }
+
+        if (controller_index >= TR_MAX_CONTROLLERS)
+        {
+            break;
+        }
+
+        controller_handles[controller_index] = SDL_GameControllerOpen(controller_index);
+        rumble_handles[controller_index] = SDL_HapticOpen(controller_index);
+
+        if (rumble_handles[controller_index] && SDL_HapticRumbleInit(rumble_handles[controller_index]) != 0)
+        {
+            SDL_HapticClose(rumble_handles[controller_index]);
+            rumble_handles[controller_index] = 0;
+        }
+    }
+}
+
+
+void
+sdl_close_game_controllers()
+{
+    for (int32_t controller_index = 0; controller_index < TR_MAX_CONTROLLERS; ++controller_index)
+    {
+        if (controller_handles[controller_index])
+        {
+            SDL_GameControllerClose(controller_handles[controller_index]);
+        }
+    }
+}
+
+
+// Start or stop each controller's rumble to match what the simulation asked
+// for. Main thread only.
+void
+sdl_update_rumble(const struct SimState *state)
+{
+    static bool rumbling[TR_MAX_CONTROLLERS];
+    for (int32_t controller_index = 0; controller_index < TR_MAX_CONTROLLERS; ++controller_index)
+    {
+        SDL_Haptic *handle = rumble_handles[controller_index];
+        if (!handle || state->rumble[controller_index] == rumbling[controller_index])
+        {
+            continue;
+        }
+
+        if (state->rumble[controller_index])
+        {
+            SDL_HapticRumblePlay(handle, 0.5f, SDL_HAPTIC_INFINITY);
+        }
+        else
+        {
+            SDL_HapticRumbleStop(handle);
+        }
+        rumbling[controller_index] = state->rumble[controller_index];
+    }
+}
+
+
+void
+triple_buffer_init(struct TripleBuffer *buffer, const struct SimState *initial)
+{
+    for (int32_t i = 0; i < 3; ++i)
+    {
+        buffer->slots[i] = *initial;
+    }
+    buffer->write_index = 0;
+    buffer->read_index = 1;
+    SDL_AtomicSet(&buffer->middle, 2);
+}
+
+
+// Writer side: publish a new state and take the old middle slot to write
+// into next time. Never blocks.
+void
+triple_buffer_write(struct TripleBuffer *buffer, const struct SimState *state)
+{
+    buffer->slots[buffer->write_index] = *state;
+    SDL_MemoryBarrierRelease();
+    int previous = SDL_AtomicSet(&buffer->middle, buffer->write_index | TR_TRIPLE_BUFFER_FRESH);
+    buffer->write_index = previous & TR_TRIPLE_BUFFER_INDEX_MASK;
+}
+
+
+// Reader side: return the latest published state. Never blocks.
+const struct SimState *
+triple_buffer_read(struct TripleBuffer *buffer)
+{
+    if (SDL_AtomicGet(&buffer->middle) & TR_TRIPLE_BUFFER_FRESH)
+    {
+        int previous = SDL_AtomicSet(&buffer->middle, buffer->read_index);
+        SDL_MemoryBarrierAcquire();
+        buffer->read_index = previous & TR_TRIPLE_BUFFER_INDEX_MASK;
+    }
+    return &buffer->slots[buffer->read_index];
+}
+
+
+void
+sample_input(struct InputState *input)
+{
+    memset(input, 0, sizeof(*input));
+
+    const uint8_t *keystate = SDL_GetKeyboardState(0);
+    input->key_a = keystate[SDL_SCANCODE_A];
+    input->key_d = keystate[SDL_SCANCODE_D];
+    input->key_w = keystate[SDL_SCANCODE_W];
+    input->key_s = keystate[SDL_SCANCODE_S];
+    input->key_left = keystate[SDL_SCANCODE_LEFT];
+    input->key_right = keystate[SDL_SCANCODE_RIGHT];
+    input->key_up = keystate[SDL_SCANCODE_UP];
+    input->key_down = keystate[SDL_SCANCODE_DOWN];
+
+    // NOTE: Number keys 1, 2, ..., 9, 0 select colors in enum order.
+    for (int32_t color = 0; color < COLOR_COUNT && color < 10; ++color)
+    {
+        if (keystate[SDL_SCANCODE_1 + color])
+        {
+            input->color_key = (uint8_t)(color + 1);
+        }
+    }
+
+    input->key_q = keystate[SDL_SCANCODE_Q];
+    input->key_e = keystate[SDL_SCANCODE_E];
+    input->key_r = keystate[SDL_SCANCODE_R];
+    input->key_f = keystate[SDL_SCANCODE_F];
+    if (keystate[SDL_SCANCODE_Z])
+    {
+        input->cross_section_key = CROSS_SECTION_CIRCLE + 1;
+    }
+    if (keystate[SDL_SCANCODE_X])
+    {
+        input->cross_section_key = CROSS_SECTION_ELLIPSE + 1;
+    }
+    if (keystate[SDL_SCANCODE_C])
+    {
+        input->cross_section_key = CROSS_SECTION_SQUARE + 1;
+    }
+
+    // NOTE: F1, F2, ... select textures in enum order.
+    for (int32_t pattern = 0; pattern < TEXTURE_PATTERN_COUNT; ++pattern)
+    {
+        if (keystate[SDL_SCANCODE_F1 + pattern])
+        {
+            input->texture_key = (uint8_t)(pattern + 1);
+        }
+    }
+
+    for (int32_t controller_index = 0; controller_index < TR_MAX_CONTROLLERS; ++controller_index)
+    {
+        SDL_GameController *handle = controller_handles[controller_index];
+        struct ControllerInput *controller = &input->controllers[controller_index];
+        controller->attached = SDL_GameControllerGetAttached(handle);
+        if (!controller->attached)
+        {
+            continue;
+        }
+
+        controller->start = SDL_GameControllerGetButton(handle, SDL_CONTROLLER_BUTTON_START);
+        controller->back = SDL_GameControllerGetButton(handle, SDL_CONTROLLER_BUTTON_BACK);
+        controller->a_button = SDL_GameControllerGetButton(handle, SDL_CONTROLLER_BUTTON_A);
+        controller->b_button = SDL_GameControllerGetButton(handle, SDL_CONTROLLER_BUTTON_B);
+        controller->x_button = SDL_GameControllerGetButton(handle, SDL_CONTROLLER_BUTTON_X);
+        controller->y_button = SDL_GameControllerGetButton(handle, SDL_CONTROLLER_BUTTON_Y);
+        controller->left_shoulder = SDL_GameControllerGetButton(handle, SDL_CONTROLLER_BUTTON_LEFTSHOULDER);
+        controller->right_shoulder = SDL_GameControllerGetButton(handle, SDL_CONTROLLER_BUTTON_RIGHTSHOULDER);
+
+        controller->stick_leftx = SDL_GameControllerGetAxis(handle, SDL_CONTROLLER_AXIS_LEFTX);
+        controller->stick_lefty = SDL_GameControllerGetAxis(handle, SDL_CONTROLLER_AXIS_LEFTY);
+        controller->stick_rightx = SDL_GameControllerGetAxis(handle, SDL_CONTROLLER_AXIS_RIGHTX);
+        controller->stick_righty = SDL_GameControllerGetAxis(handle, SDL_CONTROLLER_AXIS_RIGHTY);
+    }
+}
+
+
+
+uint32_t
+input_log_encode(const struct InputState *input, uint8_t *record)
+{
+    const bool keys[] = {
+        input->key_a, input->key_d, input->key_w, input->key_s,
+        input->key_left, input->key_right, input->key_up, input->key_down,
+        input->key_q, input->key_e, input->key_r, input->key_f,
+    };
+    uint32_t key_bits = 0;
+    for (uint32_t key = 0; key < sizeof(keys) / sizeof(keys[0]); ++key)
+    {
+        key_bits |= (uint32_t)keys[key] << key;
+    }
+
+    uint8_t attached = 0;
+    uint32_t size = 6;
+    for (int32_t controller_index = 0; controller_index < TR_MAX_CONTROLLERS; ++controller_index)
+    {
+        const struct ControllerInput *controller = &input->controllers[controller_index];
+        if (!controller->attached)
+        {
+            continue;
+        }
+
+        attached |= (uint8_t)(1 << controller_index);
+        record[size++] = (uint8_t)(controller->start
+                | controller->back << 1
+                | controller->a_button << 2
+                | controller->b_button << 3
+                | controller->x_button << 4
+                | controller->y_button << 5
+                | controller->left_shoulder << 6
+                | controller->right_shoulder << 7);
+        const int16_t sticks[] = {
+            controller->stick_leftx, controller->stick_lefty,
+            controller->stick_rightx, controller->stick_righty,
+        };
+        for (int32_t stick = 0; stick < 4; ++stick)
+        {
+            record[size++] = (uint8_t)((uint16_t)sticks[stick] & 0xFF);
+            record[size++] = (uint8_t)((uint16_t)sticks[stick] >> 8);
+        }
+    }
+
+    record[0] = (uint8_t)(key_bits & 0xFF);
+    record[1] = (uint8_t)(key_bits >> 8);
+    record[2] = input->color_key;
+    record[3] = input->texture_key;
+    record[4] = input->cross_section_key;
+    record[5] = attached;
+    return size;
+}
+
+
+// Read one entry's input after its repeat count. Returns false at the end
+// of the log or if it's cut short.
+bool
+input_log_decode(FILE *file, struct InputState *input)
+{
+    uint8_t record[TR_INPUT_LOG_MAX_RECORD];
+    if (fread(record, 1, 6, file) != 6)
+    {
+        return false;
+    }
+
+    memset(input, 0, sizeof(*input));
+    uint32_t key_bits = record[0] | (uint32_t)record[1] << 8;
+    bool *keys[] = {
+        &input->key_a, &input->key_d, &input->key_w, &input->key_s,
+        &input->key_left, &input->key_right, &input->key_up, &input->key_down,
+        &input->key_q, &input->key_e, &input->key_r, &input->key_f,
+    };
+    for (uint32_t key = 0; key < sizeof(keys) / sizeof(keys[0]); ++key)
+    {
+        *keys[key] = (key_bits >> key) & 1;
+    }
+    input->color_key = record[2];
+    input->texture_key = record[3];
+    input->cross_section_key = record[4];
+
+    uint8_t attached = record[5];
+    for (int32_t controller_index = 0; controller_index < TR_MAX_CONTROLLERS; ++controller_index)
+    {
+        if (!(attached & (1 << controller_index)))
+        {
+            continue;
+        }
+
+        uint8_t bytes[9];
+        if (fread(bytes, 1, sizeof(bytes), file) != sizeof(bytes))
+        {
+            return false;
+        }
+
+        struct ControllerInput *controller = &input->controllers[controller_index];
+        controller->attached = true;
+        controller->start = bytes[0] & 1;
+        controller->back = (bytes[0] >> 1) & 1;
+        controller->a_button = (bytes[0] >> 2) & 1;
+        controller->b_button = (bytes[0] >> 3) & 1;
+        controller->x_button = (bytes[0] >> 4) & 1;
+        controller->y_button = (bytes[0] >> 5) & 1;
+        controller->left_shoulder = (bytes[0] >> 6) & 1;
+        controller->right_shoulder = (bytes[0] >> 7) & 1;
+        int16_t *sticks[] = {
+            &controller->stick_leftx, &controller->stick_lefty,
+            &controller->stick_rightx, &controller->stick_righty,
+        };
+        for (int32_t stick = 0; stick < 4; ++stick)
+        {
+            *sticks[stick] = (int16_t)(bytes[1 + 2 * stick] | bytes[2 + 2 * stick] << 8);
+        }
+    }
+    return true;
+}
+
+
+bool
+input_log_open(struct InputLog *log, const char *path, bool replaying, enum TexturePattern *texture_choice)
+{
+    memset(log, 0, sizeof(*log));
+    log->path = path;
+    log->replaying = replaying;
+    log->file = fopen(path, replaying ? "rb" : "wb");
+    if (!log->file)
+    {
+        TR_LOG_ERR("Couldn't open input log %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    struct InputLogHeader header = {0};
+    if (replaying)
+    {
+        if (fread(&header, sizeof(header), 1, log->file) != 1
+                || memcmp(header.magic, TR_INPUT_LOG_MAGIC, sizeof(TR_INPUT_LOG_MAGIC)) != 0
+                || header.version != TR_INPUT_LOG_VERSION
+                || header.updates_per_second != TR_UPDATES_PER_SECOND
+                || header.texture_choice >= TEXTURE_PATTERN_COUNT)
+        {
+            TR_LOG_ERR("Not a compatible input log: %s\n", path);
+            fclose(log->file);
+            log->file = 0;
+            return false;
+        }
+        *texture_choice = (enum TexturePattern)header.texture_choice;
+        log->frame_hash = TR_FNV_OFFSET_BASIS;
+    }
+    else
+    {
+        memcpy(header.magic, TR_INPUT_LOG_MAGIC, sizeof(TR_INPUT_LOG_MAGIC));
+        header.version = TR_INPUT_LOG_VERSION;
+        header.updates_per_second = TR_UPDATES_PER_SECOND;
+        header.texture_choice = *texture_choice;
+        if (fwrite(&header, sizeof(header), 1, log->file) != 1)
+        {
+            TR_LOG_ERR("Couldn't write input log %s: %s\n", path, strerror(errno));
+            fclose(log->file);
+            log->file = 0;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+void
+input_log_flush(struct InputLog *log)
+{
+    if (log->repeat == 0)
+    {
+        return;
+    }
+
+    uint8_t count[2] = { (uint8_t)(log->repeat & 0xFF), (uint8_t)(log->repeat >> 8) };
+    fwrite(count, 1, sizeof(count), log->file);
+    fwrite(log->record, 1, log->record_size, log->file);
+    log->repeat = 0;
+}
+
+
+// Called by the simulation thread with the input for each update.
+void
+input_log_write(struct InputLog *log, const struct InputState *input)
+{
+    uint8_t record[TR_INPUT_LOG_MAX_RECORD];
+    uint32_t record_size = input_log_encode(input, record);
+    if (log->repeat > 0 && log->repeat < TR_INPUT_LOG_MAX_REPEAT
+            && record_size == log->record_size && memcmp(record, log->record, record_size) == 0)
+    {
+        ++log->repeat;
+    }
+    else
+    {
+        input_log_flush(log);
+        memcpy(log->record, record, record_size);
+        log->record_size = record_size;
+        log->repeat = 1;
+    }
+    ++log->updates;
+}
+
+
+// The input for the next update. Returns false once the log runs out.
+bool
+input_log_read(struct InputLog *log, struct InputState *input)
+{
+    if (log->repeat == 0)
+    {
+        uint8_t count[2];
+        if (fread(count, 1, sizeof(count), log->file) != sizeof(count)
+                || !input_log_decode(log->file, &log->input))
+        {
+            return false;
+        }
+        log->repeat = count[0] | (uint32_t)count[1] << 8;
+        if (log->repeat == 0)
+        {
+            return false;
+        }
+    }
+
+    *input = log->input;
+    --log->repeat;
+    ++log->updates;
+    return true;
+}
+
+
+void
+input_log_close(struct InputLog *log)
+{
+    if (!log->file)
+    {
+        return;
+    }
+
+    if (!log->replaying)
+    {
+        input_log_flush(log);
+    }
+    bool ok = !ferror(log->file);
+    ok = fclose(log->file) == 0 && ok;
+    log->file = 0;
+
+    if (!ok)
+    {
+        TR_LOG_ERR("Couldn't write input log %s\n", log->path);
+    }
+    else if (log->replaying && log->frames)
+    {
+        // NOTE: Printed whatever the log level, to compare runs against.
+        printf("Replay: %" PRIu64 " updates, %" PRIu64 " frames, frame hash %016" PRIx64 "\n",
+                log->updates, log->frames, log->frame_hash);
+    }
+    else
+    {
+        TR_LOG_DBG("Input log: %" PRIu64 " updates %s %s\n", log->updates,
+                log->replaying ? "read from" : "written to", log->path);
+    }
+}
+
+
+// FNV-1a over a frame's pixels, one pixel at a time, skipping row padding.
+uint64_t
+frame_hash(struct SDLOffscreenBuffer buffer, uint64_t hash)
+{
+    for (uint32_t y = 0; y < buffer.height; ++y)
+    {
+        const uint32_t *pixel = (const uint32_t *)((const uint8_t *)buffer.memory + y * buffer.pitch);
+        for (uint32_t x = 0; x < buffer.width; ++x)
+        {
+            hash = (hash ^ pixel[x]) * TR_FNV_PRIME;
+        }
+    }
+    return hash;
+}
+
+
+// Binary PPM (P6), dropping the unused fourth byte of each pixel.
+bool
+frame_write_ppm(struct SDLOffscreenBuffer buffer, const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+        TR_LOG_ERR("Couldn't open %s for writing: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    fprintf(file, "P6\n%u %u\n255\n", buffer.width, buffer.height);
+    uint8_t *rgb = malloc(buffer.width * 3);
+    bool ok = rgb != 0;
+    for (uint32_t y = 0; ok && y < buffer.height; ++y)
+    {
+        const uint32_t *pixel = (const uint32_t *)((const uint8_t *)buffer.memory + y * buffer.pitch);
+        for (uint32_t x = 0; x < buffer.width; ++x)
+        {
+            rgb[3 * x + 0] = (uint8_t)(pixel[x] >> 16);
+            rgb[3 * x + 1] = (uint8_t)(pixel[x] >> 8);
+            rgb[3 * x + 2] = (uint8_t)pixel[x];
+        }
+        ok = fwrite(rgb, 3, buffer.width, file) == buffer.width;
+    }
+    free(rgb);
+
+    ok = fclose(file) == 0 && ok;
+    if (!ok)
+    {
+        TR_LOG_ERR("Couldn't write %s\n", path);
+    }
+    return ok;
+}
+
+// One fixed-rate simulation step.
+void
+simulation_update(struct SimState *state, const struct InputState *input)
+{
+    if (input->key_a)
+    {
+        state->rotation_offset -= TR_MOVEMENT_SPEED;
+    }
+    if (input->key_d)
+    {
+        state->rotation_offset += TR_MOVEMENT_SPEED;
+    }
+    if (input->key_w)
+    {
+        state->translation_offset += TR_MOVEMENT_SPEED;
+    }
+    if (input->key_s)
+    {
+        state->translation_offset -= TR_MOVEMENT_SPEED;
+    }
+    if (input->key_left)
+    {
+        state->rotation_offset --;
+    }
+    if (input->key_right)
+    {
+        state->rotation_offset ++;
+    }
+    if (input->key_up)
+    {
+        state->translation_offset ++;
+    }
+    if (input->key_down)
+    {
+        state->translation_offset --;
+    }
+    if (input->color_key)
+    {
+        state->color_choice = (enum Color)(input->color_key - 1);
+    }
+    if (input->texture_key)
+    {
+        state->texture_choice = (enum TexturePattern)(input->texture_key - 1);
+    }
+
+    if (input->key_q)
+    {
+        state->shape.twist -= TR_SHAPE_TWIST_STEP;
+    }
+    if (input->key_e)
+    {
+        state->shape.twist += TR_SHAPE_TWIST_STEP;
+    }
+    if (input->key_r)
+    {
+        state->shape.radius += TR_SHAPE_RADIUS_STEP;
+    }
+    if (input->key_f && state->shape.radius > 2.0f * TR_SHAPE_RADIUS_STEP)
+    {
+        state->shape.radius -= TR_SHAPE_RADIUS_STEP;
+    }
+    if (input->cross_section_key)
+    {
+        state->cross_section = (enum CrossSection)(input->cross_section_key - 1);
+    }
+
+    // Ease into the selected cross-section rather than snapping to it.
+    float target_aspect = state->cross_section == CROSS_SECTION_ELLIPSE ? TR_SHAPE_ELLIPSE_ASPECT : 1.0f;
+    float target_squareness = state->cross_section == CROSS_SECTION_SQUARE ? 1.0f : 0.0f;
+    state->shape.aspect += (target_aspect - state->shape.aspect) * TR_SHAPE_EASE;
+    state->shape.squareness += (target_squareness - state->shape.squareness) * TR_SHAPE_EASE;
+
+    state->palette_phase++;
+    state->tick++;
+
+    for (int32_t controller_index = 0; controller_index < TR_MAX_CONTROLLERS; ++controller_index)
+    {
+        const struct ControllerInput *controller = &input->controllers[controller_index];
+        state->rumble[controller_index] = controller->attached && controller->start;
+        if (!controller->attached)
+        {
+            continue;
+        }
+
+        if (controller->start)
+        {
+            state->color_choice = '\0';
+        }
+
+        if (controller->back)
+        {
+            state->quit = true;
+        }
+
+        // NOTE: Buttons select colors.
+        if (controller->a_button)
+        {
+            state->color_choice = COLOR_GREEN;
+        }
+        if (controller->b_button)
+        {
+            state->color_choice = COLOR_RED;
+        }
+        if (controller->x_button)
+        {
+            state->color_choice = COLOR_BLUE;
+        }
+        if (controller->y_button)
+        {
+            state->color_choice = COLOR_YELLOW;
+        }
+        if (controller->left_shoulder)
+        {
+            state->color_choice = COLOR_MAGENTA;
+        }
+        if (controller->right_shoulder)
+        {
+            state->color_choice = COLOR_CYAN;
+        }
+
+        state->rotation_offset += controller->stick_leftx / 5000;
+        state->translation_offset -= controller->stick_lefty / 5000;
+
+        state->look_x = controller->stick_rightx;
+        state->look_y = controller->stick_righty;
+    }
+    TR_LOG_FRM("%d, %d\n", state->translation_offset, state->rotation_offset);
+}
+
+
+// Map one axis of the right stick onto how far the view is shifted along a
+// back buffer dimension of `size`: from 0 to `size`, `size` / 2 when
+// centered.
+int32_t
+look_shift(uint32_t size, int16_t look)
+{
+    int32_t dampened_max = size / 2;
+    int32_t dampened_min = -((int32_t)size / 2);
+    int32_t dampened = (look - TR_CONTROLLER_STICK_MIN) * (dampened_max - dampened_min) / (TR_CONTROLLER_STICK_MAX - TR_CONTROLLER_STICK_MIN) + dampened_min;
+    TR_LOG_FRM("size / 2: %d\t damp: %d\t raw: %d\n", size / 2, dampened, look);
+    return size / 2 + dampened;
+}
+
+
+// Map the right stick onto a shift of the view within the transform tables.
+// The range is taken from the back buffer rather than the window, since the
+// tables lag behind the window size while new ones are rebuilt after a
+// resize.
+void
+transform_set_look(struct TransformData *t, struct SDLOffscreenBuffer buffer, int16_t look_x, int16_t look_y)
+{
+    t->look_shift_x = look_shift(buffer.width, look_x);
+    t->look_shift_y = look_shift(buffer.height, look_y);
+}
+
+
+// Turn the simulated shape into this frame's kernel parameters for
+// `buffer`, with the radius breathing over time and the view shifted by the
+// right stick as it is for the table engine.
+void
+tunnel_shape_update(
+        struct TunnelShapeParams *params,
+        const struct TunnelShape *shape,
+        uint32_t tick,
+        struct SDLOffscreenBuffer buffer,
+        int16_t look_x,
+        int16_t look_y)
+{
+    float phase = 2.0f * TR_PI32 * (float)(tick % TR_SHAPE_PULSE_STEPS) / TR_SHAPE_PULSE_STEPS;
+    float radius = shape->radius * (1.0f + TR_SHAPE_PULSE * sinf(phase));
+    params->depth_scale = radius * TR_TEX_HEIGHT;
+    params->twist = shape->twist;
+    params->aspect = shape->aspect;
+    params->squareness = shape->squareness;
+    params->pixel_size = 1.0f / buffer.scale;
+    params->origin_x = look_shift(buffer.width, look_x) - (int32_t)buffer.width;
+    params->origin_y = look_shift(buffer.height, look_y) - (int32_t)buffer.height;
+}
+
+
+int
+simulation_thread(void *data)
+{
+    struct Simulation *simulation = (struct Simulation *)data;
+
+    uint64_t lag = 0;
+    uint64_t previous_ns = get_current_time_ns();
+
+    while (!SDL_AtomicGet(&simulation->stop))
+    {
+        uint64_t current_ns = get_current_time_ns();
+        lag += current_ns - previous_ns;
+        previous_ns = current_ns;
+        TR_LOG_FRM("Lag: %" PRIu64 "\n", lag);
+
+        struct InputState input;
+        SDL_LockMutex(simulation->input_lock);
+        input = simulation->input;
+        SDL_UnlockMutex(simulation->input_lock);
+
+        bool updated = false;
+        while (lag >= TR_NS_PER_UPDATE)
+        {
+            uint64_t update_start_ns = profile_begin();
+            if (input_log.file)
+            {
+                input_log_write(&input_log, &input);
+            }
+            simulation_update(&simulation->state, &input);
+            profile_end(PROFILE_TRACK_SIMULATION, PROFILE_UPDATE, update_start_ns);
+            profile_next_frame(PROFILE_TRACK_SIMULATION);
+            lag -= TR_NS_PER_UPDATE;
+            updated = true;
+        }
+
+        if (updated)
+        {
+            triple_buffer_write(&simulation->states, &simulation->state);
+        }
+
+        sleep_ns(TR_NS_PER_UPDATE - lag);
+    }
+
+    return 0;
+}
+
+
+void
+simulation_init(struct Simulation *simulation, enum TexturePattern texture_choice)
+{
+    memset(&simulation->state, 0, sizeof(simulation->state));
+    simulation->state.color_choice = COLOR_WHITE;
+    simulation->state.texture_choice = texture_choice;
+    simulation->state.shape.radius = TR_TUNNEL_RATIO;
+    simulation->state.shape.aspect = 1.0f;
+    triple_buffer_init(&simulation->states, &simulation->state);
+    memset(&simulation->input, 0, sizeof(simulation->input));
+    simulation->input_lock = 0;
+    SDL_AtomicSet(&simulation->stop, 0);
+    simulation->thread = 0;
+}
+
+
+bool
+simulation_start(struct Simulation *simulation, enum TexturePattern texture_choice)
+{
+    simulation_init(simulation, texture_choice);
+    simulation->input_lock = SDL_CreateMutex();
+    if (!simulation->input_lock)
+    {
+        TR_LOG_ERR("SDL_CreateMutex failed: %s\n", SDL_GetError());
+        return false;
+    }
+    simulation->thread = SDL_CreateThread(simulation_thread, "tr_simulation", simulation);
+    if (!simulation->thread)
+    {
+        TR_LOG_ERR("SDL_CreateThread failed: %s\n", SDL_GetError());
+        return false;
+    }
+    return true;
+}
+
+
+// Replays run the simulation on the main thread instead, a fixed number of
+// updates per frame. Returns false once the log runs out.
+bool
+simulation_replay_frame(struct Simulation *simulation, struct InputLog *log)
+{
+    for (uint32_t update = 0; update < TR_REPLAY_UPDATES_PER_FRAME; ++update)
+    {
+        struct InputState input;
+        if (!input_log_read(log, &input))
+        {
+            return false;
+        }
+        simulation_update(&simulation->state, &input);
+    }
+    return true;
+}
+
+
+void
+simulation_stop(struct Simulation *simulation)
+{
+    if (simulation->thread)
+    {
+        SDL_AtomicSet(&simulation->stop, 1);
+        SDL_WaitThread(simulation->thread, 0);
+        simulation->thread = 0;
+    }
+    if (simulation->input_lock)
+    {
+        SDL_DestroyMutex(simulation->input_lock);
+        simulation->input_lock = 0;
+    }
+}
+
+
+// Hand the simulation thread the keyboard and controller state as of the
+// last event pump. Main thread only.
+void
+simulation_post_input(struct Simulation *simulation)
+{
+    if (!simulation->thread)
+    {
+        return;
+    }
+
+    struct InputState input;
+    sample_input(&input);
+    SDL_LockMutex(simulation->input_lock);
+    simulation->input = input;
+    SDL_UnlockMutex(simulation->input_lock);
+}
+
+
+// Set up what every windowed run needs besides its windows: the texture, the
+// profiler, the input log and the simulation. Exits on failure.
+void
+session_start(
+        const char *texture_path,
+        enum TexelLayout texel_layout,
+        const char *profile_prefix,
+        bool profile_overlay,
+        const char *record_path,
+        const char *replay_path,
+        enum TexturePattern texture_pattern)
+{
+    texture_init(&global_texture);
+    texture_set_layout(&global_texture, texel_layout);
+    if (texture_path && !texture_load_image(&global_texture, texture_path))
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // NOTE: Before the simulation thread starts, which reads
+    // global_profiler.enabled.
+    if (profile_prefix || profile_overlay)
+    {
+        profile_init(profile_prefix, profile_overlay);
+    }
+
+    const char *input_log_path = replay_path ? replay_path : record_path;
+    if (input_log_path && !input_log_open(&input_log, input_log_path, replay_path != 0, &texture_pattern))
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    if (input_log.replaying)
+    {
+        simulation_init(&global_simulation, texture_pattern);
+    }
+    else if (!simulation_start(&global_simulation, texture_pattern))
+    {
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+// Tables for a back buffer of width x height at `scale`: the ones another
+// window already uses if there are any, otherwise loaded or built into a
+// free slot. Returns null if there isn't memory for them.
+struct SharedTransform *
+shared_transform_acquire(int32_t width, int32_t height, float scale)
+{
+    struct SharedTransform *free_slot = 0;
+    for (uint32_t i = 0; i < TR_MAX_WINDOWS + 1; ++i)
+    {
+        struct SharedTransform *shared = &shared_transforms[i];
+        if (shared->references == 0)
+        {
+            free_slot = free_slot ? free_slot : shared;
+        }
+        else if (shared->width == width && shared->height == height && shared->scale == scale)
+        {
+            ++shared->references;
+            return shared;
+        }
+    }
+
+    // NOTE: There's a slot for every window and a spare, so one is always
+    // free.
+    assert(free_slot);
+    if (!arena_reserve(&free_slot->arena, transform_arena_size(width, height, 1.0f / scale))
+        || !transform_load_or_build(&free_slot->data, width, height, 1.0f / scale, &global_thread_pool, &free_slot->arena))
+    {
+        return 0;
+    }
+    free_slot->width = width;
+    free_slot->height = height;
+    free_slot->scale = scale;
+    free_slot->references = 1;
+    return free_slot;
+}
+
+
+void
+shared_transform_release(struct SharedTransform *shared)
+{
+    if (shared && --shared->references == 0)
+    {
+        transform_free(&shared->data);
+        arena_release(&shared->arena);
+    }
+}
+
+
+// Returns false, and leaves the window as it was, if there isn't memory for
+// the new size.
+bool
+tunnel_window_resize(struct TunnelWindow *w, int32_t window_width, int32_t window_height)
+{
+    struct SDLWindowDimension render = render_dimension(window_width, window_height, render_scale);
+    struct SharedTransform *tables = shared_transform_acquire(render.width, render.height, render_scale);
+    if (!tables)
+    {
+        return false;
+    }
+    if (!arena_reserve(&w->arena, back_buffer_arena_size(render.width, render.height)))
+    {
+        shared_transform_release(tables);
+        return false;
+    }
+
+    shared_transform_release(w->tables);
+    w->tables = tables;
+    sdl_resize_back_buffer(&w->buffer, w->renderer, render.width, render.height, render_scale, &w->arena);
+    delta_renderer_use_arena(&w->delta, &w->arena, render.width, render.height);
+    return true;
+}
+
+
+struct TunnelWindow *
+tunnel_window_find(uint32_t id)
+{
+    for (uint32_t i = 0; i < tunnel_window_count; ++i)
+    {
+        if (tunnel_windows[i].id == id)
+        {
+            return &tunnel_windows[i];
+        }
+    }
+    return 0;
+}
+
+
+// Open a fullscreen window on each of the first `requested` displays, or all
+// of them if it's 0. Only the first window's renderer waits for vsync, so
+// presenting to several displays doesn't wait for each in turn. Returns the
+// number of windows opened.
+uint32_t
+tunnel_windows_open(uint32_t requested, uint32_t renderer_flags)
+{
+    int display_count = SDL_GetNumVideoDisplays();
+    if (display_count < 1)
+    {
+        TR_LOG_ERR("SDL_GetNumVideoDisplays failed: %s\n", SDL_GetError());
+        return 0;
+    }
+    if (requested == 0 || requested > (uint32_t)display_count)
+    {
+        requested = (uint32_t)display_count;
+    }
+    if (requested > TR_MAX_WINDOWS)
+    {
+        requested = TR_MAX_WINDOWS;
+    }
+
+    for (uint32_t display = 0; display < requested; ++display)
+    {
+        SDL_Rect bounds;
+        if (SDL_GetDisplayBounds((int)display, &bounds) != 0)
+        {
+            TR_LOG_ERR("SDL_GetDisplayBounds failed: %s\n", SDL_GetError());
+            continue;
+        }
+
+        struct TunnelWindow *w = &tunnel_windows[tunnel_window_count];
+        w->window = SDL_CreateWindow(
+                "Tunnel Runner",
+                SDL_WINDOWPOS_UNDEFINED_DISPLAY(display),
+                SDL_WINDOWPOS_UNDEFINED_DISPLAY(display),
+                bounds.w,
+                bounds.h,
+                SDL_WINDOW_FULLSCREEN_DESKTOP);
+        if (!w->window)
+        {
+            TR_LOG_ERR("SDL_CreateWindow failed: %s\n", SDL_GetError());
+            continue;
+        }
+        w->renderer = SDL_CreateRenderer(w->window, -1, tunnel_window_count == 0 ? renderer_flags : 0);
+        if (!w->renderer)
+        {
+            TR_LOG_ERR("SDL_CreateRenderer failed: %s\n", SDL_GetError());
+            SDL_DestroyWindow(w->window);
+            w->window = 0;
+            continue;
+        }
+        w->id = SDL_GetWindowID(w->window);
+        w->delta.enabled = global_delta_renderer.enabled;
+
+        struct SDLWindowDimension dimension = sdl_get_window_dimension(w->window);
+        if (!tunnel_window_resize(w, dimension.width, dimension.height))
+        {
+            SDL_DestroyRenderer(w->renderer);
+            SDL_DestroyWindow(w->window);
+            memset(w, 0, sizeof(*w));
+            continue;
+        }
+        TR_LOG_DBG("Display %u: %dx%d window, tables shared by %u\n",
+                display, dimension.width, dimension.height, w->tables->references);
+        ++tunnel_window_count;
+    }
+
+    return tunnel_window_count;
+}
+
+
+void
+tunnel_windows_close(void)
+{
+    for (uint32_t i = 0; i < tunnel_window_count; ++i)
+    {
+        struct TunnelWindow *w = &tunnel_windows[i];
+        delta_renderer_report(&w->delta);
+        delta_renderer_free(&w->delta);
+        shared_transform_release(w->tables);
+        arena_release(&w->arena);
+        if (w->buffer.texture)
+        {
+            SDL_DestroyTexture(w->buffer.texture);
+        }
+        SDL_DestroyRenderer(w->renderer);
+        SDL_DestroyWindow(w->window);
+        memset(w, 0, sizeof(*w));
+    }
+    tunnel_window_count = 0;
+}
+
+
+// Handle window events for the --displays windows; everything else goes to
+// handle_event. Returns true if the program should quit.
+bool
+tunnel_windows_handle_event(SDL_Event *event)
+{
+    if (event->type != SDL_WINDOWEVENT)
+    {
+        return handle_event(event);
+    }
+
+    struct TunnelWindow *w = tunnel_window_find(event->window.windowID);
+    if (!w)
+    {
+        return false;
+    }
+    switch(event->window.event)
+    {
+        case SDL_WINDOWEVENT_SIZE_CHANGED:
+        {
+            TR_LOG_DBG("SDL_WINDOWEVENT_SIZE_CHANGED %u (%d, %d)\n", w->id, event->window.data1, event->window.data2);
+            if (!tunnel_window_resize(w, event->window.data1, event->window.data2))
+            {
+                TR_LOG_ERR("Keeping the %ux%u back buffer for window %u\n", w->buffer.width, w->buffer.height, w->id);
+            }
+        } break;
+
+        case SDL_WINDOWEVENT_EXPOSED:
+        {
+            if (present_mode == PRESENT_LOCK)
+            {
+                sdl_present(w->renderer, w->buffer);
+            }
+            else
+            {
+                sdl_update_window(w->renderer, w->buffer);
+            }
+        } break;
+
+        case SDL_WINDOWEVENT_CLOSE:
+        {
+            return true;
+        } break;
+    }
+    return false;
+}
+
+
+// The main loop of a --displays run: like the single window one, but each
+// frame of the simulation is drawn into every window with its own tables
+// (shared between windows of the same size), one window after another, each
+// spread across the thread pool. Resizes are handled synchronously and the
+// render scale is fixed.
+void
+run_displays(uint32_t requested, enum PacingMode pacing_mode, uint32_t target_fps)
+{
+    uint32_t renderer_flags = pacing_mode == PACING_VSYNC ? SDL_RENDERER_PRESENTVSYNC : 0;
+    if (tunnel_windows_open(requested, renderer_flags) == 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    frame_pacer_init(&global_frame_pacer, pacing_mode, target_fps);
+
+    bool drawn[TR_MAX_WINDOWS];
+    bool running = true;
+    while (running)
+    {
+        uint64_t stage_start_ns = profile_begin();
+        SDL_Event event;
+        while (SDL_PollEvent(&event))
+        {
+            if (tunnel_windows_handle_event(&event))
+            {
+                running = false;
+            }
+        }
+        simulation_post_input(&global_simulation);
+        profile_end(PROFILE_TRACK_MAIN, PROFILE_EVENTS, stage_start_ns);
+
+        const struct SimState *state = 0;
+        if (input_log.replaying)
+        {
+            if (!simulation_replay_frame(&global_simulation, &input_log))
+            {
+                running = false;
+            }
+            state = &global_simulation.state;
+        }
+        else
+        {
+            state = triple_buffer_read(&global_simulation.states);
+        }
+        if (state->quit)
+        {
+            running = false;
+        }
+        sdl_update_rumble(state);
+
+        stage_start_ns = profile_begin();
+        texture_select(&global_texture, state->texture_choice);
+        texture_animate(&global_texture, state->tick / TR_TEXTURE_STEPS_PER_FRAME);
+        texture_colorize(&global_texture, &global_palette, state->color_choice, state->palette_phase);
+        profile_end(PROFILE_TRACK_MAIN, PROFILE_TEXTURE, stage_start_ns);
+
+        uint32_t drawn_count = 0;
+        for (uint32_t i = 0; i < tunnel_window_count; ++i)
+        {
+            struct TunnelWindow *w = &tunnel_windows[i];
+            drawn[i] = false;
+
+            // NOTE: The renderer reads the tables from `transform`, which
+            // only borrows this window's.
+            stage_start_ns = profile_begin();
+            transform = w->tables->data;
+            transform_set_look(&transform, w->buffer, state->look_x, state->look_y);
+            tunnel_shape_update(&tunnel_shape, &state->shape, state->tick, w->buffer, state->look_x, state->look_y);
+            profile_end(PROFILE_TRACK_MAIN, PROFILE_TABLES, stage_start_ns);
+
+            struct FrameKey key = frame_key_current(w->buffer, &global_texture, state->rotation_offset, state->translation_offset);
+            if (!input_log.replaying && delta_renderer_unchanged(&w->delta, &key))
+            {
+                continue;
+            }
+
+            struct SDLOffscreenBuffer target = w->buffer;
+            bool locked = false;
+            if (present_mode == PRESENT_LOCK)
+            {
+                locked = sdl_lock_back_buffer(w->buffer, &target);
+                if (!locked)
+                {
+                    TR_LOG_ERR("SDL_LockTexture failed, falling back to SDL_UpdateTexture: %s\n", SDL_GetError());
+                    present_mode = PRESENT_UPDATE;
+                }
+            }
+
+            stage_start_ns = profile_begin();
+            delta_render(&w->delta, &global_thread_pool, target, &global_texture, state->rotation_offset, state->translation_offset);
+            profile_end(PROFILE_TRACK_MAIN, PROFILE_RENDER, stage_start_ns);
+            if (input_log.replaying && i == 0)
+            {
+                input_log.frame_hash = frame_hash(target, input_log.frame_hash);
+                input_log.frames++;
+            }
+            profile_draw_overlay(target, global_frame_pacer.frame_ns);
+
+            if (locked)
+            {
+                stage_start_ns = profile_begin();
+                SDL_UnlockTexture(w->buffer.texture);
+                profile_end(PROFILE_TRACK_MAIN, PROFILE_UPLOAD, stage_start_ns);
+            }
+            drawn[i] = true;
+            ++drawn_count;
+        }
+        memset(&transform, 0, sizeof(transform));
+
+        stage_start_ns = profile_begin();
+        if (drawn_count == 0)
+        {
+            frame_pacer_idle(&global_frame_pacer);
+            profile_end(PROFILE_TRACK_MAIN, PROFILE_WAIT, stage_start_ns);
+            profile_next_frame(PROFILE_TRACK_MAIN);
+            continue;
+        }
+        frame_pacer_wait(&global_frame_pacer);
+        profile_end(PROFILE_TRACK_MAIN, PROFILE_WAIT, stage_start_ns);
+
+        for (uint32_t i = 0; i < tunnel_window_count; ++i)
+        {
+            struct TunnelWindow *w = &tunnel_windows[i];
+            if (!drawn[i])
+            {
+                continue;
+            }
+            if (present_mode == PRESENT_LOCK)
+            {
+                sdl_present(w->renderer, w->buffer);
+                present_stats_record(PRESENT_LOCK, 0);
+            }
+            else
+            {
+                sdl_update_window(w->renderer, w->buffer);
+                present_stats_record(PRESENT_UPDATE, (uint64_t)w->buffer.pitch * w->buffer.height);
+            }
+        }
+        frame_pacer_frame_presented(&global_frame_pacer);
+        profile_next_frame(PROFILE_TRACK_MAIN);
+    }
+
+    simulation_stop(&global_simulation);
+}
+
+
+void
+sdl_cleanup(void)
+{
+    TR_LOG_DBG("Cleaning up...\n");
+    simulation_stop(&global_simulation);
+    input_log_close(&input_log);
+    present_stats_report();
+    texture_stats_report();
+    profile_report();
+    if (global_profiler.output_prefix)
+    {
+        profile_write(global_profiler.output_prefix);
+    }
+    if (global_dynamic_scale.enabled)
+    {
+        TR_LOG_DBG("Render scale: %g at exit, %" PRIu64 " changes\n",
+                (double)render_scale_levels[global_dynamic_scale.level], global_dynamic_scale.changes);
+    }
+    frame_pacer_report(&global_frame_pacer);
+    delta_renderer_report(&global_delta_renderer);
+    delta_renderer_free(&global_delta_renderer);
+    tunnel_windows_close();
+    transform_rebuilder_shutdown(&transform_rebuilder);
+    transform_free(&transform);
+    arena_release(&resolution_arena);
+    thread_pool_shutdown(&global_thread_pool);
+    sdl_close_game_controllers();
+    SDL_Quit();
+}
+
+
+int
+compare_uint64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+// Open a hardware counter for the calling thread, counting user space only.
+// Returns -1 where perf events aren't available (not Linux, or not allowed
+// by kernel.perf_event_paranoid).
+int
+perf_counter_open(uint32_t type, uint64_t config)
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    (void)type;
+    (void)config;
+    return -1;
+#endif
+}
+
+
+uint64_t
+perf_counter_read(int fd)
+{
+    uint64_t value = 0;
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+    {
+        return 0;
+    }
+    return value;
+}
+
+
+// Count L1 data cache read misses and last level cache misses per pixel over
+// a few frames rendered on this thread alone (counters only follow the
+// thread that opened them). Misses are -1 if the counter isn't available.
+// With `indices`, the frames are drawn from that index cache.
+void
+bench_count_misses(struct SDLOffscreenBuffer buffer, const struct Texture *texture, const uint16_t *indices, double *l1_misses, double *llc_misses)
+{
+#ifdef __linux__
+    int l1_fd = perf_counter_open(PERF_TYPE_HW_CACHE,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    int llc_fd = perf_counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#else
+    int l1_fd = perf_counter_open(0, 0);
+    int llc_fd = perf_counter_open(0, 0);
+#endif
+
+    uint64_t l1_start = perf_counter_read(l1_fd);
+    uint64_t llc_start = perf_counter_read(llc_fd);
+    for (uint32_t frame = 0; frame < TR_BENCH_COUNTER_FRAMES; ++frame)
+    {
+        int32_t offset = (int32_t)frame * TR_MOVEMENT_SPEED;
+        if (indices)
+        {
+            render_tunnel_delta(buffer, texture, indices, offset, offset);
+        }
+        else
+        {
+            render_tunnel(buffer, texture, offset, offset);
+        }
+    }
+    double pixels = (double)buffer.width * buffer.height * TR_BENCH_COUNTER_FRAMES;
+    *l1_misses = l1_fd < 0 ? -1.0 : (double)(perf_counter_read(l1_fd) - l1_start) / pixels;
+    *llc_misses = llc_fd < 0 ? -1.0 : (double)(perf_counter_read(llc_fd) - llc_start) / pixels;
+
+    if (l1_fd >= 0)
+    {
+        close(l1_fd);
+    }
+    if (llc_fd >= 0)
+    {
+        close(llc_fd);
+    }
+}
+
+
+// Render `frame_count` frames into a plain malloc'd buffer, with no window or
+// renderer, and report frame time statistics. The offsets advance every
+// frame so that consecutive frames don't hit identical memory patterns.
+void
+bench_resolution(struct Texture *texture, int32_t window_width, int32_t window_height, uint32_t frame_count)
+{
+    struct SDLWindowDimension render = render_dimension(window_width, window_height, render_scale);
+    int32_t width = render.width;
+    int32_t height = render.height;
+
+    struct SDLOffscreenBuffer buffer = {0};
+    buffer.width = width;
+    buffer.height = height;
+    buffer.pitch = width * TR_BYTES_PER_PIXEL;
+    buffer.scale = render_scale;
+    buffer.memory = malloc(width * height * TR_BYTES_PER_PIXEL);
+
+    uint64_t *frame_ns = malloc(frame_count * sizeof(uint64_t));
+
+    if (!buffer.memory || !frame_ns)
+    {
+        TR_LOG_ERR("Bench: out of memory at %dx%d\n", width, height);
+        free(buffer.memory);
+        free(frame_ns);
+        return;
+    }
+
+    uint64_t table_start_ns = get_current_time_ns();
+    if (!transform_build(&transform, width, height, 1.0f / render_scale, &global_thread_pool, 0))
+    {
+        free(buffer.memory);
+        free(frame_ns);
+        return;
+    }
+    uint64_t table_ns = get_current_time_ns() - table_start_ns;
+
+    struct TunnelShape shape = { .radius = TR_TUNNEL_RATIO, .aspect = 1.0f };
+    tunnel_shape_update(&tunnel_shape, &shape, 0, buffer, 0, 0);
+
+    // The table engine with both texel layouts, then the shape engine, then
+    // either one scrolling a prebuilt index cache (--redraw delta), so they
+    // can be compared on this machine.
+    for (int32_t variant = 0; variant < 4; ++variant)
+    {
+        enum TunnelEngine engine = variant == 2 ? ENGINE_SHAPE : ENGINE_TABLE;
+        enum TexelLayout texels = variant == 1 ? TEXELS_MORTON : TEXELS_COLORIZED;
+        tunnel_engine = engine;
+        texture_set_layout(texture, texels);
+        texture_colorize(texture, &global_palette, COLOR_WHITE, 0);
+
+        const uint16_t *indices = 0;
+        if (variant == 3)
+        {
+            if (!delta_renderer_build(&global_delta_renderer, &global_thread_pool, buffer))
+            {
+                break;
+            }
+            indices = global_delta_renderer.indices;
+        }
+
+        double l1_misses = 0.0;
+        double llc_misses = 0.0;
+        bench_count_misses(buffer, texture, indices, &l1_misses, &llc_misses);
+
+        // Warm up caches and page in the buffer before timing anything.
+        if (indices)
+        {
+            render_tunnel_delta_threaded(&global_thread_pool, buffer, texture, indices, 0, 0);
+        }
+        else
+        {
+            render_tunnel_threaded(&global_thread_pool, buffer, texture, 0, 0);
+        }
+
+        uint64_t total_ns = 0;
+        for (uint32_t frame = 0; frame < frame_count; ++frame)
+        {
+            int32_t offset = (int32_t)frame * TR_MOVEMENT_SPEED;
+            uint64_t start_ns = get_current_time_ns();
+            if (indices)
+            {
+                render_tunnel_delta_threaded(&global_thread_pool, buffer, texture, indices, offset, offset);
+            }
+            else
+            {
+                render_tunnel_threaded(&global_thread_pool, buffer, texture, offset, offset);
+            }
+            frame_ns[frame] = get_current_time_ns() - start_ns;
+            total_ns += frame_ns[frame];
+        }
+
+        qsort(frame_ns, frame_count, sizeof(uint64_t), compare_uint64);
+
+        uint64_t min_ns = frame_ns[0];
+        uint64_t median_ns = frame_ns[frame_count / 2];
+        uint64_t p99_ns = frame_ns[(frame_count * 99) / 100];
+        double megapixels = (double)width * height * frame_count / 1000000.0;
+        double mpix_per_second = megapixels / ((double)total_ns / 1000000000.0);
+
+        printf("%5dx%-5d %-6s %-9s %8u %10.3f %10.3f %10.3f %10.1f",
+                window_width, window_height, indices ? "delta" : engine == ENGINE_SHAPE ? "shape" : "table",
+                texels == TEXELS_MORTON ? "morton" : "colorized", frame_count,
+                min_ns / 1000000.0, median_ns / 1000000.0, p99_ns / 1000000.0,
+                mpix_per_second);
+        if (l1_misses >= 0.0)
+        {
+            printf(" %11.4f", l1_misses);
+        }
+        else
+        {
+            printf(" %11s", "-");
+        }
+        if (llc_misses >= 0.0)
+        {
+            printf(" %11.4f", llc_misses);
+        }
+        else
+        {
+            printf(" %11s", "-");
+        }
+        if (indices)
+        {
+            // The index cache in place of the tables.
+            printf(" %10s %10.1f\n", "-", (double)width * height * sizeof(uint16_t) / (1024.0 * 1024.0));
+        }
+        else if (engine == ENGINE_TABLE)
+        {
+            printf(" %10.3f %10.1f\n", table_ns / 1000000.0, transform_table_size(&transform) / (1024.0 * 1024.0));
+        }
+        else
+        {
+            printf(" %10s %10s\n", "-", "-");
+        }
+    }
+    tunnel_engine = ENGINE_TABLE;
+    texture_set_layout(texture, TEXELS_COLORIZED);
+
+    transform_free(&transform);
+    free(frame_ns);
+    free(buffer.memory);
+}
+
+
+int
+run_benchmark(int32_t sizes[][2], uint32_t size_count, uint32_t frame_count)
+{
+    texture_init(&global_texture);
+    texture_colorize(&global_texture, &global_palette, COLOR_WHITE, 0);
+
+    printf("Rendering with %u threads, %s kernel, scale %g, %s tables\n",
+            global_thread_pool.worker_count + 1, tunnel_kernel->name, (double)render_scale,
+            transform_layout == TRANSFORM_QUADRANT ? "quadrant" : "full");
+    printf("%-11s %-6s %-9s %8s %10s %10s %10s %10s %11s %11s %10s %10s\n", "resolution", "engine", "texels", "frames",
+            "min ms", "median ms", "p99 ms", "Mpix/s", "L1 miss/px", "LLC miss/px", "table ms", "table MB");
+    for (uint32_t i = 0; i < size_count; ++i)
+    {
+        bench_resolution(&global_texture, sizes[i][0], sizes[i][1], frame_count);
+    }
+    delta_renderer_free(&global_delta_renderer);
+
+    // Texture updates are timed on their own: regenerating every slot, then
+    // animating the plasma frame by frame through a fixed gradient.
+    memset(&texture_stats, 0, sizeof(texture_stats));
+    texture_init(&global_texture);
+    texture_select(&global_texture, TEXTURE_PLASMA);
+    for (uint32_t frame = 0; frame < frame_count; ++frame)
+    {
+        texture_animate(&global_texture, frame + 1);
+        texture_colorize(&global_texture, &global_palette, COLOR_FIRE, 0);
+    }
+    // And again for the Z-order store, which swizzles instead of colorizing.
+    texture_set_layout(&global_texture, TEXELS_MORTON);
+    for (uint32_t frame = 0; frame < frame_count; ++frame)
+    {
+        texture_animate(&global_texture, frame_count + frame + 1);
+        texture_colorize(&global_texture, &global_palette, COLOR_FIRE, 0);
+    }
+    texture_set_layout(&global_texture, TEXELS_COLORIZED);
+
+    printf("\n%-11s %8s %10s %10s %10s\n", "texture", "updates", "rows", "avg ms", "max ms");
+    for (int32_t update = 0; update < TEXTURE_UPDATE_COUNT; ++update)
+    {
+        uint64_t updates = texture_stats.updates[update];
+        if (updates)
+        {
+            printf("%-11s %8" PRIu64 " %10" PRIu64 " %10.4f %10.4f\n",
+                    texture_update_name((enum TextureUpdate)update),
+                    updates,
+                    texture_stats.rows[update] / updates,
+                    (double)texture_stats.total_ns[update] / updates / TR_MILLISECOND,
+                    (double)texture_stats.max_ns[update] / TR_MILLISECOND);
+        }
+    }
+
+    return 0;
+}
+
+
+#ifdef TR_MICROBENCH
+void
+perf_counters_start(struct PerfCounters *counters)
+{
+#ifdef __linux__
+    static const uint32_t types[PERF_COUNTER_COUNT] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+    };
+    static const uint64_t configs[PERF_COUNTER_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    for (int32_t i = 0; i < PERF_COUNTER_COUNT; ++i)
+    {
+        counters->fds[i] = perf_counter_open(types[i], configs[i]);
+    }
+#else
+    for (int32_t i = 0; i < PERF_COUNTER_COUNT; ++i)
+    {
+        counters->fds[i] = perf_counter_open(0, 0);
+    }
+#endif
+    for (int32_t i = 0; i < PERF_COUNTER_COUNT; ++i)
+    {
+        counters->start[i] = perf_counter_read(counters->fds[i]);
+    }
+}
+
+
+// Close the counters and store how far each advanced, or -1 for the ones
+// that weren't available.
+void
+perf_counters_stop(struct PerfCounters *counters, double *deltas)
+{
+    for (int32_t i = 0; i < PERF_COUNTER_COUNT; ++i)
+    {
+        if (counters->fds[i] < 0)
+        {
+            deltas[i] = -1.0;
+            continue;
+        }
+        deltas[i] = (double)(perf_counter_read(counters->fds[i]) - counters->start[i]);
+        close(counters->fds[i]);
+        counters->fds[i] = -1;
+    }
+}
+
+
+void
+microbench_setup_tunnel(struct MicrobenchContext *context, int32_t argument)
+{
+    enum TransformLayout layout = argument == 1 ? TRANSFORM_FULL : TRANSFORM_QUADRANT;
+    tunnel_engine = argument == 3 ? ENGINE_SHAPE : ENGINE_TABLE;
+    if (tunnel_engine == ENGINE_TABLE && (!transform.table || transform.layout != layout))
+    {
+        transform_layout = layout;
+        transform_build(&transform, context->buffer.width, context->buffer.height, 1.0f, &global_thread_pool, 0);
+    }
+    transform_set_look(&transform, context->buffer, 0, 0);
+    struct TunnelShape shape = { .radius = TR_TUNNEL_RATIO, .aspect = 1.0f };
+    tunnel_shape_update(&tunnel_shape, &shape, 0, context->buffer, 0, 0);
+
+    texture_set_layout(&global_texture, argument == 2 ? TEXELS_MORTON : TEXELS_COLORIZED);
+    texture_colorize(&global_texture, &global_palette, COLOR_FIRE, 0);
+    if (argument == 4)
+    {
+        delta_renderer_build(&global_delta_renderer, &global_thread_pool, context->buffer);
+    }
+}
+
+
+void
+microbench_render_tunnel(struct MicrobenchContext *context, int32_t argument, uint32_t iteration)
+{
+    int32_t offset = (int32_t)iteration * TR_MOVEMENT_SPEED;
+    if (argument == 4)
+    {
+        render_tunnel_delta(context->buffer, &global_texture, global_delta_renderer.indices, offset, offset);
+    }
+    else
+    {
+        render_tunnel(context->buffer, &global_texture, offset, offset);
+    }
+}
+
+
+void
+microbench_render_texture(struct MicrobenchContext *context, int32_t argument, uint32_t iteration)
+{
+    (void)argument;
+    render_texture(context->buffer, &global_texture, (int32_t)iteration, (int32_t)iteration);
+}
+
+
+// The tables sdl_resize_texture builds, on this thread alone.
+void
+microbench_transform_build(struct MicrobenchContext *context, int32_t argument, uint32_t iteration)
+{
+    (void)argument;
+    (void)iteration;
+    transform_build(&context->tables, context->buffer.width, context->buffer.height, 1.0f, 0, 0);
+}
+
+
+void
+microbench_texture_generate(struct MicrobenchContext *context, int32_t argument, uint32_t iteration)
+{
+    (void)context;
+    texture_generate(&global_texture, (enum TexturePattern)argument, iteration);
+}
+
+
+void
+microbench_setup_texture_animate(struct MicrobenchContext *context, int32_t argument)
+{
+    (void)context;
+    (void)argument;
+    texture_set_layout(&global_texture, TEXELS_COLORIZED);
+    texture_select(&global_texture, TEXTURE_PLASMA);
+    texture_colorize(&global_texture, &global_palette, COLOR_FIRE, 0);
+}
+
+
+// One frame's texture update for an animated pattern: new rows, colorized.
+void
+microbench_texture_animate(struct MicrobenchContext *context, int32_t argument, uint32_t iteration)
+{
+    (void)context;
+    (void)argument;
+    texture_animate(&global_texture, iteration + 1);
+    texture_colorize(&global_texture, &global_palette, COLOR_FIRE, 0);
+}
+
+
+// What SDL_UpdateTexture does with the back buffer in --present update: a
+// copy row by row into a texture with its own pitch.
+void
+microbench_present_copy(struct MicrobenchContext *context, int32_t argument, uint32_t iteration)
+{
+    (void)argument;
+    (void)iteration;
+    const uint8_t *source = (const uint8_t *)context->buffer.memory;
+    uint8_t *destination = context->upload;
+    for (uint32_t y = 0; y < context->buffer.height; ++y)
+    {
+        memcpy(destination, source, context->buffer.width * TR_BYTES_PER_PIXEL);
+        source += context->buffer.pitch;
+        destination += context->upload_pitch;
+    }
+}
+
+
+void
+microbench_print_value(double value, bool available)
+{
+    if (available)
+    {
+        printf(" %9.3f", value);
+    }
+    else
+    {
+        printf(" %9s", "-");
+    }
+}
+
+
+// Time each hot function on its own, on this thread, with cycles,
+// instructions, last level cache misses and branch misses counted around
+// it, and write the results to `json_path` as well as stdout. The render
+// functions are run with every supported tunnel kernel.
+int
+run_microbench(const char *json_path, int32_t width, int32_t height, uint32_t render_iterations)
+{
+    static const struct Microbench render_benches[] = {
+        { "render_tunnel/table-quadrant", microbench_setup_tunnel, microbench_render_tunnel, 0, 0, false },
+        { "render_tunnel/table-full", microbench_setup_tunnel, microbench_render_tunnel, 1, 0, false },
+        { "render_tunnel/table-morton", microbench_setup_tunnel, microbench_render_tunnel, 2, 0, false },
+        { "render_tunnel/shape", microbench_setup_tunnel, microbench_render_tunnel, 3, 0, false },
+        { "render_tunnel/delta", microbench_setup_tunnel, microbench_render_tunnel, 4, 0, false },
+    };
+    static const struct Microbench other_benches[] = {
+        { "render_texture", microbench_setup_texture_animate, microbench_render_texture, 0, 0, false },
+        { "transform_build", 0, microbench_transform_build, 0, TR_MICROBENCH_BUILD_ITERATIONS, false },
+        { "texture_generate/xor", 0, microbench_texture_generate, TEXTURE_XOR, TR_MICROBENCH_TEXTURE_ITERATIONS, true },
+        { "texture_generate/mosaic", 0, microbench_texture_generate, TEXTURE_MOSAIC, TR_MICROBENCH_TEXTURE_ITERATIONS, true },
+        { "texture_generate/checker", 0, microbench_texture_generate, TEXTURE_CHECKER, TR_MICROBENCH_TEXTURE_ITERATIONS, true },
+        { "texture_generate/noise", 0, microbench_texture_generate, TEXTURE_NOISE, TR_MICROBENCH_TEXTURE_ITERATIONS, true },
+        { "texture_generate/plasma", 0, microbench_texture_generate, TEXTURE_PLASMA, TR_MICROBENCH_TEXTURE_ITERATIONS, true },
+        { "texture_animate", microbench_setup_texture_animate, microbench_texture_animate, 0, TR_MICROBENCH_TEXTURE_ITERATIONS, true },
+        { "present_copy", 0, microbench_present_copy, 0, 0, false },
+    };
+    uint32_t render_bench_count = sizeof(render_benches) / sizeof(render_benches[0]);
+    uint32_t other_bench_count = sizeof(other_benches) / sizeof(other_benches[0]);
+
+    FILE *json = fopen(json_path, "w");
+    if (!json)
+    {
+        TR_LOG_ERR("Couldn't open %s: %s\n", json_path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    struct MicrobenchContext context;
+    memset(&context, 0, sizeof(context));
+    context.buffer.width = width;
+    context.buffer.height = height;
+    context.buffer.pitch = width * TR_BYTES_PER_PIXEL;
+    context.buffer.scale = 1.0f;
+    context.buffer.memory = calloc((size_t)width * height, TR_BYTES_PER_PIXEL);
+    // NOTE: Padded like a texture pitch can be, so the copy isn't one memcpy.
+    context.upload_pitch = (width * TR_BYTES_PER_PIXEL + 63) & ~63;
+    context.upload = calloc((size_t)context.upload_pitch, height);
+    if (!context.buffer.memory || !context.upload)
+    {
+        TR_LOG_ERR("Microbench: out of memory at %dx%d\n", width, height);
+        free(context.buffer.memory);
+        free(context.upload);
+        fclose(json);
+        return EXIT_FAILURE;
+    }
+
+    const struct TunnelKernel *selected_kernel = tunnel_kernel;
+    enum TransformLayout selected_layout = transform_layout;
+    texture_init(&global_texture);
+    texture_colorize(&global_texture, &global_palette, COLOR_FIRE, 0);
+
+    fprintf(json, "{\n  \"width\": %d,\n  \"height\": %d,\n  \"benchmarks\": [", width, height);
+    printf("%-36s %6s %10s %9s %9s %9s %9s %9s %9s\n", "benchmark", "iters", "ms/iter", "ns/item",
+            "cyc/item", "ins/item", "IPC", "LLC/kitem", "brm/kitem");
+
+    uint32_t kernel_count = TR_TUNNEL_KERNEL_COUNT;
+    bool first = true;
+    for (uint32_t k = 0; k <= kernel_count; ++k)
+    {
+        // NOTE: The last pass runs the benchmarks that don't use a kernel.
+        bool render_pass = k < kernel_count;
+        if (render_pass && !tunnel_kernels[k].is_supported())
+        {
+            continue;
+        }
+        tunnel_kernel = render_pass ? &tunnel_kernels[k] : selected_kernel;
+        const struct Microbench *benches = render_pass ? render_benches : other_benches;
+        uint32_t bench_count = render_pass ? render_bench_count : other_bench_count;
+
+        for (uint32_t b = 0; b < bench_count; ++b)
+        {
+            const struct Microbench *bench = &benches[b];
+            uint32_t iterations = bench->iterations ? bench->iterations : render_iterations;
+            if (bench->setup)
+            {
+                bench->setup(&context, bench->argument);
+            }
+            // Warm up caches once, untimed.
+            bench->run(&context, bench->argument, 0);
+
+            struct PerfCounters counters;
+            perf_counters_start(&counters);
+            uint64_t start_ns = get_current_time_ns();
+            for (uint32_t i = 0; i < iterations; ++i)
+            {
+                bench->run(&context, bench->argument, i + 1);
+            }
+            uint64_t elapsed_ns = get_current_time_ns() - start_ns;
+            double deltas[PERF_COUNTER_COUNT];
+            perf_counters_stop(&counters, deltas);
+
+            char name[128];
+            snprintf(name, sizeof(name), "%s%s%s", bench->name, render_pass ? "/" : "", render_pass ? tunnel_kernel->name : "");
+            double items = (bench->per_texel ? (double)TR_TEX_WIDTH * TR_TEX_HEIGHT : (double)width * height) * iterations;
+
+            double cycles = deltas[PERF_COUNTER_CYCLES];
+            double instructions = deltas[PERF_COUNTER_INSTRUCTIONS];
+            printf("%-36s %6u %10.3f %9.3f", name, iterations, (double)elapsed_ns / iterations / TR_MILLISECOND, (double)elapsed_ns / items);
+            microbench_print_value(cycles / items, cycles >= 0.0);
+            microbench_print_value(instructions / items, instructions >= 0.0);
+            microbench_print_value(instructions / cycles, instructions >= 0.0 && cycles > 0.0);
+            microbench_print_value(deltas[PERF_COUNTER_LLC_MISSES] * 1000.0 / items, deltas[PERF_COUNTER_LLC_MISSES] >= 0.0);
+            microbench_print_value(deltas[PERF_COUNTER_BRANCH_MISSES] * 1000.0 / items, deltas[PERF_COUNTER_BRANCH_MISSES] >= 0.0);
+            printf("\n");
+            fprintf(json, "%s\n    {\"name\": \"%s\", \"iterations\": %u, \"items_per_iteration\": %.0f, \"ns_per_iteration\": %.1f",
+                    first ? "" : ",", name, iterations, items / iterations, (double)elapsed_ns / iterations);
+            first = false;
+
+            static const char *counter_names[PERF_COUNTER_COUNT] = { "cycles", "instructions", "llc_misses", "branch_misses" };
+            for (int32_t c = 0; c < PERF_COUNTER_COUNT; ++c)
+            {
+                if (deltas[c] < 0.0)
+                {
+                    fprintf(json, ", \"%s\": null", counter_names[c]);
+                }
+                else
+                {
+                    fprintf(json, ", \"%s\": %.1f", counter_names[c], deltas[c] / iterations);
+                }
+            }
+            fprintf(json, "}");
+        }
+    }
+    fprintf(json, "\n  ]\n}\n");
+
+    tunnel_kernel = selected_kernel;
+    tunnel_engine = ENGINE_TABLE;
+    transform_layout = selected_layout;
+    texture_set_layout(&global_texture, TEXELS_COLORIZED);
+    transform_free(&transform);
+    transform_free(&context.tables);
+    delta_renderer_free(&global_delta_renderer);
+    free(context.buffer.memory);
+    free(context.upload);
+
+    bool write_failed = ferror(json) != 0;
+    if (fclose(json) != 0 || write_failed)
+    {
+        TR_LOG_ERR("Couldn't write %s\n", json_path);
+        return EXIT_FAILURE;
+    }
+    printf("Wrote %s\n", json_path);
+    return 0;
+}
+#endif
+
+
+uint32_t
+random_next(uint32_t *state)
+{
+    // xorshift32
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+
+// Random texels, stored both colorized through a random palette and in
+// Z-order.
+void
+selftest_fill_textures(uint32_t *seed, uint32_t *colorized, uint8_t *morton, uint32_t *palette)
+{
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        palette[i] = random_next(seed);
+    }
+    for (uint32_t i = 0; i < TR_TEX_WIDTH * TR_TEX_HEIGHT; ++i)
+    {
+        uint8_t texel = (uint8_t)random_next(seed);
+        colorized[i] = palette[texel];
+        morton[morton_swizzle((uint16_t)i)] = texel;
+    }
+}
+
+
+// Compare every vector kernel the CPU supports against the scalar reference
+// over random tables, offsets, widths, and colors.
+int
+run_selftest(void)
+{
+    uint32_t max_count = 1024;
+    uint16_t *table_row = malloc(max_count * sizeof(uint16_t));
+    uint32_t *expected = malloc(max_count * sizeof(uint32_t));
+    uint32_t *actual = malloc(max_count * sizeof(uint32_t));
+    uint32_t *texture = malloc(TR_TEX_WIDTH * TR_TEX_HEIGHT * sizeof(uint32_t));
+    uint8_t *morton = malloc(TR_TEX_WIDTH * TR_TEX_HEIGHT + 3);
+    uint32_t palette[256];
+
+    if (!table_row || !expected || !actual || !texture || !morton)
+    {
+        TR_LOG_ERR("Selftest: out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    int result = 0;
+
+    // The single-channel palettes must match what the per-pixel color switch
+    // used to produce.
+    uint32_t palette_failures = 0;
+    for (int32_t color = COLOR_GREEN; color <= COLOR_WHITE; ++color)
+    {
+        struct Palette built = {0};
+        const uint32_t *lut = palette_lookup(&built, (enum Color)color, 0);
+        for (uint32_t texel = 0; texel < 256; ++texel)
+        {
+            uint32_t red = texel << 16;
+            uint32_t green = texel << 8;
+            uint32_t blue = texel;
+            uint32_t channels[] = {
+                green, red, blue, red | green, red | blue, blue | green, red | green | blue
+            };
+            if (lut[texel] != channels[color])
             {
-                case SDL_WINDOWEVENT_SIZE_CHANGED:
-                {
-                    SDL_Window *window = SDL_GetWindowFromID(event->window.windowID);
-                    SDL_Renderer *renderer = SDL_GetRenderer(window);
-                    TR_LOG_DBG("SDL_WINDOWEVENT_SIZE_CHANGED (%d, %d)\n", event->window.data1, event->window.data2);
-                    sdl_resize_texture(&global_back_buffer, renderer, event->window.data1, event->window.data2);
-                } break;
+                ++palette_failures;
+            }
+        }
+    }
+    printf("%-8s %s (%u/%d mismatched)\n", "palette", palette_failures ? "FAILED" : "ok", palette_failures, 256 * (COLOR_WHITE + 1));
+    if (palette_failures)
+    {
+        result = EXIT_FAILURE;
+    }
 
-                case SDL_WINDOWEVENT_FOCUS_GAINED:
+    // The Z-order store colored through a palette must draw exactly what
+    // the colorized store does.
+    uint32_t morton_seed = 0x2468ACE0;
+    uint32_t morton_failures = 0;
+    for (uint32_t iteration = 0; iteration < TR_SELFTEST_ITERATIONS; ++iteration)
+    {
+        selftest_fill_textures(&morton_seed, texture, morton, palette);
+        uint32_t count = random_next(&morton_seed) % max_count + 1;
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            table_row[i] = (uint16_t)random_next(&morton_seed);
+        }
+        int32_t rotation_offset = (int32_t)random_next(&morton_seed);
+        int32_t translation_offset = (int32_t)random_next(&morton_seed);
+        tunnel_row_scalar(expected, table_row, 1, count, texture, 0, rotation_offset, translation_offset);
+        tunnel_row_morton_scalar(actual, table_row, 1, count, morton, palette, 0, rotation_offset, translation_offset);
+        if (memcmp(expected, actual, count * sizeof(uint32_t)) != 0)
+        {
+            ++morton_failures;
+        }
+    }
+    printf("%-8s %s (%u/%d mismatched)\n", "morton", morton_failures ? "FAILED" : "ok", morton_failures, TR_SELFTEST_ITERATIONS);
+    if (morton_failures)
+    {
+        result = EXIT_FAILURE;
+    }
+
+    for (uint32_t k = 1; k < TR_TUNNEL_KERNEL_COUNT; ++k)
+    {
+        const struct TunnelKernel *kernel = &tunnel_kernels[k];
+        if (!kernel->is_supported())
+        {
+            printf("%-8s skipped (not supported)\n", kernel->name);
+            continue;
+        }
+
+        uint32_t seed = 0x12345678;
+        uint32_t failures = 0;
+        for (uint32_t iteration = 0; iteration < TR_SELFTEST_ITERATIONS; ++iteration)
+        {
+            for (uint32_t i = 0; i < TR_TEX_WIDTH * TR_TEX_HEIGHT; ++i)
+            {
+                texture[i] = random_next(&seed);
+            }
+
+            uint32_t count = random_next(&seed) % max_count + 1;
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                table_row[i] = (uint16_t)random_next(&seed);
+            }
+
+            // Cover both read directions and both entry masks the quadrant
+            // layout uses.
+            uint32_t variant = random_next(&seed);
+            int32_t step = (variant & 1) ? -1 : 1;
+            const uint16_t *start = step > 0 ? table_row : table_row + count - 1;
+            uint16_t entry_mask = (variant & 2) ? 0xFF : 0;
+
+            int32_t rotation_offset = (int32_t)random_next(&seed);
+            int32_t translation_offset = (int32_t)random_next(&seed);
+            tunnel_row_scalar(expected, start, step, count, texture, entry_mask, rotation_offset, translation_offset);
+            kernel->function(actual, start, step, count, texture, entry_mask, rotation_offset, translation_offset);
+
+            if (memcmp(expected, actual, count * sizeof(uint32_t)) != 0)
+            {
+                ++failures;
+            }
+        }
+
+        printf("%-8s %s (%u/%d mismatched)\n", kernel->name, failures ? "FAILED" : "ok", failures, TR_SELFTEST_ITERATIONS);
+        if (failures)
+        {
+            result = EXIT_FAILURE;
+        }
+
+        uint32_t kernel_morton_failures = 0;
+        for (uint32_t iteration = 0; iteration < TR_SELFTEST_ITERATIONS; ++iteration)
+        {
+            selftest_fill_textures(&seed, texture, morton, palette);
+            uint32_t count = random_next(&seed) % max_count + 1;
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                table_row[i] = (uint16_t)random_next(&seed);
+            }
+
+            uint32_t variant = random_next(&seed);
+            int32_t step = (variant & 1) ? -1 : 1;
+            const uint16_t *start = step > 0 ? table_row : table_row + count - 1;
+            uint16_t entry_mask = (variant & 2) ? 0xFF : 0;
+
+            int32_t rotation_offset = (int32_t)random_next(&seed);
+            int32_t translation_offset = (int32_t)random_next(&seed);
+            tunnel_row_morton_scalar(expected, start, step, count, morton, palette, entry_mask, rotation_offset, translation_offset);
+            kernel->morton_function(actual, start, step, count, morton, palette, entry_mask, rotation_offset, translation_offset);
+
+            if (memcmp(expected, actual, count * sizeof(uint32_t)) != 0)
+            {
+                ++kernel_morton_failures;
+            }
+        }
+
+        printf("%-8s %s (%u/%d mismatched)\n", "  morton", kernel_morton_failures ? "FAILED" : "ok", kernel_morton_failures, TR_SELFTEST_ITERATIONS);
+        if (kernel_morton_failures)
+        {
+            result = EXIT_FAILURE;
+        }
+
+        if (kernel->shape_function == tunnel_shape_row_scalar)
+        {
+            continue;
+        }
+
+        uint32_t shape_failures = 0;
+        for (uint32_t iteration = 0; iteration < TR_SELFTEST_ITERATIONS; ++iteration)
+        {
+            // Random geometry, including rows through the center.
+            struct TunnelShapeParams params = {
+                .depth_scale = (float)(random_next(&seed) % 64 + 1) * TR_TEX_HEIGHT,
+                .twist = (float)((int32_t)(random_next(&seed) % 2001) - 1000) / 10000.0f,
+                .aspect = 0.5f + (float)(random_next(&seed) % 1000) / 500.0f,
+                .squareness = (float)(random_next(&seed) % 1001) / 1000.0f,
+                .pixel_size = (float)(random_next(&seed) % 4 + 1),
+            };
+            uint32_t count = random_next(&seed) % max_count + 1;
+            float dx = -(float)(random_next(&seed) % (2 * count)) * params.pixel_size;
+            float dy = (float)((int32_t)(random_next(&seed) % 401) - 200);
+            if (iteration % 10 == 0)
+            {
+                dy = 0.0f;
+            }
+
+            int32_t rotation_offset = (int32_t)random_next(&seed);
+            int32_t translation_offset = (int32_t)random_next(&seed);
+            tunnel_shape_row_scalar(expected, count, dx, dy, &params, texture, rotation_offset, translation_offset);
+            kernel->shape_function(actual, count, dx, dy, &params, texture, rotation_offset, translation_offset);
+
+            if (memcmp(expected, actual, count * sizeof(uint32_t)) != 0)
+            {
+                ++shape_failures;
+            }
+        }
+
+        printf("%-8s %s (%u/%d mismatched)\n", "  shape", shape_failures ? "FAILED" : "ok", shape_failures, TR_SELFTEST_ITERATIONS);
+        if (shape_failures)
+        {
+            result = EXIT_FAILURE;
+        }
+    }
+
+    free(morton);
+    free(texture);
+    free(actual);
+    free(expected);
+    free(table_row);
+    return result;
+}
+
+
+static const struct CheckFrame check_frames[TR_CHECK_FRAMES] = {
+    { 0, 0, 0, 0, COLOR_WHITE, 0 },
+    { 37, 5, 12000, -8000, COLOR_FIRE, 0 },
+    { -200, 513, TR_CONTROLLER_STICK_MIN + 2, TR_CONTROLLER_STICK_MAX - 3, COLOR_RAINBOW, 40 },
+    { 1000, -77, TR_CONTROLLER_STICK_MAX - 3, TR_CONTROLLER_STICK_MIN + 2, COLOR_GREEN, 0 },
+    { 255, 256, -5000, 300, COLOR_OCEAN, 200 },
+    { -1, -1, 0, 20000, COLOR_MAGENTA, 0 },
+    // Only the color changes, so --redraw delta has to notice it.
+    { -1, -1, 0, 20000, COLOR_GREEN, 0 },
+};
+
+static const struct TunnelShape check_shape = { 24.0f, 0.002f, 1.3f, 0.5f };
+
+// NOTE: The golden hashes are of the reference path (scalar kernel, full
+// tables, one thread). The tables go through sqrtf/atan2f and the palettes
+// and textures through other libm functions, so a C library that rounds
+// those differently fails here while every path still matches the
+// reference. The shape hashes also assume -ffp-contract=off (see the pragma
+// at the top of the file): an FMA in the scalar shape kernel changes its
+// frames. Compare frames with --check-dump before updating these.
+static const struct CheckScene check_scenes[] = {
+    { "tunnel-640x480", CHECK_TUNNEL, ENGINE_TABLE, 640, 480, 1.0f, TEXTURE_XOR, 0x1f52facf09fee507ull },
+    { "tunnel-333x197", CHECK_TUNNEL, ENGINE_TABLE, 333, 197, 1.0f, TEXTURE_NOISE, 0x166cfe1ff606766full },
+    { "tunnel-scaled", CHECK_TUNNEL, ENGINE_TABLE, 640, 480, 0.5f, TEXTURE_CHECKER, 0x5faf1ce14bbc926aull },
+    { "shape-640x480", CHECK_TUNNEL, ENGINE_SHAPE, 640, 480, 1.0f, TEXTURE_XOR, 0x2ab698288f1f5d6dull },
+    { "shape-scaled", CHECK_TUNNEL, ENGINE_SHAPE, 333, 197, 0.75f, TEXTURE_MOSAIC, 0xa12a2d2b4434309bull },
+    { "texture-300x200", CHECK_TEXTURE, ENGINE_TABLE, 300, 200, 1.0f, TEXTURE_MOSAIC, 0x8e4f1eccc3b51ad8ull },
+};
+#define TR_CHECK_SCENE_COUNT (sizeof(check_scenes) / sizeof(check_scenes[0]))
+
+
+// Render the check frames for `scene` with the current kernel and table
+// layout, on `pool` if given, and hash each one. Frames are also written to
+// `dump_dir` as PPM images if it's set.
+bool
+check_render_scene(const struct CheckScene *scene, struct SDLOffscreenBuffer buffer, struct ThreadPool *pool, struct DeltaRenderer *delta, uint64_t *hashes, const char *dump_dir)
+{
+    tunnel_engine = scene->engine;
+    if (delta)
+    {
+        delta->presented_valid = false;
+    }
+    if (scene->view == CHECK_TUNNEL && scene->engine == ENGINE_TABLE
+            && !transform_build(&transform, buffer.width, buffer.height, 1.0f / scene->scale, pool, 0))
+    {
+        return false;
+    }
+
+    for (uint32_t frame = 0; frame < TR_CHECK_FRAMES; ++frame)
+    {
+        const struct CheckFrame *input = &check_frames[frame];
+        texture_colorize(&global_texture, &global_palette, input->color_choice, input->palette_phase);
+
+        if (scene->view == CHECK_TEXTURE)
+        {
+            render_texture(buffer, &global_texture, input->rotation_offset, input->translation_offset);
+        }
+        else
+        {
+            transform_set_look(&transform, buffer, input->look_x, input->look_y);
+            tunnel_shape_update(&tunnel_shape, &check_shape, frame * 60, buffer, input->look_x, input->look_y);
+            if (delta)
+            {
+                // NOTE: A frame the render loop wouldn't redraw is skipped
+                // here too, leaving the last one in the buffer.
+                struct FrameKey key = frame_key_current(buffer, &global_texture, input->rotation_offset, input->translation_offset);
+                if (!delta_renderer_unchanged(delta, &key))
                 {
-                    TR_LOG_DBG("SDL_WINDOWEVENT_FOCUS_GAINED\n");
-                } break;
+                    // NOTE: Rebuilt for every frame drawn, to draw each one
+                    // from the cache whatever its geometry.
+                    if (!delta_renderer_build(delta, pool, buffer))
+                    {
+                        return false;
+                    }
+                    if (pool)
+                    {
+                        render_tunnel_delta_threaded(pool, buffer, &global_texture, delta->indices, input->rotation_offset, input->translation_offset);
+                    }
+                    else
+                    {
+                        render_tunnel_delta(buffer, &global_texture, delta->indices, input->rotation_offset, input->translation_offset);
+                    }
+                }
+            }
+            else if (pool)
+            {
+                render_tunnel_threaded(pool, buffer, &global_texture, input->rotation_offset, input->translation_offset);
+            }
+            else
+            {
+                render_tunnel(buffer, &global_texture, input->rotation_offset, input->translation_offset);
+            }
+        }
 
-                case SDL_WINDOWEVENT_EXPOSED:
+        hashes[frame] = frame_hash(buffer, TR_FNV_OFFSET_BASIS);
+
+        if (dump_dir)
+        {
+            char path[TR_MAX_PATH];
+            snprintf(path, sizeof(path), "%s/%s-%u.ppm", dump_dir, scene->name, frame);
+            if (!frame_write_ppm(buffer, path))
+            {
+                return false;
+            }
+        }
+    }
+
+    tunnel_engine = ENGINE_TABLE;
+    transform_free(&transform);
+    return true;
+}
+
+
+// Render a fixed sequence of frames for each scene along the reference path
+// and compare their hashes to the golden ones, then along every other path
+// (each supported kernel, table and texel layout, with and without the
+// thread pool and the index cache) and check that each frame matches the
+// reference bit for bit.
+int
+run_check(const char *dump_dir)
+{
+    const struct TunnelKernel *selected_kernel = tunnel_kernel;
+    enum TransformLayout selected_layout = transform_layout;
+
+    uint32_t max_pixels = 0;
+    for (uint32_t s = 0; s < TR_CHECK_SCENE_COUNT; ++s)
+    {
+        uint32_t pixels = (uint32_t)(check_scenes[s].window_width * check_scenes[s].window_height);
+        max_pixels = pixels > max_pixels ? pixels : max_pixels;
+    }
+    void *memory = malloc(max_pixels * TR_BYTES_PER_PIXEL);
+    if (!memory)
+    {
+        TR_LOG_ERR("Check: out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    texture_init(&global_texture);
+
+    int result = 0;
+    for (uint32_t s = 0; s < TR_CHECK_SCENE_COUNT; ++s)
+    {
+        const struct CheckScene *scene = &check_scenes[s];
+        struct SDLWindowDimension render = render_dimension(scene->window_width, scene->window_height, scene->scale);
+        struct SDLOffscreenBuffer buffer = {0};
+        buffer.memory = memory;
+        buffer.width = render.width;
+        buffer.height = render.height;
+        buffer.pitch = render.width * TR_BYTES_PER_PIXEL;
+        buffer.scale = scene->scale;
+        texture_select(&global_texture, scene->pattern);
+
+        uint64_t reference[TR_CHECK_FRAMES];
+        tunnel_kernel = &tunnel_kernels[0];
+        transform_layout = TRANSFORM_FULL;
+        if (!check_render_scene(scene, buffer, 0, 0, reference, dump_dir))
+        {
+            result = EXIT_FAILURE;
+            break;
+        }
+
+        uint64_t hash = TR_FNV_OFFSET_BASIS;
+        for (uint32_t frame = 0; frame < TR_CHECK_FRAMES; ++frame)
+        {
+            hash = (hash ^ reference[frame]) * TR_FNV_PRIME;
+        }
+        bool golden_ok = hash == scene->golden;
+
+        // NOTE: Bit 0 of `layout` picks the quadrant tables and bit 1 Z-order
+        // texels. render_texture only reads the texels and the shape engine
+        // uses neither.
+        uint32_t kernel_count = scene->view == CHECK_TUNNEL ? TR_TUNNEL_KERNEL_COUNT : 1;
+        uint32_t layout_count = scene->view == CHECK_TEXTURE || scene->engine == ENGINE_TABLE ? 4 : 1;
+        uint32_t layout_step = scene->view == CHECK_TEXTURE ? 2 : 1;
+        // Bit 0 of `mode` picks the thread pool and bit 1 the index cache.
+        int32_t mode_count = scene->view == CHECK_TUNNEL ? 4 : 1;
+        uint32_t paths = 0;
+        uint32_t failed_paths = 0;
+        for (uint32_t k = 0; k < kernel_count; ++k)
+        {
+            if (!tunnel_kernels[k].is_supported())
+            {
+                continue;
+            }
+            for (uint32_t layout = 0; layout < layout_count; layout += layout_step)
+            {
+                for (int32_t mode = 0; mode < mode_count; ++mode)
                 {
-                    SDL_Window *window = SDL_GetWindowFromID(event->window.windowID);
-                    SDL_Renderer *renderer = SDL_GetRenderer(window);
-                    sdl_update_window(renderer, global_back_buffer);
-                } break;
+                    bool threaded = mode & 1;
+                    bool delta = mode & 2;
+                    if (k == 0 && layout == 0 && mode == 0)
+                    {
+                        continue;
+                    }
+
+                    tunnel_kernel = &tunnel_kernels[k];
+                    transform_layout = (layout & 1) ? TRANSFORM_QUADRANT : TRANSFORM_FULL;
+                    texture_set_layout(&global_texture, (layout & 2) ? TEXELS_MORTON : TEXELS_COLORIZED);
+                    uint64_t hashes[TR_CHECK_FRAMES] = {0};
+                    check_render_scene(scene, buffer, threaded ? &global_thread_pool : 0, delta ? &global_delta_renderer : 0, hashes, 0);
+                    texture_set_layout(&global_texture, TEXELS_COLORIZED);
+                    ++paths;
+
+                    for (uint32_t frame = 0; frame < TR_CHECK_FRAMES; ++frame)
+                    {
+                        if (hashes[frame] != reference[frame])
+                        {
+                            printf("%-16s FAILED: %s kernel, %s tables, %s texels, %s%s differs from the reference at frame %u\n",
+                                    scene->name, tunnel_kernels[k].name, (layout & 1) ? "quadrant" : "full",
+                                    (layout & 2) ? "morton" : "colorized", threaded ? "threaded" : "single-threaded",
+                                    delta ? " from the index cache" : "", frame);
+                            ++failed_paths;
+                            break;
+                        }
+                    }
+                }
             }
-        } break;
+        }
+
+        if (golden_ok && failed_paths == 0)
+        {
+            printf("%-16s ok (%016" PRIx64 ", %u other paths match)\n", scene->name, hash, paths);
+        }
+        else
+        {
+            if (!golden_ok)
+            {
+                printf("%-16s FAILED: reference hash %016" PRIx64 ", golden %016" PRIx64 "\n",
+                        scene->name, hash, scene->golden);
+            }
+            result = EXIT_FAILURE;
+        }
     }
-    return should_quit ;
+
+    tunnel_kernel = selected_kernel;
+    transform_layout = selected_layout;
+    delta_renderer_free(&global_delta_renderer);
+    free(memory);
+    return result;
+}
+
+// BT.601 studio-swing YUV, at full chroma resolution.
+void
+export_convert_y4m(struct FrameExporter *exporter, const uint32_t *frame)
+{
+    uint32_t pixel_count = exporter->width * exporter->height;
+    uint8_t *y_plane = exporter->planes;
+    uint8_t *u_plane = y_plane + pixel_count;
+    uint8_t *v_plane = u_plane + pixel_count;
+    for (uint32_t i = 0; i < pixel_count; ++i)
+    {
+        int32_t r = (frame[i] >> 16) & 0xFF;
+        int32_t g = (frame[i] >> 8) & 0xFF;
+        int32_t b = frame[i] & 0xFF;
+        y_plane[i] = (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+        u_plane[i] = (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+        v_plane[i] = (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+    }
+}
+
+
+bool
+export_write_frame(struct FrameExporter *exporter, uint32_t frame_index, const uint8_t *frame)
+{
+    if (exporter->format == EXPORT_PPM)
+    {
+        struct SDLOffscreenBuffer buffer = {0};
+        buffer.memory = (void *)frame;
+        buffer.width = exporter->width;
+        buffer.height = exporter->height;
+        buffer.pitch = exporter->width * TR_BYTES_PER_PIXEL;
+
+        char path[TR_MAX_PATH];
+        snprintf(path, sizeof(path), "%s/frame-%05u.ppm", exporter->path, frame_index);
+        return frame_write_ppm(buffer, path);
+    }
+
+    export_convert_y4m(exporter, (const uint32_t *)frame);
+    size_t plane_bytes = 3 * (size_t)exporter->width * exporter->height;
+    if (fputs("FRAME\n", exporter->file) == EOF
+            || fwrite(exporter->planes, 1, plane_bytes, exporter->file) != plane_bytes)
+    {
+        TR_LOG_ERR("Couldn't write %s: %s\n", exporter->path, strerror(errno));
+        return false;
+    }
+    return true;
 }
 
 
-void
-sdl_open_game_controllers()
-{
-    int32_t num_joysticks = SDL_NumJoysticks();
-    for (int32_t controller_index = 0; controller_index < num_joysticks; ++controller_index)
+int
+export_writer_thread(void *data)
+{
+    struct FrameExporter *exporter = (struct FrameExporter *)data;
+
+    for (uint32_t frame_index = 0; ; ++frame_index)
+    {
+        SDL_SemWait(exporter->ready_frames);
+        // NOTE: The renderer posts once more than it renders, to wake us
+        // up when it's done.
+        if ((int32_t)frame_index >= SDL_AtomicGet(&exporter->rendered))
+        {
+            break;
+        }
+
+        // After a write error keep draining the ring, so the renderer
+        // doesn't wait forever, but don't try to write anything else.
+        if (!SDL_AtomicGet(&exporter->failed)
+                && !export_write_frame(exporter, frame_index, exporter->frames[frame_index % TR_EXPORT_RING_SIZE]))
+        {
+            SDL_AtomicSet(&exporter->failed, 1);
+        }
+        SDL_SemPost(exporter->free_frames);
+    }
+    return 0;
+}
+
+
+void
+export_close(struct FrameExporter *exporter)
+{
+    if (exporter->writer)
+    {
+        SDL_SemPost(exporter->ready_frames);
+        SDL_WaitThread(exporter->writer, 0);
+        exporter->writer = 0;
+    }
+    if (exporter->file && fclose(exporter->file) != 0)
+    {
+        TR_LOG_ERR("Couldn't write %s: %s\n", exporter->path, strerror(errno));
+        SDL_AtomicSet(&exporter->failed, 1);
+    }
+    exporter->file = 0;
+    for (uint32_t i = 0; i < TR_EXPORT_RING_SIZE; ++i)
+    {
+        free(exporter->frames[i]);
+        exporter->frames[i] = 0;
+    }
+    free(exporter->planes);
+    exporter->planes = 0;
+    if (exporter->free_frames)
+    {
+        SDL_DestroySemaphore(exporter->free_frames);
+        exporter->free_frames = 0;
+    }
+    if (exporter->ready_frames)
+    {
+        SDL_DestroySemaphore(exporter->ready_frames);
+        exporter->ready_frames = 0;
+    }
+}
+
+
+bool
+export_open(struct FrameExporter *exporter, const char *path, uint32_t width, uint32_t height, uint32_t fps)
+{
+    memset(exporter, 0, sizeof(*exporter));
+    size_t path_length = strlen(path);
+    exporter->format = path_length > 4 && strcmp(path + path_length - 4, ".y4m") == 0 ? EXPORT_Y4M : EXPORT_PPM;
+    exporter->path = path;
+    exporter->width = width;
+    exporter->height = height;
+    exporter->fps = fps;
+
+    if (exporter->format == EXPORT_Y4M)
+    {
+        exporter->file = fopen(path, "wb");
+        if (!exporter->file)
+        {
+            TR_LOG_ERR("Couldn't open %s for writing: %s\n", path, strerror(errno));
+            return false;
+        }
+        fprintf(exporter->file, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C444\n", width, height, fps);
+        exporter->planes = malloc(3 * (size_t)width * height);
+    }
+    else
+    {
+        char dir[TR_MAX_PATH];
+        snprintf(dir, sizeof(dir), "%s", path);
+        if (!make_directories(dir))
+        {
+            TR_LOG_ERR("Couldn't create %s: %s\n", path, strerror(errno));
+            return false;
+        }
+    }
+
+    bool ok = exporter->format == EXPORT_PPM || exporter->planes;
+    for (uint32_t i = 0; i < TR_EXPORT_RING_SIZE; ++i)
+    {
+        exporter->frames[i] = malloc((size_t)width * height * TR_BYTES_PER_PIXEL);
+        ok = ok && exporter->frames[i];
+    }
+    if (!ok)
+    {
+        TR_LOG_ERR("Export: out of memory at %ux%u\n", width, height);
+        export_close(exporter);
+        return false;
+    }
+
+    exporter->free_frames = SDL_CreateSemaphore(TR_EXPORT_RING_SIZE);
+    exporter->ready_frames = SDL_CreateSemaphore(0);
+    if (!exporter->free_frames || !exporter->ready_frames)
+    {
+        TR_LOG_ERR("SDL_CreateSemaphore failed: %s\n", SDL_GetError());
+        export_close(exporter);
+        return false;
+    }
+
+    exporter->writer = SDL_CreateThread(export_writer_thread, "tr_export", exporter);
+    if (!exporter->writer)
+    {
+        TR_LOG_ERR("SDL_CreateThread failed: %s\n", SDL_GetError());
+        export_close(exporter);
+        return false;
+    }
+    return true;
+}
+
+
+// Render `frame_count` frames at `fps` without a window, flying forward
+// through the tunnel or following the input log being replayed, and write
+// them to `path`: a Y4M file if it ends in .y4m, otherwise a directory of
+// PPM images. Renders as fast as the machine allows.
+int
+run_export(const char *path, int32_t width, int32_t height, uint32_t fps, uint32_t frame_count, enum TexturePattern texture_choice)
+{
+    struct FrameExporter exporter;
+    if (!export_open(&exporter, path, (uint32_t)width, (uint32_t)height, fps))
+    {
+        return EXIT_FAILURE;
+    }
+
+    global_back_buffer.width = width;
+    global_back_buffer.height = height;
+    global_back_buffer.pitch = width * TR_BYTES_PER_PIXEL;
+    global_back_buffer.scale = 1.0f;
+    if (tunnel_engine == ENGINE_TABLE && !transform_build(&transform, width, height, 1.0f, &global_thread_pool, 0))
+    {
+        export_close(&exporter);
+        return EXIT_FAILURE;
+    }
+    simulation_init(&global_simulation, texture_choice);
+
+    struct InputState forward = {0};
+    forward.key_w = true;
+
+    uint64_t start_ns = get_current_time_ns();
+    uint64_t updates = 0;
+    uint32_t frame = 0;
+    bool input_left = true;
+    for (; frame < frame_count && input_left && !SDL_AtomicGet(&exporter.failed); ++frame)
     {
-        if (!SDL_IsGameController(controller_index))
+        // Step the simulation up to this frame's time.
+        uint64_t target_updates = (uint64_t)(frame + 1) * TR_UPDATES_PER_SECOND / fps;
+        for (; updates < target_updates; ++updates)
         {
-            continue;
+            struct InputState input = forward;
+            if (input_log.replaying && !input_log_read(&input_log, &input))
+            {
+                input_left = false;
+                break;
+            }
+            simulation_update(&global_simulation.state, &input);
         }
+        const struct SimState *state = &global_simulation.state;
 
-        if (controller_index >= TR_MAX_CONTROLLERS)
+        if (SDL_SemTryWait(exporter.free_frames) != 0)
         {
-            break;
+            ++exporter.render_waits;
+            SDL_SemWait(exporter.free_frames);
         }
+        global_back_buffer.memory = exporter.frames[frame % TR_EXPORT_RING_SIZE];
 
-        controller_handles[controller_index] = SDL_GameControllerOpen(controller_index);
-        rumble_handles[controller_index] = SDL_HapticOpen(controller_index);
+        transform_set_look(&transform, global_back_buffer, state->look_x, state->look_y);
+        tunnel_shape_update(&tunnel_shape, &state->shape, state->tick, global_back_buffer, state->look_x, state->look_y);
+        texture_select(&global_texture, state->texture_choice);
+        texture_animate(&global_texture, state->tick / TR_TEXTURE_STEPS_PER_FRAME);
+        texture_colorize(&global_texture, &global_palette, state->color_choice, state->palette_phase);
+        delta_render(&global_delta_renderer, &global_thread_pool, global_back_buffer, &global_texture, state->rotation_offset, state->translation_offset);
 
-        if (rumble_handles[controller_index] && SDL_HapticRumbleInit(rumble_handles[controller_index]) != 0)
-        {
-            SDL_HapticClose(rumble_handles[controller_index]);
-            rumble_handles[controller_index] = 0;
-        }
+        SDL_AtomicIncRef(&exporter.rendered);
+        SDL_SemPost(exporter.ready_frames);
     }
-}
 
+    export_close(&exporter);
+    global_back_buffer.memory = 0;
+    transform_free(&transform);
+    delta_renderer_free(&global_delta_renderer);
 
-void
-sdl_close_game_controllers()
-{
-    for (int32_t controller_index = 0; controller_index < TR_MAX_CONTROLLERS; ++controller_index)
+    if (SDL_AtomicGet(&exporter.failed))
     {
-        if (controller_handles[controller_index])
-        {
-            SDL_GameControllerClose(controller_handles[controller_index]);
-        }
+        return EXIT_FAILURE;
     }
-}
 
+    double seconds = (double)(get_current_time_ns() - start_ns) / TR_SECOND;
+    printf("Exported %u frames at %dx%d to %s in %.3f s (%.1f fps, %.1fx real time), renderer waited on the writer %" PRIu64 " times\n",
+            frame, width, height, path, seconds, frame / seconds, frame / seconds / fps, exporter.render_waits);
+    return 0;
+}
 
 void
-sdl_cleanup(void)
+usage(const char *program_name)
 {
-    TR_LOG_DBG("Cleaning up...\n");
-    sdl_close_game_controllers();
-    SDL_Quit();
+    printf("usage: %s [options]\n", program_name);
+    printf("\n");
+    printf("options:\n");
+    printf("-h, --help                show help\n");
+    printf("--bench                   render offscreen and report frame times\n");
+    printf("--frames N                frames per resolution in bench mode (default %d), or to export\n", TR_BENCH_DEFAULT_FRAMES);
+    printf("--size WxH                bench resolution, may be repeated, or export resolution\n");
+    printf("--export PATH             render frames without a window to PATH.y4m or a directory of PPMs\n");
+    printf("--threads N               render threads, 0 for one per core (default 0)\n");
+    printf("--kernel NAME             force a tunnel kernel (scalar, sse2, avx2, neon)\n");
+#ifdef TR_MICROBENCH
+    printf("--microbench PATH         time each hot function with perf counters, results as JSON to PATH\n");
+#endif
+    printf("--selftest                check the vector kernels against the scalar one\n");
+    printf("--check                   render fixed frames along every path and compare them\n");
+    printf("--check-dump DIR          also write the reference frames to DIR as PPM images\n");
+    printf("--engine NAME             table (look up the tables) or shape (per-pixel geometry) (default table)\n");
+    printf("--tables LAYOUT           quadrant (1x the window) or full (4x) tables (default quadrant)\n");
+    printf("--texels LAYOUT           colorized (32-bit rows) or morton (8-bit Z-order) texels (default colorized)\n");
+    printf("--redraw MODE             delta (skip unchanged frames, reuse texel indices) or always (default delta)\n");
+    printf("--no-cache                don't read or write the transform table cache\n");
+    printf("--sync-resize             rebuild tables on the main thread when resized\n");
+    printf("--displays N              a fullscreen window on each of the first N displays, 0 for all\n");
+    printf("--scale S                 render at S times the window size, or auto (default 1)\n");
+    printf("--upscale FILTER          nearest or linear stretching to the window (default linear)\n");
+    printf("--present MODE            lock (render into the texture) or update (copy)\n");
+    printf("--texture NAME            xor, mosaic, checker, noise or plasma (default xor)\n");
+    printf("--texture-file PATH       start with an image (BMP) as the texture\n");
+    printf("--pacing MODE             vsync, spin (sleep then spin), or uncapped (default spin)\n");
+    printf("--fps N                   frame rate for spin pacing (default %d)\n", TR_FPS);
+    printf("--record PATH             write the input for every update to PATH\n");
+    printf("--replay PATH             replay input from PATH and print a hash of the frames\n");
+    printf("--profile PREFIX          time each frame stage, write PREFIX.csv and PREFIX.json on exit\n");
+    printf("--overlay                 time each frame stage and draw them over the tunnel (P toggles)\n");
 }
 
 
 int
-main(void)
+main(int argc, char *argv[])
 {
+    bool bench = false;
+    // NOTE: 0 picks the default for the mode.
+    uint32_t bench_frames = 0;
+    int32_t bench_sizes[TR_BENCH_MAX_SIZES][2];
+    uint32_t bench_size_count = 0;
+    uint32_t thread_count = 0;
+    const char *kernel_name = 0;
+    enum TexelLayout texel_layout = TEXELS_COLORIZED;
+    bool selftest = false;
+#ifdef TR_MICROBENCH
+    const char *microbench_path = 0;
+#endif
+    bool check = false;
+    const char *check_dump_dir = 0;
+    bool sync_resize = false;
+    enum PacingMode pacing_mode = PACING_SPIN;
+    enum TexturePattern texture_pattern = TEXTURE_XOR;
+    const char *texture_path = 0;
+    bool dynamic_scale = false;
+    bool displays = false;
+    uint32_t display_count = 0;
+    bool upscale_linear = true;
+    uint32_t target_fps = TR_FPS;
+    const char *profile_prefix = 0;
+    bool profile_overlay = false;
+    const char *record_path = 0;
+    const char *replay_path = 0;
+    const char *export_path = 0;
+
+    for (int32_t i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0)
+        {
+            usage(argv[0]);
+            return 0;
+        }
+        else if (strcmp(argv[i], "--bench") == 0)
+        {
+            bench = true;
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+        {
+            bench_frames = (uint32_t)strtoul(argv[++i], 0, 10);
+        }
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+        {
+            int32_t w = 0;
+            int32_t h = 0;
+            if (sscanf(argv[++i], "%" SCNd32 "x%" SCNd32, &w, &h) != 2 || w <= 0 || h <= 0)
+            {
+                TR_LOG_ERR("Invalid size: %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            if (bench_size_count < TR_BENCH_MAX_SIZES)
+            {
+                bench_sizes[bench_size_count][0] = w;
+                bench_sizes[bench_size_count][1] = h;
+                ++bench_size_count;
+            }
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            thread_count = (uint32_t)strtoul(argv[++i], 0, 10);
+        }
+        else if (strcmp(argv[i], "--kernel") == 0 && i + 1 < argc)
+        {
+            kernel_name = argv[++i];
+        }
+#ifdef TR_MICROBENCH
+        else if (strcmp(argv[i], "--microbench") == 0 && i + 1 < argc)
+        {
+            microbench_path = argv[++i];
+        }
+#endif
+        else if (strcmp(argv[i], "--selftest") == 0)
+        {
+            selftest = true;
+        }
+        else if (strcmp(argv[i], "--check") == 0)
+        {
+            check = true;
+        }
+        else if (strcmp(argv[i], "--check-dump") == 0 && i + 1 < argc)
+        {
+            check = true;
+            check_dump_dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc)
+        {
+            const char *engine = argv[++i];
+            if (strcmp(engine, "table") == 0)
+            {
+                tunnel_engine = ENGINE_TABLE;
+            }
+            else if (strcmp(engine, "shape") == 0)
+            {
+                tunnel_engine = ENGINE_SHAPE;
+            }
+            else
+            {
+                TR_LOG_ERR("Invalid engine: %s\n", engine);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--tables") == 0 && i + 1 < argc)
+        {
+            const char *layout = argv[++i];
+            if (strcmp(layout, "quadrant") == 0)
+            {
+                transform_layout = TRANSFORM_QUADRANT;
+            }
+            else if (strcmp(layout, "full") == 0)
+            {
+                transform_layout = TRANSFORM_FULL;
+            }
+            else
+            {
+                TR_LOG_ERR("Invalid table layout: %s\n", layout);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--redraw") == 0 && i + 1 < argc)
+        {
+            const char *redraw = argv[++i];
+            if (strcmp(redraw, "delta") == 0)
+            {
+                global_delta_renderer.enabled = true;
+            }
+            else if (strcmp(redraw, "always") == 0)
+            {
+                global_delta_renderer.enabled = false;
+            }
+            else
+            {
+                TR_LOG_ERR("Invalid redraw mode: %s\n", redraw);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--displays") == 0 && i + 1 < argc)
+        {
+            displays = true;
+            display_count = (uint32_t)strtoul(argv[++i], 0, 10);
+        }
+        else if (strcmp(argv[i], "--texels") == 0 && i + 1 < argc)
+        {
+            const char *layout = argv[++i];
+            if (strcmp(layout, "colorized") == 0)
+            {
+                texel_layout = TEXELS_COLORIZED;
+            }
+            else if (strcmp(layout, "morton") == 0)
+            {
+                texel_layout = TEXELS_MORTON;
+            }
+            else
+            {
+                TR_LOG_ERR("Invalid texel layout: %s\n", layout);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--no-cache") == 0)
+        {
+            transform_cache_enabled = false;
+        }
+        else if (strcmp(argv[i], "--sync-resize") == 0)
+        {
+            sync_resize = true;
+        }
+        else if (strcmp(argv[i], "--texture") == 0 && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            int32_t pattern = 0;
+            while (pattern < TEXTURE_IMAGE && strcmp(name, texture_pattern_name((enum TexturePattern)pattern)) != 0)
+            {
+                ++pattern;
+            }
+            if (pattern == TEXTURE_IMAGE)
+            {
+                TR_LOG_ERR("Invalid texture: %s\n", name);
+                return EXIT_FAILURE;
+            }
+            texture_pattern = (enum TexturePattern)pattern;
+        }
+        else if (strcmp(argv[i], "--texture-file") == 0 && i + 1 < argc)
+        {
+            texture_path = argv[++i];
+            texture_pattern = TEXTURE_IMAGE;
+        }
+        else if (strcmp(argv[i], "--pacing") == 0 && i + 1 < argc)
+        {
+            const char *mode = argv[++i];
+            if (strcmp(mode, "vsync") == 0)
+            {
+                pacing_mode = PACING_VSYNC;
+            }
+            else if (strcmp(mode, "spin") == 0)
+            {
+                pacing_mode = PACING_SPIN;
+            }
+            else if (strcmp(mode, "uncapped") == 0)
+            {
+                pacing_mode = PACING_UNCAPPED;
+            }
+            else
+            {
+                TR_LOG_ERR("Invalid pacing mode: %s\n", mode);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc)
+        {
+            target_fps = (uint32_t)strtoul(argv[++i], 0, 10);
+        }
+        else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc)
+        {
+            const char *scale = argv[++i];
+            if (strcmp(scale, "auto") == 0)
+            {
+                dynamic_scale = true;
+            }
+            else
+            {
+                render_scale = strtof(scale, 0);
+                if (!(render_scale > 0.0f && render_scale <= 1.0f))
+                {
+                    TR_LOG_ERR("Invalid scale: %s\n", scale);
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--upscale") == 0 && i + 1 < argc)
+        {
+            const char *filter = argv[++i];
+            if (strcmp(filter, "nearest") == 0)
+            {
+                upscale_linear = false;
+            }
+            else if (strcmp(filter, "linear") == 0)
+            {
+                upscale_linear = true;
+            }
+            else
+            {
+                TR_LOG_ERR("Invalid upscale filter: %s\n", filter);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+        {
+            profile_prefix = argv[++i];
+        }
+        else if (strcmp(argv[i], "--overlay") == 0)
+        {
+            profile_overlay = true;
+        }
+        else if (strcmp(argv[i], "--export") == 0 && i + 1 < argc)
+        {
+            export_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+        {
+            record_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+        {
+            replay_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--present") == 0 && i + 1 < argc)
+        {
+            const char *mode = argv[++i];
+            if (strcmp(mode, "lock") == 0)
+            {
+                present_mode = PRESENT_LOCK;
+            }
+            else if (strcmp(mode, "update") == 0)
+            {
+                present_mode = PRESENT_UPDATE;
+            }
+            else
+            {
+                TR_LOG_ERR("Invalid present mode: %s\n", mode);
+                return EXIT_FAILURE;
+            }
+        }
+        else
+        {
+            TR_LOG_ERR("Unknown option: %s\n", argv[i]);
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!select_tunnel_kernel(kernel_name))
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (selftest)
+    {
+        return run_selftest();
+    }
+
+    if (record_path && replay_path)
+    {
+        TR_LOG_ERR("--record and --replay can't be used together\n");
+        return EXIT_FAILURE;
+    }
+
+    if (displays && dynamic_scale)
+    {
+        TR_LOG_ERR("--scale auto can't be used with --displays\n");
+        return EXIT_FAILURE;
+    }
+
+    if (texel_layout == TEXELS_MORTON && tunnel_engine == ENGINE_SHAPE)
+    {
+        TR_LOG_ERR("--texels morton needs the table engine\n");
+        return EXIT_FAILURE;
+    }
+
+    if (export_path)
+    {
+        if (replay_path && !input_log_open(&input_log, replay_path, true, &texture_pattern))
+        {
+            return EXIT_FAILURE;
+        }
+        texture_init(&global_texture);
+        texture_set_layout(&global_texture, texel_layout);
+        if (texture_path && !texture_load_image(&global_texture, texture_path))
+        {
+            return EXIT_FAILURE;
+        }
+        if (target_fps == 0)
+        {
+            target_fps = TR_FPS;
+        }
+
+        thread_pool_init(&global_thread_pool, thread_count);
+        int result = run_export(export_path,
+                bench_size_count ? bench_sizes[0][0] : TR_SCREEN_WIDTH,
+                bench_size_count ? bench_sizes[0][1] : TR_SCREEN_HEIGHT,
+                target_fps, bench_frames ? bench_frames : TR_EXPORT_DEFAULT_SECONDS * target_fps, texture_pattern);
+        input_log_close(&input_log);
+        thread_pool_shutdown(&global_thread_pool);
+        return result;
+    }
+
+    thread_pool_init(&global_thread_pool, thread_count);
+
+#ifdef TR_MICROBENCH
+    if (microbench_path)
+    {
+        int result = run_microbench(microbench_path,
+                bench_size_count ? bench_sizes[0][0] : 1920,
+                bench_size_count ? bench_sizes[0][1] : 1080,
+                bench_frames ? bench_frames : TR_MICROBENCH_RENDER_ITERATIONS);
+        thread_pool_shutdown(&global_thread_pool);
+        return result;
+    }
+#endif
+
+    if (check)
+    {
+        int result = run_check(check_dump_dir);
+        thread_pool_shutdown(&global_thread_pool);
+        return result;
+    }
+
+    if (bench)
+    {
+        if (bench_size_count == 0)
+        {
+            int32_t default_sizes[][2] = {
+                { 640, 480 },
+                { 1280, 720 },
+                { 1920, 1080 },
+                { 2560, 1440 },
+                { 3840, 2160 },
+            };
+            bench_size_count = sizeof(default_sizes) / sizeof(default_sizes[0]);
+            memcpy(bench_sizes, default_sizes, sizeof(default_sizes));
+        }
+        if (bench_frames == 0)
+        {
+            bench_frames = TR_BENCH_DEFAULT_FRAMES;
+        }
+        int result = run_benchmark(bench_sizes, bench_size_count, bench_frames);
+        thread_pool_shutdown(&global_thread_pool);
+        return result;
+    }
+
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_GAMECONTROLLER | SDL_INIT_HAPTIC) != 0)
     {
         TR_LOG_ERR("SDL_Init failed: %s\n", SDL_GetError());
@@ -434,193 +7814,173 @@ main(void)
     // controllers!
     atexit(sdl_cleanup);
 
+    if (displays)
+    {
+        // NOTE: Read by SDL when each texture is created, so this picks
+        // the filter SDL_RenderCopy stretches the back buffers with.
+        SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, upscale_linear ? "linear" : "nearest");
+        session_start(texture_path, texel_layout, profile_prefix, profile_overlay, record_path, replay_path, texture_pattern);
+        run_displays(display_count, pacing_mode, target_fps);
+        return 0;
+    }
+
     SDL_Window *window = SDL_CreateWindow(
             "Tunnel Runner",
             SDL_WINDOWPOS_UNDEFINED,
             SDL_WINDOWPOS_UNDEFINED,
             TR_SCREEN_WIDTH,
             TR_SCREEN_HEIGHT,
-            0);
+            SDL_WINDOW_RESIZABLE);
 
     if (window)
     {
-        SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, 0);
+        uint32_t renderer_flags = pacing_mode == PACING_VSYNC ? SDL_RENDERER_PRESENTVSYNC : 0;
+        SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, renderer_flags);
 
         if (renderer)
         {
-            struct SDLWindowDimension dimension = sdl_get_window_dimension(window);
-            sdl_resize_texture(&global_back_buffer, renderer, dimension.width, dimension.height);
+            // NOTE: Read by SDL when each texture is created, so this picks
+            // the filter SDL_RenderCopy stretches the back buffer with.
+            SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, upscale_linear ? "linear" : "nearest");
 
-            uint32_t texture[TR_TEX_HEIGHT][TR_TEX_WIDTH];
+            struct SDLWindowDimension dimension = sdl_get_window_dimension(window);
+            if (!sdl_resize_texture(&global_back_buffer, renderer, dimension.width, dimension.height, render_scale))
+            {
+                exit(EXIT_FAILURE);
+            }
 
-            for (int32_t y = 0; y < TR_TEX_HEIGHT; ++y)
+            if (!sync_resize)
             {
-                for (int32_t x = 0; x < TR_TEX_WIDTH; ++x)
-                {
-                    // XOR texture:
-                    texture[y][x] = (x * 256 / TR_TEX_WIDTH) ^ (y * 256 / TR_TEX_HEIGHT);
-                    // Mosaic texture:
-                    //texture[y][x] = (x * x * y * y);
-                }
+                transform_rebuilder_init(&transform_rebuilder);
             }
 
-            bool running = true;
-            int32_t rotation_offset = 0;
-            int32_t translation_offset = 0;
-            enum Color color_choice = COLOR_WHITE;
+            session_start(texture_path, texel_layout, profile_prefix, profile_overlay, record_path, replay_path, texture_pattern);
 
-            uint64_t lag = 0;
-            uint64_t previous_ms = get_current_time_ms();
+            frame_pacer_init(&global_frame_pacer, pacing_mode, target_fps);
+            if (dynamic_scale)
+            {
+                dynamic_scale_init(&global_dynamic_scale, global_frame_pacer.frame_ns);
+            }
 
+            bool running = true;
             while (running)
             {
-                uint64_t current_ms = get_current_time_ms();
-                uint64_t elapsed_ms = current_ms - previous_ms;
-                previous_ms = current_ms;
-                lag += elapsed_ms;
-                TR_LOG_FRM("Lag: %d\n", lag);
+                uint64_t frame_start_ns = get_current_time_ns();
 
-                TR_LOG_FRM("%" PRIu64 ", %f\n", lag, TR_MS_PER_UPDATE);
-                // TODO: I don't think we need determinism
-                while (lag >= TR_MS_PER_UPDATE)
+                // NOTE: Events must be pumped on the main thread, and the
+                // keyboard and controller state they update is sampled here
+                // too, for the simulation thread to pick up.
+                uint64_t stage_start_ns = profile_begin();
+                SDL_Event event;
+                while (SDL_PollEvent(&event))
                 {
-                    SDL_Event event;
+                    if (handle_event(&event))
+                    {
+                        running = false;
+                    }
+                }
+                simulation_post_input(&global_simulation);
+                profile_end(PROFILE_TRACK_MAIN, PROFILE_EVENTS, stage_start_ns);
 
-                    while (SDL_PollEvent(&event))
+                const struct SimState *state = 0;
+                if (input_log.replaying)
+                {
+                    if (!simulation_replay_frame(&global_simulation, &input_log))
                     {
-                        running = !handle_event(&event);
+                        running = false;
                     }
+                    state = &global_simulation.state;
+                }
+                else
+                {
+                    state = triple_buffer_read(&global_simulation.states);
+                }
+                if (state->quit)
+                {
+                    running = false;
+                }
+                sdl_update_rumble(state);
 
-                    SDL_PumpEvents();
+                stage_start_ns = profile_begin();
+                transform_rebuilder_poll(&transform_rebuilder, &global_back_buffer, renderer);
+                transform_set_look(&transform, global_back_buffer, state->look_x, state->look_y);
+                tunnel_shape_update(&tunnel_shape, &state->shape, state->tick, global_back_buffer, state->look_x, state->look_y);
+                profile_end(PROFILE_TRACK_MAIN, PROFILE_TABLES, stage_start_ns);
 
-                    dimension = sdl_get_window_dimension(window);
+                stage_start_ns = profile_begin();
+                texture_select(&global_texture, state->texture_choice);
+                texture_animate(&global_texture, state->tick / TR_TEXTURE_STEPS_PER_FRAME);
+                texture_colorize(&global_texture, &global_palette, state->color_choice, state->palette_phase);
+                profile_end(PROFILE_TRACK_MAIN, PROFILE_TEXTURE, stage_start_ns);
 
-                    const uint8_t *keystate = SDL_GetKeyboardState(0);
+                // NOTE: Replays hash every frame, so they never skip one.
+                struct FrameKey key = frame_key_current(global_back_buffer, &global_texture, state->rotation_offset, state->translation_offset);
+                if (!input_log.replaying && delta_renderer_unchanged(&global_delta_renderer, &key))
+                {
+                    stage_start_ns = profile_begin();
+                    frame_pacer_idle(&global_frame_pacer);
+                    profile_end(PROFILE_TRACK_MAIN, PROFILE_WAIT, stage_start_ns);
+                    profile_next_frame(PROFILE_TRACK_MAIN);
+                    continue;
+                }
 
-                    if (keystate[SDL_SCANCODE_A])
-                    {
-                        rotation_offset -= TR_MOVEMENT_SPEED;
-                    }
-                    if (keystate[SDL_SCANCODE_D])
-                    {
-                        rotation_offset += TR_MOVEMENT_SPEED;
-                    }
-                    if (keystate[SDL_SCANCODE_W])
-                    {
-                        translation_offset += TR_MOVEMENT_SPEED;
-                    }
-                    if (keystate[SDL_SCANCODE_S])
-                    {
-                        translation_offset -= TR_MOVEMENT_SPEED;
-                    }
-                    if (keystate[SDL_SCANCODE_LEFT])
-                    {
-                        rotation_offset --;
-                    }
-                    if (keystate[SDL_SCANCODE_RIGHT])
-                    {
-                        rotation_offset ++;
-                    }
-                    if (keystate[SDL_SCANCODE_UP])
-                    {
-                        translation_offset ++;
-                    }
-                    if (keystate[SDL_SCANCODE_DOWN])
+                struct SDLOffscreenBuffer target = global_back_buffer;
+                bool locked = false;
+                if (present_mode == PRESENT_LOCK)
+                {
+                    locked = sdl_lock_back_buffer(global_back_buffer, &target);
+                    if (!locked)
                     {
-                        translation_offset --;
+                        TR_LOG_ERR("SDL_LockTexture failed, falling back to SDL_UpdateTexture: %s\n", SDL_GetError());
+                        present_mode = PRESENT_UPDATE;
                     }
+                }
 
+                stage_start_ns = profile_begin();
+                delta_render(&global_delta_renderer, &global_thread_pool, target, &global_texture, state->rotation_offset, state->translation_offset);
+                //render_texture(target, &global_texture, state->rotation_offset, state->translation_offset);
+                profile_end(PROFILE_TRACK_MAIN, PROFILE_RENDER, stage_start_ns);
+                if (input_log.replaying)
+                {
+                    input_log.frame_hash = frame_hash(target, input_log.frame_hash);
+                    input_log.frames++;
+                }
+                profile_draw_overlay(target, global_frame_pacer.frame_ns);
 
-                    for (int32_t controller_index = 0; controller_index < TR_MAX_CONTROLLERS; ++controller_index)
-                    {
-                        if (SDL_GameControllerGetAttached(controller_handles[controller_index]))
-                        {
-                            bool start = SDL_GameControllerGetButton(controller_handles[controller_index], SDL_CONTROLLER_BUTTON_START);
-                            bool back = SDL_GameControllerGetButton(controller_handles[controller_index], SDL_CONTROLLER_BUTTON_BACK);
-                            bool a_button = SDL_GameControllerGetButton(controller_handles[controller_index], SDL_CONTROLLER_BUTTON_A);
-                            bool b_button = SDL_GameControllerGetButton(controller_handles[controller_index], SDL_CONTROLLER_BUTTON_B);
-                            bool x_button = SDL_GameControllerGetButton(controller_handles[controller_index], SDL_CONTROLLER_BUTTON_X);
-                            bool y_button = SDL_GameControllerGetButton(controller_handles[controller_index], SDL_CONTROLLER_BUTTON_Y);
-                            bool left_shoulder = SDL_GameControllerGetButton(controller_handles[controller_index], SDL_CONTROLLER_BUTTON_LEFTSHOULDER);
-                            bool right_shoulder = SDL_GameControllerGetButton(controller_handles[controller_index], SDL_CONTROLLER_BUTTON_RIGHTSHOULDER);
-
-                            int16_t stick_leftx = SDL_GameControllerGetAxis(controller_handles[controller_index], SDL_CONTROLLER_AXIS_LEFTX);
-                            int16_t stick_lefty = SDL_GameControllerGetAxis(controller_handles[controller_index], SDL_CONTROLLER_AXIS_LEFTY);
-                            int16_t stick_rightx = SDL_GameControllerGetAxis(controller_handles[controller_index], SDL_CONTROLLER_AXIS_RIGHTX);
-                            int16_t stick_righty = SDL_GameControllerGetAxis(controller_handles[controller_index], SDL_CONTROLLER_AXIS_RIGHTY);
-
-                            if (start)
-                            {
-                                SDL_HapticRumblePlay(rumble_handles[controller_index], 0.5f, 2000);
-                                color_choice = '\0';
-                            }
-                            else
-                            {
-                                SDL_HapticRumbleStop(rumble_handles[controller_index]);
-                            }
-
-                            if (back)
-                            {
-                                running = false;
-                            }
-
-                            // NOTE: Buttons select colors.
-                            if (a_button)
-                            {
-                                color_choice = COLOR_GREEN;
-                            }
-                            if (b_button)
-                            {
-                                color_choice = COLOR_RED;
-                            }
-                            if (x_button)
-                            {
-                                color_choice = COLOR_BLUE;
-                            }
-                            if (y_button)
-                            {
-                                color_choice = COLOR_YELLOW;
-                            }
-                            if (left_shoulder)
-                            {
-                                color_choice = COLOR_MAGENTA;
-                            }
-                            if (right_shoulder)
-                            {
-                                color_choice = COLOR_CYAN;
-                            }
-
-                            rotation_offset += stick_leftx / 5000;
-                            translation_offset -= stick_lefty / 5000;
-
-                            int32_t dampened_x_max = dimension.width / 2;
-                            int32_t dampened_x_min = -(dimension.width / 2);
-                            int32_t dampened_y_max = dimension.height / 2;
-                            int32_t dampened_y_min = -(dimension.height / 2);
-
-                            int32_t dampened_x = (stick_rightx - TR_CONTROLLER_STICK_MIN) * (dampened_x_max - dampened_x_min) / (TR_CONTROLLER_STICK_MAX - TR_CONTROLLER_STICK_MIN) + dampened_x_min;
-                            int32_t dampened_y = (stick_righty - TR_CONTROLLER_STICK_MIN) * (dampened_y_max - dampened_y_min) / (TR_CONTROLLER_STICK_MAX - TR_CONTROLLER_STICK_MIN) + dampened_y_min;
-
-                            transform.look_shift_x = dimension.width / 2 + dampened_x;
-                            transform.look_shift_y = dimension.height / 2 + dampened_y;
-                            TR_LOG_FRM("dimension.width / 2: %d\t damp_x: %d\t raw_x: %d\n", dimension.width / 2, dampened_x, stick_rightx);
-                            TR_LOG_FRM("dimension.height / 2: %d\t damp_y: %d\t raw_y: %d\n", dimension.height / 2, dampened_y, stick_righty);
-                        }
-                    }
-                    TR_LOG_FRM("%d, %d\n", translation_offset, rotation_offset);
+                uint64_t frame_work_ns = get_current_time_ns() - frame_start_ns;
 
-                    TR_LOG_FRM("\t%" PRIu64 ", %f\n", lag, TR_MS_PER_UPDATE);
-                    //render_tunnel(global_back_buffer, texture, rotation_offset, translation_offset, color_choice);
-                    lag -= TR_MS_PER_UPDATE;
+                if (locked)
+                {
+                    stage_start_ns = profile_begin();
+                    SDL_UnlockTexture(global_back_buffer.texture);
+                    profile_end(PROFILE_TRACK_MAIN, PROFILE_UPLOAD, stage_start_ns);
+
+                    stage_start_ns = profile_begin();
+                    frame_pacer_wait(&global_frame_pacer);
+                    profile_end(PROFILE_TRACK_MAIN, PROFILE_WAIT, stage_start_ns);
+                    sdl_present(renderer, global_back_buffer);
+                    present_stats_record(PRESENT_LOCK, 0);
+                }
+                else
+                {
+                    stage_start_ns = profile_begin();
+                    frame_pacer_wait(&global_frame_pacer);
+                    profile_end(PROFILE_TRACK_MAIN, PROFILE_WAIT, stage_start_ns);
+                    sdl_update_window(renderer, global_back_buffer);
+                    present_stats_record(PRESENT_UPDATE, (uint64_t)global_back_buffer.pitch * global_back_buffer.height);
                 }
-                render_tunnel(global_back_buffer, texture, rotation_offset, translation_offset, color_choice);
-                //render_texture(global_back_buffer, texture, rotation_offset, translation_offset, color_choice);
-                sdl_update_window(renderer, global_back_buffer);
-                if (elapsed_ms <= TR_MS_PER_FRAME)
+                frame_pacer_frame_presented(&global_frame_pacer);
+                profile_next_frame(PROFILE_TRACK_MAIN);
+
+                if (dynamic_scale_update(&global_dynamic_scale, global_back_buffer.scale, frame_work_ns))
                 {
-                    SDL_Delay((TR_MS_PER_FRAME - elapsed_ms));
+                    render_scale = render_scale_levels[global_dynamic_scale.level];
+                    dimension = sdl_get_window_dimension(window);
+                    sdl_request_resize(renderer, dimension.width, dimension.height);
                 }
             }
+
+            simulation_stop(&global_simulation);
         }
         else
         {